@@ -0,0 +1,268 @@
+//
+// Microbenchmarks: sequential and random inserts, point lookups, full scans and
+// the flush on close, for a range of table sizes. Results go to stdout as JSON,
+// progress to stderr.
+//
+
+#include "db.h"
+#include <algorithm>
+#include <climits>
+#include <random>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_POOL_FRAMES 256
+#define BENCH_DEFAULT_LOOKUPS 200000
+#define BENCH_DEFAULT_SCANS 3
+#define BENCH_MAX_DATASETS 16
+
+/**
+ * rows lists the table sizes to run, smallest first. The defaults span a table
+ * that fits the buffer pool to one several times larger than it; pass larger
+ * --rows, or --pool-frames, to measure tables larger than the machine's memory.
+ */
+struct BenchConfig {
+    DbOptions options;
+    const char *path;
+    uint num_datasets;
+    uint rows[BENCH_MAX_DATASETS];
+    uint lookups;
+    uint scans;
+};
+
+/**
+ * the latency of every operation of one kind, in nanoseconds
+ */
+struct BenchResult {
+    const char *name;
+    uint64_t total_ns = 0;
+    std::vector<uint64_t> latencies{};
+};
+
+
+uint64_t now_ns() {
+    timespec time{};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+
+void bench_row(uint id, Row *row) {
+    row->id = id;
+    snprintf(row->username, sizeof(row->username), "user%u", id);
+    snprintf(row->email, sizeof(row->email), "user%u@example.com", id);
+}
+
+
+void bench_remove_files(const char *path) {
+    char wal_path[PATH_MAX];
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", path);
+    unlink(path);
+    unlink(wal_path);
+}
+
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, (size_t) (fraction * sorted.size()));
+    return sorted[index];
+}
+
+
+void print_result(BenchResult *result, bool last) {
+    std::vector<uint64_t> &latencies = result->latencies;
+    std::sort(latencies.begin(), latencies.end());
+    double seconds = result->total_ns / 1e9;
+    printf("        \"%s\": {\"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+           "\"latency_ns\": {\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}%s\n",
+           result->name, latencies.size(), seconds, seconds > 0 ? latencies.size() / seconds : 0.0,
+           (unsigned long) percentile(latencies, 0.5), (unsigned long) percentile(latencies, 0.9),
+           (unsigned long) percentile(latencies, 0.99), (unsigned long) percentile(latencies, 0.999),
+           (unsigned long) (latencies.empty() ? 0 : latencies.back()), last ? "" : ",");
+}
+
+
+void bench_inserts(Table *table, const std::vector<uint> &ids, BenchResult *result) {
+    Row row;
+    result->latencies.reserve(ids.size());
+    uint64_t start = now_ns();
+    for (uint id: ids) {
+        bench_row(id, &row);
+        uint64_t op_start = now_ns();
+        table_insert(table, &row);
+        result->latencies.push_back(now_ns() - op_start);
+    }
+    result->total_ns = now_ns() - start;
+}
+
+
+void bench_close(Table *table, BenchResult *result) {
+    uint64_t start = now_ns();
+    db_close(table);
+    result->total_ns = now_ns() - start;
+    result->latencies.push_back(result->total_ns);
+}
+
+
+void bench_lookups(Table *table, uint num_rows, uint count, std::mt19937 &random, BenchResult *result) {
+    std::uniform_int_distribution<uint> pick(1, num_rows);
+    Row row;
+    result->latencies.reserve(count);
+    uint64_t start = now_ns();
+    for (uint i = 0; i < count; i++) {
+        uint id = pick(random);
+        uint64_t op_start = now_ns();
+        if (!table_get(table, id, &row)) {
+            fprintf(stderr, "bench: row %u is missing\n", id);
+            exit(EXIT_FAILURE);
+        }
+        result->latencies.push_back(now_ns() - op_start);
+    }
+    result->total_ns = now_ns() - start;
+}
+
+
+/**
+ * each operation is one select of the whole table, printed to /dev/null
+ */
+void bench_scans(Table *table, uint count, BenchResult *result) {
+    Statement statement{};
+    statement.type = STATEMENT_SELECT;
+    statement.id_lo = 0;
+    statement.id_hi = UINT32_MAX;
+    statement.limit = UINT32_MAX;
+    statement.scan_mode = SCAN_SERIAL;
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1) {
+        fprintf(stderr, "bench: unable to open /dev/null\n");
+        exit(EXIT_FAILURE);
+    }
+    int saved_fd = table->output_fd;
+    table->output_fd = null_fd;
+    uint64_t start = now_ns();
+    for (uint i = 0; i < count; i++) {
+        uint64_t op_start = now_ns();
+        execute_select(&statement, table);
+        result->latencies.push_back(now_ns() - op_start);
+    }
+    result->total_ns = now_ns() - start;
+    table->output_fd = saved_fd;
+    close(null_fd);
+}
+
+
+void bench_dataset(const BenchConfig *config, uint num_rows, bool last) {
+    std::mt19937 random(num_rows);
+    std::vector<uint> ids(num_rows);
+    for (uint i = 0; i < num_rows; i++) {
+        ids[i] = i + 1;
+    }
+    BenchResult sequential{"sequential_insert"};
+    BenchResult close_after_insert{"close"};
+    BenchResult shuffled{"random_insert"};
+    BenchResult lookups{"point_lookup"};
+    BenchResult scans{"full_scan"};
+
+    fprintf(stderr, "bench: %u rows, sequential inserts\n", num_rows);
+    bench_remove_files(config->path);
+    Table *table = db_open(config->path, &config->options);
+    bench_inserts(table, ids, &sequential);
+    bench_close(table, &close_after_insert);
+
+    fprintf(stderr, "bench: %u rows, random inserts\n", num_rows);
+    std::shuffle(ids.begin(), ids.end(), random);
+    bench_remove_files(config->path);
+    table = db_open(config->path, &config->options);
+    bench_inserts(table, ids, &shuffled);
+    db_close(table);
+
+    // lookups and scans start from a cold buffer pool
+    fprintf(stderr, "bench: %u rows, lookups and scans\n", num_rows);
+    table = db_open(config->path, &config->options);
+    uint file_pages = table->pager->num_pages;
+    bench_lookups(table, num_rows, std::min(num_rows, config->lookups), random, &lookups);
+    bench_scans(table, config->scans, &scans);
+    db_close(table);
+    struct stat file_stat{};
+    stat(config->path, &file_stat);
+    bench_remove_files(config->path);
+
+    uint pool_frames = std::max(config->options.pool_frames, (uint) MIN_POOL_FRAMES);
+    double scan_seconds = scans.total_ns / 1e9;
+    printf("    {\"rows\": %u, \"file_pages\": %u, \"file_bytes\": %lld, \"file_to_pool\": %.2f, "
+           "\"scan_rows_per_sec\": %.1f, \"results\": {\n",
+           num_rows, file_pages, (long long) file_stat.st_size, (double) file_pages / pool_frames,
+           scan_seconds > 0 ? (double) num_rows * config->scans / scan_seconds : 0.0);
+    print_result(&sequential, false);
+    print_result(&shuffled, false);
+    print_result(&lookups, false);
+    print_result(&scans, false);
+    print_result(&close_after_insert, true);
+    printf("    }}%s\n", last ? "" : ",");
+    fflush(stdout);
+}
+
+
+/**
+ * bench [--rows n,n,...] [--lookups n] [--scans n] [--pool-frames n] [--mmap] [--wal] [--compress] [--direct] [--path file]
+ */
+int main(int argc, const char *argv[]) {
+    BenchConfig config{};
+    config.options = {BENCH_DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, false, 0, 0, 0, false, false};
+    config.path = "bench.db";
+    config.num_datasets = 3;
+    config.rows[0] = 10000;
+    config.rows[1] = 50000;
+    config.rows[2] = 200000;
+    config.lookups = BENCH_DEFAULT_LOOKUPS;
+    config.scans = BENCH_DEFAULT_SCANS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            config.num_datasets = 0;
+            for (const char *list = argv[++i]; *list && config.num_datasets < BENCH_MAX_DATASETS;) {
+                char *end;
+                config.rows[config.num_datasets++] = strtoul(list, &end, 10);
+                list = *end == ',' ? end + 1 : end;
+            }
+        } else if (strcmp(argv[i], "--lookups") == 0 && i + 1 < argc) {
+            config.lookups = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scans") == 0 && i + 1 < argc) {
+            config.scans = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pool-frames") == 0 && i + 1 < argc) {
+            config.options.pool_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            config.options.pager_mode = PAGER_MMAP;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            config.options.wal = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            config.options.compress = true;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            config.options.direct_io = true;
+        } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            config.path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: bench [--rows n,n,...] [--lookups n] [--scans n] [--pool-frames n] [--mmap] [--wal] [--compress] [--direct] [--path file]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    for (uint i = 0; i < config.num_datasets; i++) {
+        if (config.rows[i] == 0) {
+            fprintf(stderr, "bench: --rows needs positive counts\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("{\n  \"config\": {\"page_size\": %u, \"pool_frames\": %u, \"pager\": \"%s\", \"wal\": %s, "
+           "\"compress\": %s, \"direct_io\": %s, \"lookups\": %u, \"scans\": %u},\n  \"datasets\": [\n",
+           PAGE_SIZE, std::max(config.options.pool_frames, (uint) MIN_POOL_FRAMES),
+           config.options.pager_mode == PAGER_MMAP ? "mmap" : "buffer_pool",
+           config.options.wal ? "true" : "false", config.options.compress ? "true" : "false",
+           config.options.direct_io ? "true" : "false", config.lookups, config.scans);
+    for (uint i = 0; i < config.num_datasets; i++) {
+        bench_dataset(&config, config.rows[i], i + 1 == config.num_datasets);
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
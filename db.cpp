@@ -3,18 +3,80 @@
 //
 
 #include "db.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 uint *leaf_node_next_leaf(void *node);
 
-Cursor *table_start(Table *table);
+void wal_flush(Wal *wal, uint64_t lsn, bool linger);
 
-uint *node_parent(void *node);
+uint64_t wal_durable_lsn(Wal *wal);
+
+uint64_t wal_unsynced_lsn(Wal *wal);
+
+ExecuteResult execute_insert(const Row *row_to_insert, Table *table);
+
+void table_unlatch_all(Table *table);
+
+uint64_t pager_log_commit(Pager *pager);
+
+ThreadPool *thread_pool_create(uint num_threads);
+
+void thread_pool_submit(ThreadPool *pool, std::function<void()> task);
+
+void thread_pool_destroy(ThreadPool *pool);
+
+Cursor table_start(Table *table);
+
+void cursor_seek(Cursor *cursor, uint key);
+
+void leaf_node_find(Cursor *cursor, uint page_num, void *node, uint key);
+
+NodeType get_node_type(void *node);
+
+uint *internal_node_num_keys(void *node);
+
+uint *internal_node_key(void *node, uint key_num);
+
+uint *internal_node_child(void *node, uint child_num);
 
 void update_internal_node_key(void *node, uint old_key, uint new_key);
 
 uint internal_node_find_child(void *node, uint key);
 
-void internal_node_insert(Table *table, uint parent_page_num, uint child_page_num);
+void internal_node_insert(Table *table, TreePath *path, uint level, uint child_page_num);
+
+void initialize_index_node(void *node, NodeType type);
+
+void index_row(Table *table, const Row *row);
+
+uint index_lookup(Table *table, IndexColumn column, const char *key, uint from_id, uint *ids, uint capacity);
+
+uint *internal_node_count(void *node, uint child_num);
+
+uint internal_node_child_index(void *node, uint child_page_num);
+
+uint node_row_count(void *node);
+
+bool table_has_key(Table *table, uint key);
+
+void internal_node_fill(void *node, const uint *children, const uint *keys, const uint *counts, uint count);
+
+void table_open_file(Table *table);
+
+Table *rewrite_begin(Table *table);
+
+void rewrite_finish(Table *table, Table *copy);
 
 
 void print_prompt() {
@@ -46,13 +108,8 @@ void close_input_buffer(InputBuffer *input_buffer) {
 }
 
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
-    statement->type = STATEMENT_INSERT;
-    char *keyword = strtok(input_buffer->buffer, " ");
-    char *id_string = strtok(nullptr, " ");
-    char *username = strtok(nullptr, " ");
-    char *email = strtok(nullptr, " ");
-    if (!keyword || !id_string || !username || !email) {
+PrepareResult prepare_row(const char *id_string, const char *username, const char *email, Row *row) {
+    if (!id_string || !username || !email) {
         return PREPARE_SYNTAX_ERROR;
     }
     int id = atoi(id_string);
@@ -66,643 +123,6096 @@ PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
         return PREPARE_STRING_TOO_LONG;
     }
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+    row->id = id;
+    strcpy(row->username, username);
+    strcpy(row->email, email);
     return PREPARE_SUCCESS;
 }
 
 
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement) {
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-        return prepare_insert(input_buffer, statement);
-    }
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+/**
+ * a "?" token is a placeholder: it records which field it stands for, and the
+ * caller gets a neutral value to parse in its place
+ */
+const char *prepare_param(const char *token, Statement *statement, StatementParam param, const char *neutral) {
+    if (token == nullptr || strcmp(token, "?") != 0 || statement->num_params == MAX_STATEMENT_PARAMS) {
+        return token;
     }
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    statement->params[statement->num_params++] = param;
+    return neutral;
 }
 
 
-void serialize_row(Row *source, void *destination) {
-    char *dest = (char *) destination;
-    memcpy(dest + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(dest + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-    strncpy(dest + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement) {
+    statement->type = STATEMENT_INSERT;
+    char *keyword = strtok(input_buffer->buffer, " ");
+    const char *id_string = prepare_param(strtok(nullptr, " "), statement, PARAM_ID, "0");
+    const char *username = prepare_param(strtok(nullptr, " "), statement, PARAM_USERNAME, "");
+    const char *email = prepare_param(strtok(nullptr, " "), statement, PARAM_EMAIL, "");
+    if (!keyword) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return prepare_row(id_string, username, email, &statement->row_to_insert);
 }
 
 
-void deserialize_row(void *source, Row *dest) {
-    char *src = (char *) source;
-    memcpy(&(dest->id), src + ID_OFFSET, ID_SIZE);
-    memcpy(dest->username, src + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(dest->email, src + EMAIL_OFFSET, EMAIL_SIZE);
+PrepareResult parse_id(const char *token, uint *id) {
+    if (token == nullptr) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (token[0] == '-') {
+        return PREPARE_NEGATIVE_ID;
+    }
+    char *end;
+    unsigned long value = strtoul(token, &end, 10);
+    if (*token == 0 || *end != 0 || value > UINT32_MAX) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *id = value;
+    return PREPARE_SUCCESS;
 }
 
 
-void print(Row *row) {
-    printf("(%d %s %s)\n", row->id, row->username, row->email);
+/**
+ * the value of "where username = X" or "where email = X", looked up through that column's index
+ */
+PrepareResult prepare_index_key(const char *key, IndexColumn column, Statement *statement) {
+    if (key == nullptr) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    size_t length = strlen(key);
+    if (length > (column == INDEX_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE)) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    statement->by_index = true;
+    statement->index_column = column;
+    memcpy(statement->index_key, key, length + 1);
+    return PREPARE_SUCCESS;
 }
 
 
-void *get_page(Pager *pager, uint page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-               TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
-    }
-    if (pager->pages[page_num] == nullptr) {
-        // malloc one page
-        auto page = malloc(PAGE_SIZE);
-        uint num_pages = pager->file_length / PAGE_SIZE;
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
-        }
-        // TODO
-        if (page_num <= num_pages) {
-            lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->fd, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                printf("Error reading file\n");
-                exit(EXIT_FAILURE);
-            }
+/**
+ * the rest of "where id = N" or "where id between A and B", after the operator
+ */
+PrepareResult prepare_id_condition(const char *op, Statement *statement) {
+    PrepareResult result;
+    if (strcmp(op, "=") == 0) {
+        const char *id = prepare_param(strtok(nullptr, " "), statement, PARAM_ID_EQUALS, "0");
+        if ((result = parse_id(id, &statement->id_lo)) != PREPARE_SUCCESS) {
+            return result;
         }
-        pager->pages[page_num] = page;
-
-        if (pager->num_pages <= page_num) {
-            pager->num_pages = page_num + 1;
+        statement->id_hi = statement->id_lo;
+    } else if (strcmp(op, "between") == 0) {
+        const char *id_lo = prepare_param(strtok(nullptr, " "), statement, PARAM_ID_LO, "0");
+        if ((result = parse_id(id_lo, &statement->id_lo)) != PREPARE_SUCCESS) {
+            return result;
+        }
+        char *conjunction = strtok(nullptr, " ");
+        if (conjunction == nullptr || strcmp(conjunction, "and") != 0) {
+            return PREPARE_SYNTAX_ERROR;
         }
+        const char *id_hi = prepare_param(strtok(nullptr, " "), statement, PARAM_ID_HI, "0");
+        if ((result = parse_id(id_hi, &statement->id_hi)) != PREPARE_SUCCESS) {
+            return result;
+        }
+    } else {
+        return PREPARE_SYNTAX_ERROR;
     }
-    return pager->pages[page_num];
+    return PREPARE_SUCCESS;
 }
 
 
-Pager *pager_open(const char *filename) {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-    if (fd == -1) {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+/**
+ * select [count(*)] [where id = N | where id between A and B | where username = U | where email = E]
+ *        [limit L] [offset K] [parallel [ordered | unordered]]
+ */
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->id_lo = 0;
+    statement->id_hi = UINT32_MAX;
+    statement->limit = UINT32_MAX;
+    statement->offset = 0;
+    statement->count = false;
+    statement->scan_mode = SCAN_SERIAL;
+    statement->by_index = false;
+
+    strtok(input_buffer->buffer, " ");
+    char *token = strtok(nullptr, " ");
+    PrepareResult result;
+    if (token != nullptr && strcmp(token, "count(*)") == 0) {
+        statement->count = true;
+        token = strtok(nullptr, " ");
     }
+    if (token != nullptr && strcmp(token, "where") == 0) {
+        char *column = strtok(nullptr, " ");
+        char *op = strtok(nullptr, " ");
+        if (column == nullptr || op == nullptr) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        bool by_username = strcmp(column, "username") == 0;
+        if (by_username || strcmp(column, "email") == 0) {
+            if (strcmp(op, "=") != 0) {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            const char *key = prepare_param(strtok(nullptr, " "), statement, PARAM_INDEX_KEY, "");
+            if ((result = prepare_index_key(key, by_username ? INDEX_USERNAME : INDEX_EMAIL, statement)) != PREPARE_SUCCESS) {
+                return result;
+            }
+        } else if (strcmp(column, "id") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        } else if ((result = prepare_id_condition(op, statement)) != PREPARE_SUCCESS) {
+            return result;
+        }
+        token = strtok(nullptr, " ");
+    }
+    if (token != nullptr && strcmp(token, "limit") == 0) {
+        const char *limit = prepare_param(strtok(nullptr, " "), statement, PARAM_LIMIT, "0");
+        if ((result = parse_id(limit, &statement->limit)) != PREPARE_SUCCESS) {
+            return result;
+        }
+        token = strtok(nullptr, " ");
+    }
+    if (token != nullptr && strcmp(token, "offset") == 0) {
+        const char *offset = prepare_param(strtok(nullptr, " "), statement, PARAM_OFFSET, "0");
+        if ((result = parse_id(offset, &statement->offset)) != PREPARE_SUCCESS) {
+            return result;
+        }
+        token = strtok(nullptr, " ");
+    }
+    if (token != nullptr && strcmp(token, "parallel") == 0) {
+        statement->scan_mode = SCAN_PARALLEL_ORDERED;
+        token = strtok(nullptr, " ");
+        if (token != nullptr && strcmp(token, "unordered") == 0) {
+            statement->scan_mode = SCAN_PARALLEL_UNORDERED;
+            token = strtok(nullptr, " ");
+        } else if (token != nullptr && strcmp(token, "ordered") == 0) {
+            token = strtok(nullptr, " ");
+        }
+    }
+    if (token != nullptr) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
-
-    auto *pager = (Pager *) malloc(sizeof(Pager));
-    pager->fd = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
 
-    if (file_length % PAGE_SIZE) {
-        printf("DB file is not a whole number of pages. Corrupt file\n");
-        exit(EXIT_FAILURE);
+/**
+ * delete where id = N | delete where id between A and B
+ */
+PrepareResult prepare_delete(InputBuffer *input_buffer, Statement *statement) {
+    statement->type = STATEMENT_DELETE;
+    statement->by_index = false;
+    strtok(input_buffer->buffer, " ");
+    char *where = strtok(nullptr, " ");
+    char *column = strtok(nullptr, " ");
+    char *op = strtok(nullptr, " ");
+    if (where == nullptr || column == nullptr || op == nullptr || strcmp(where, "where") != 0 ||
+        strcmp(column, "id") != 0) {
+        return PREPARE_SYNTAX_ERROR;
     }
-
-    for (auto &page: pager->pages) {
-        page = nullptr;
+    PrepareResult result = prepare_id_condition(op, statement);
+    if (result != PREPARE_SUCCESS) {
+        return result;
     }
-
-    return pager;
+    return strtok(nullptr, " ") == nullptr ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
 }
 
 
-void pager_flush(Pager *pager, uint page_num) {
-    if (pager->pages[page_num] == nullptr) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+/**
+ * parses a statement that may hold "?" placeholders for values bound later;
+ * the buffer is tokenized in place
+ */
+PrepareResult prepare_parameterized(InputBuffer *input_buffer, Statement *statement) {
+    statement->num_params = 0;
+    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+        return prepare_insert(input_buffer, statement);
     }
-    off_t offset = lseek(pager->fd, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1) {
-        printf("Error seeking\n");
-        exit(EXIT_FAILURE);
+    if (strcmp(input_buffer->buffer, "select") == 0 || strncmp(input_buffer->buffer, "select ", 7) == 0) {
+        return prepare_select(input_buffer, statement);
+    }
+    if (strcmp(input_buffer->buffer, "delete") == 0 || strncmp(input_buffer->buffer, "delete ", 7) == 0) {
+        return prepare_delete(input_buffer, statement);
     }
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
 
-    ssize_t bytes_written = write(pager->fd, pager->pages[page_num], PAGE_SIZE);
-    if (bytes_written == -1) {
-        printf("Error writing\n");
-        exit(EXIT_FAILURE);
+
+PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement) {
+    PrepareResult result = prepare_parameterized(input_buffer, statement);
+    if (result == PREPARE_SUCCESS && statement->num_params > 0) {
+        return PREPARE_SYNTAX_ERROR;
     }
+    return result;
 }
 
 
 /**
- * 1. flushes the page cache to disk
- * 2. closes the database file
- * 3. frees the memory for the pager and table data structures
- * @param table
+ * sets the value of placeholder index (counted from 0) of a prepared statement
  */
-void db_close(Table *table) {
-    Pager *pager = table->pager;
-
-    for (uint i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == nullptr) continue;
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = nullptr;
+PrepareResult statement_bind_id(Statement *statement, uint index, uint value) {
+    if (index >= statement->num_params) {
+        return PREPARE_SYNTAX_ERROR;
     }
-
-    int result = close(pager->fd);
-    if (result == -1) {
-        printf("Error closing db file\n");
-        exit(EXIT_FAILURE);
+    switch (statement->params[index]) {
+        case PARAM_ID:
+            statement->row_to_insert.id = value;
+            return PREPARE_SUCCESS;
+        case PARAM_ID_EQUALS:
+            statement->id_lo = value;
+            statement->id_hi = value;
+            return PREPARE_SUCCESS;
+        case PARAM_ID_LO:
+            statement->id_lo = value;
+            return PREPARE_SUCCESS;
+        case PARAM_ID_HI:
+            statement->id_hi = value;
+            return PREPARE_SUCCESS;
+        case PARAM_LIMIT:
+            statement->limit = value;
+            return PREPARE_SUCCESS;
+        case PARAM_OFFSET:
+            statement->offset = value;
+            return PREPARE_SUCCESS;
+        default:
+            return PREPARE_SYNTAX_ERROR;
     }
+}
 
-    for (auto &page: pager->pages) {
-        if (page) {
-            free(page);
-            page = nullptr;
-        }
-    }
 
-    free(pager);
-    free(table);
+PrepareResult statement_bind_text(Statement *statement, uint index, const char *value) {
+    if (index >= statement->num_params) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    size_t length = strlen(value);
+    switch (statement->params[index]) {
+        case PARAM_USERNAME:
+            if (length > COLUMN_USERNAME_SIZE) {
+                return PREPARE_STRING_TOO_LONG;
+            }
+            memcpy(statement->row_to_insert.username, value, length + 1);
+            return PREPARE_SUCCESS;
+        case PARAM_EMAIL:
+            if (length > COLUMN_EMAIL_SIZE) {
+                return PREPARE_STRING_TOO_LONG;
+            }
+            memcpy(statement->row_to_insert.email, value, length + 1);
+            return PREPARE_SUCCESS;
+        case PARAM_INDEX_KEY:
+            return prepare_index_key(value, statement->index_column, statement);
+        default:
+            return PREPARE_SYNTAX_ERROR;
+    }
 }
 
 
-uint *leaf_node_num_cells(void *node) {
-    return reinterpret_cast<uint *>((char *) node + LEAF_NODE_NUM_CELLS_OFFSET);
+uint serialized_row_size(const Row *row) {
+    return ROW_HEADER_SIZE + strlen(row->username) + strlen(row->email);
 }
 
 
-void *leaf_node_cell(void *node, uint cell_num) {
-    return (char *) node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+/**
+ * @return the number of bytes written
+ */
+uint serialize_row(const Row *source, void *destination) {
+    char *dest = (char *) destination;
+    uint8 username_length = strlen(source->username);
+    uint8 email_length = strlen(source->email);
+    memcpy(dest + ROW_ID_OFFSET, &(source->id), ID_SIZE);
+    dest[ROW_USERNAME_LENGTH_OFFSET] = (char) username_length;
+    dest[ROW_EMAIL_LENGTH_OFFSET] = (char) email_length;
+    memcpy(dest + ROW_HEADER_SIZE, source->username, username_length);
+    memcpy(dest + ROW_HEADER_SIZE + username_length, source->email, email_length);
+    return ROW_HEADER_SIZE + username_length + email_length;
 }
 
 
-uint *leaf_node_key(void *node, uint cell_num) {
-    return static_cast<uint *>(leaf_node_cell(node, cell_num));
+uint serialized_size(void *source) {
+    uint8 *src = (uint8 *) source;
+    return ROW_HEADER_SIZE + src[ROW_USERNAME_LENGTH_OFFSET] + src[ROW_EMAIL_LENGTH_OFFSET];
 }
 
 
-void *leaf_node_value(void *node, uint cell_num) {
-    return (char *) leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+void deserialize_row(void *source, Row *dest) {
+    char *src = (char *) source;
+    uint8 username_length = src[ROW_USERNAME_LENGTH_OFFSET];
+    uint8 email_length = src[ROW_EMAIL_LENGTH_OFFSET];
+    memcpy(&(dest->id), src + ROW_ID_OFFSET, ID_SIZE);
+    memcpy(dest->username, src + ROW_HEADER_SIZE, username_length);
+    dest->username[username_length] = 0;
+    memcpy(dest->email, src + ROW_HEADER_SIZE + username_length, email_length);
+    dest->email[email_length] = 0;
 }
 
 
-void *cursor_value(Cursor *cursor) {
-    uint page_num = cursor->page_num;
-    void *page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
+/**
+ * select output bypasses stdio: rows are formatted into buffer and written to
+ * fd RESULT_BUFFER_SIZE bytes at a time. stdout is flushed when a sink opens so
+ * messages printed before the select still come first.
+ */
+#define RESULT_BUFFER_SIZE (1 << 16)
+/* the longest formatted row: the id and separators, then strings whose every byte is escaped, plus quotes */
+#define RESULT_ROW_MAX (16 + 2 * COLUMN_USERNAME_SIZE + 2 + 2 * COLUMN_EMAIL_SIZE + 2)
+
+struct ResultSink {
+    int fd;
+    OutputFormat format;
+    uint used;
+    char buffer[RESULT_BUFFER_SIZE];
+};
+
+
+void result_sink_open(ResultSink *sink, Table *table) {
+    fflush(stdout);
+    sink->fd = table->output_fd;
+    sink->format = table->output_format;
+    sink->used = 0;
 }
 
-void cursor_advance(Cursor *cursor) {
-    uint page_num = cursor->page_num;
-    void *node = get_page(cursor->table->pager, page_num);
-    cursor->cell_num += 1;
 
-    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
-        uint next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0) {
-            cursor->end_of_table = true;
-        } else {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
+void result_sink_flush(ResultSink *sink) {
+    uint written = 0;
+    while (written < sink->used) {
+        ssize_t result = write(sink->fd, sink->buffer + written, sink->used - written);
+        if (result == -1) {
+            if (errno == EINTR) continue;
+            printf("Error writing results: %d\n", errno);
+            exit(EXIT_FAILURE);
         }
+        written += result;
     }
+    sink->used = 0;
 }
 
 
-ExecuteResult execute_select(Table *table) {
-    auto cursor = table_start(table);
-    Row row{};
-    while (!cursor->end_of_table) {
-        deserialize_row(cursor_value(cursor), &row);
-        print(&row);
-        cursor_advance(cursor);
+/**
+ * @return the number of digits written
+ */
+uint format_uint(uint value, char *out) {
+    char digits[10];
+    uint length = 0;
+    do {
+        digits[length++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    for (uint i = 0; i < length; i++) {
+        out[i] = digits[length - 1 - i];
     }
-    return EXECUTE_SUCCESS;
+    return length;
 }
 
 
-void print_constants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+/**
+ * a CSV field is quoted, with its quotes doubled, when it holds a separator, quote or line break
+ */
+char *format_csv_field(const char *field, char *out) {
+    if (strpbrk(field, ",\"\r\n") == nullptr) {
+        size_t length = strlen(field);
+        memcpy(out, field, length);
+        return out + length;
+    }
+    *out++ = '"';
+    for (const char *c = field; *c; c++) {
+        if (*c == '"') *out++ = '"';
+        *out++ = *c;
+    }
+    *out++ = '"';
+    return out;
 }
 
 
-Cursor *leaf_node_find(Table *table, uint page_num, uint key) {
-    void *node = get_page(table->pager, page_num);
-    uint num_cells = *leaf_node_num_cells(node);
+char *format_tsv_field(const char *field, char *out) {
+    for (const char *c = field; *c; c++) {
+        switch (*c) {
+            case '\t': *out++ = '\\'; *out++ = 't'; break;
+            case '\n': *out++ = '\\'; *out++ = 'n'; break;
+            case '\r': *out++ = '\\'; *out++ = 'r'; break;
+            case '\\': *out++ = '\\'; *out++ = '\\'; break;
+            default: *out++ = *c;
+        }
+    }
+    return out;
+}
 
-    auto *cursor = static_cast<Cursor *>(malloc(sizeof(Cursor)));
-    cursor->table = table;
-    cursor->page_num = page_num;
 
-    uint min_index = 0;
-    uint one_past_max_index = num_cells;
-    while (min_index != one_past_max_index) {
-        uint index = (min_index + one_past_max_index) / 2;
-        uint key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            return cursor;
-        }
-        if (key < key_at_index) {
-            one_past_max_index = index;
-        } else {
-            min_index = index + 1;
+void result_sink_row(ResultSink *sink, const Row *row) {
+    if (RESULT_BUFFER_SIZE - sink->used < RESULT_ROW_MAX) {
+        result_sink_flush(sink);
+    }
+    char *out = sink->buffer + sink->used;
+    switch (sink->format) {
+        case OUTPUT_TABLE: {
+            size_t username_length = strlen(row->username);
+            size_t email_length = strlen(row->email);
+            *out++ = '(';
+            out += format_uint(row->id, out);
+            *out++ = ' ';
+            memcpy(out, row->username, username_length);
+            out += username_length;
+            *out++ = ' ';
+            memcpy(out, row->email, email_length);
+            out += email_length;
+            *out++ = ')';
+            *out++ = '\n';
+            break;
+        }
+        case OUTPUT_CSV:
+            out += format_uint(row->id, out);
+            *out++ = ',';
+            out = format_csv_field(row->username, out);
+            *out++ = ',';
+            out = format_csv_field(row->email, out);
+            *out++ = '\n';
+            break;
+        case OUTPUT_TSV:
+            out += format_uint(row->id, out);
+            *out++ = '\t';
+            out = format_tsv_field(row->username, out);
+            *out++ = '\t';
+            out = format_tsv_field(row->email, out);
+            *out++ = '\n';
+            break;
+        case OUTPUT_BINARY: {
+            uint32_t length = serialize_row(row, out + sizeof(uint32_t));
+            memcpy(out, &length, sizeof(uint32_t));
+            out += sizeof(uint32_t) + length;
+            break;
         }
     }
-    cursor->cell_num = min_index;
-    return cursor;
+    sink->used = out - sink->buffer;
 }
 
 
-NodeType get_node_type(void *node) {
-    uint8 value = *((uint *) ((char *) node + NODE_TYPE_OFFSET));
-    return static_cast<NodeType>(value);
+/**
+ * the answer of a select count(*): "(N)" in table mode, the bare number in CSV
+ * and TSV, and a record holding the 32-bit count in binary
+ */
+void result_sink_count(ResultSink *sink, uint count) {
+    if (RESULT_BUFFER_SIZE - sink->used < RESULT_ROW_MAX) {
+        result_sink_flush(sink);
+    }
+    char *out = sink->buffer + sink->used;
+    switch (sink->format) {
+        case OUTPUT_TABLE:
+            *out++ = '(';
+            out += format_uint(count, out);
+            *out++ = ')';
+            *out++ = '\n';
+            break;
+        case OUTPUT_CSV:
+        case OUTPUT_TSV:
+            out += format_uint(count, out);
+            *out++ = '\n';
+            break;
+        case OUTPUT_BINARY: {
+            uint32_t length = sizeof(uint32_t);
+            memcpy(out, &length, sizeof(uint32_t));
+            memcpy(out + sizeof(uint32_t), &count, sizeof(uint32_t));
+            out += 2 * sizeof(uint32_t);
+            break;
+        }
+    }
+    sink->used = out - sink->buffer;
 }
 
 
-void set_node_type(void *node, NodeType type) {
-    uint value = type;
-    *((uint *) ((char *) node + NODE_TYPE_OFFSET)) = value;
+/**
+ * one thread's counts. Only the owner changes them, with a relaxed load and store
+ * rather than a locked add; readers load them under stats_mutex.
+ */
+struct StatsBlock {
+    std::atomic<uint64_t> counters[NUM_STAT_COUNTERS];
+    std::atomic<uint64_t> histogram_sums[NUM_STAT_HISTOGRAMS];
+    std::atomic<uint64_t> histogram_maxes[NUM_STAT_HISTOGRAMS];
+    std::atomic<uint64_t> histograms[NUM_STAT_HISTOGRAMS][STATS_HISTOGRAM_BUCKETS];
+    StatsBlock *next;
+
+    StatsBlock();
+
+    ~StatsBlock();
+};
+
+const char *const STAT_COUNTER_NAMES[NUM_STAT_COUNTERS] = {
+        "page_hits", "page_misses", "bytes_read", "readahead_pages", "pages_written", "bytes_written", "write_ns",
+        "log_bytes_written", "log_syncs", "leaf_splits", "internal_splits", "root_splits", "index_splits",
+};
+const char *const STAT_HISTOGRAM_NAMES[NUM_STAT_HISTOGRAMS] = {"insert", "select", "delete"};
+
+/* the live blocks, and the counts of threads that have exited */
+std::mutex stats_mutex;
+StatsBlock *stats_blocks = nullptr;
+EngineStats stats_retired{};
+thread_local StatsBlock stats_local;
+
+
+StatsBlock::StatsBlock() : counters{}, histogram_sums{}, histogram_maxes{}, histograms{} {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    next = stats_blocks;
+    stats_blocks = this;
 }
 
 
-uint *internal_node_num_keys(void *node) {
-    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+StatsBlock::~StatsBlock() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    for (uint i = 0; i < NUM_STAT_COUNTERS; i++) {
+        stats_retired.counters[i] += counters[i].load(std::memory_order_relaxed);
+    }
+    for (uint h = 0; h < NUM_STAT_HISTOGRAMS; h++) {
+        stats_retired.histogram_sums[h] += histogram_sums[h].load(std::memory_order_relaxed);
+        stats_retired.histogram_maxes[h] = std::max(stats_retired.histogram_maxes[h],
+                                                    histogram_maxes[h].load(std::memory_order_relaxed));
+        for (uint i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            stats_retired.histograms[h][i] += histograms[h][i].load(std::memory_order_relaxed);
+        }
+    }
+    StatsBlock **link = &stats_blocks;
+    while (*link != this) {
+        link = &(*link)->next;
+    }
+    *link = next;
 }
 
 
-uint *internal_node_right_child(void *node) {
-    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+void stats_bump(std::atomic<uint64_t> &value, uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
 }
 
 
-uint *internal_node_cell(void *node, uint cell_num) {
-    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE);
+void stats_add(StatCounter counter, uint64_t amount) {
+    stats_bump(stats_local.counters[counter], amount);
 }
 
 
-uint *internal_node_child(void *node, uint child_num) {
-    uint num_keys = *internal_node_num_keys(node);
-    if (child_num > num_keys) {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
-        exit(EXIT_FAILURE);
-    } else if (child_num == num_keys) {
-        return internal_node_right_child(node);
-    } else {
-        return internal_node_cell(node, child_num);
+uint stats_bucket(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) {
+        return value;
     }
+    uint exponent = 63 - __builtin_clzll(value);
+    return (exponent - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS +
+           ((value >> (exponent - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1));
 }
 
 
-uint *internal_node_key(void *node, uint key_num) {
-    return reinterpret_cast<uint *>((char *) internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE);
+uint64_t stats_bucket_lower(uint bucket) {
+    if (bucket < STATS_SUB_BUCKETS) {
+        return bucket;
+    }
+    uint exponent = bucket / STATS_SUB_BUCKETS + STATS_SUB_BUCKET_BITS - 1;
+    return (uint64_t) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (exponent - STATS_SUB_BUCKET_BITS);
 }
 
 
-uint get_node_max_key(void *node) {
-    switch (get_node_type(node)) {
-        case NODE_INTERNAL:
-            return *internal_node_key(node, *internal_node_num_keys(node));
-        case NODE_LEAF:
-            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
-        default:
-            printf("Unknown node type\n");
-            exit(EXIT_FAILURE);
-    }
+uint64_t stats_bucket_upper(uint bucket) {
+    return bucket + 1 == STATS_HISTOGRAM_BUCKETS ? UINT64_MAX : stats_bucket_lower(bucket + 1) - 1;
 }
 
 
-bool is_node_root(void *node) {
-    uint8 value = *((uint8 *) ((char *) node + IS_ROOT_OFFSET));
-    return value;
+void stats_record(StatHistogram histogram, uint64_t value) {
+    stats_bump(stats_local.histogram_sums[histogram], value);
+    if (value > stats_local.histogram_maxes[histogram].load(std::memory_order_relaxed)) {
+        stats_local.histogram_maxes[histogram].store(value, std::memory_order_relaxed);
+    }
+    stats_bump(stats_local.histograms[histogram][stats_bucket(value)], 1);
 }
 
 
-void set_node_root(void *node, bool is_root) {
-    uint8 value = is_root;
-    *((uint8 *) ((char *) node + IS_ROOT_OFFSET)) = value;
+uint64_t stats_now_ns() {
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
 
-uint get_unused_page_num(Pager *pager) {
-    return pager->num_pages;
-}
+/**
+ * records the time until it goes out of scope in a latency histogram
+ */
+struct StatsTimer {
+    StatHistogram histogram;
+    uint64_t start_ns;
 
+    explicit StatsTimer(StatHistogram histogram) : histogram(histogram), start_ns(stats_now_ns()) {}
 
-void initialize_leaf_node(void *node) {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
-    *leaf_node_next_leaf(node) = 0;
-}
+    ~StatsTimer() { stats_record(histogram, stats_now_ns() - start_ns); }
+};
 
 
-void initialize_internal_node(void *node) {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
+void stats_snapshot(EngineStats *stats) {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    *stats = stats_retired;
+    for (StatsBlock *block = stats_blocks; block != nullptr; block = block->next) {
+        for (uint i = 0; i < NUM_STAT_COUNTERS; i++) {
+            stats->counters[i] += block->counters[i].load(std::memory_order_relaxed);
+        }
+        for (uint h = 0; h < NUM_STAT_HISTOGRAMS; h++) {
+            stats->histogram_sums[h] += block->histogram_sums[h].load(std::memory_order_relaxed);
+            stats->histogram_maxes[h] = std::max(stats->histogram_maxes[h],
+                                                 block->histogram_maxes[h].load(std::memory_order_relaxed));
+            for (uint i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+                stats->histograms[h][i] += block->histograms[h][i].load(std::memory_order_relaxed);
+            }
+        }
+    }
 }
 
 
-void create_new_root(Table *table, uint right_child_page_num) {
-    void *root = get_page(table->pager, table->root_page_num);
-    void *right_child = get_page(table->pager, right_child_page_num);
-    uint left_child_page_num = get_unused_page_num(table->pager);
-    void *left_child = get_page(table->pager, left_child_page_num);
+/**
+ * zeroes every count; a count its thread is updating at that moment may survive
+ */
+void stats_reset() {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    stats_retired = {};
+    for (StatsBlock *block = stats_blocks; block != nullptr; block = block->next) {
+        for (auto &counter: block->counters) {
+            counter.store(0, std::memory_order_relaxed);
+        }
+        for (uint h = 0; h < NUM_STAT_HISTOGRAMS; h++) {
+            block->histogram_sums[h].store(0, std::memory_order_relaxed);
+            block->histogram_maxes[h].store(0, std::memory_order_relaxed);
+            for (auto &bucket: block->histograms[h]) {
+                bucket.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
 
-    /* Left child has data copied from old root */
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
 
-    /* Root node is a new internal node with one key and two children */
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
+uint64_t histogram_count(const uint64_t *buckets) {
+    uint64_t count = 0;
+    for (uint i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        count += buckets[i];
+    }
+    return count;
+}
 
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
 
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) = table->root_page_num;
+/**
+ * the upper bound of the bucket holding the value at fraction of the way through,
+ * but never more than max, the largest value recorded
+ */
+uint64_t histogram_percentile(const uint64_t *buckets, uint64_t count, uint64_t max, double fraction) {
+    uint64_t rank = std::min(count - 1, (uint64_t) (fraction * count));
+    uint64_t seen = 0;
+    for (uint i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            return std::min(stats_bucket_upper(i), max);
+        }
+    }
+    return 0;
 }
 
 
-void leaf_node_split_and_insert(Cursor *cursor, uint key, Row *value) {
-    /**
-     * 创建新的页面，将后一半的内容拷贝到新分配的页面
-     */
-    void *old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint old_max = get_node_max_key(old_node);
-    uint new_page_num = get_unused_page_num(cursor->table->pager);
-    void *new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
-    *node_parent(new_node) = *node_parent(old_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node) = new_page_num;
-    for (int i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void *destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-            destination_node = new_node;
-        } else {
-            destination_node = old_node;
+/* the maximum is tracked exactly rather than read off the top bucket's bound */
+const double STATS_PERCENTILES[] = {0.5, 0.9, 0.99, 0.999};
+const char *const STATS_PERCENTILE_NAMES[] = {"p50", "p90", "p99", "p999"};
+
+
+/**
+ * .stats: one line per counter, then each statement type's latencies
+ */
+void stats_print(FILE *out) {
+    auto *stats = (EngineStats *) malloc(sizeof(EngineStats));
+    stats_snapshot(stats);
+    for (uint i = 0; i < NUM_STAT_COUNTERS; i++) {
+        fprintf(out, "%s: %lu\n", STAT_COUNTER_NAMES[i], (unsigned long) stats->counters[i]);
+    }
+    for (uint h = 0; h < NUM_STAT_HISTOGRAMS; h++) {
+        uint64_t count = histogram_count(stats->histograms[h]);
+        fprintf(out, "%s_ns: count %lu", STAT_HISTOGRAM_NAMES[h], (unsigned long) count);
+        if (count > 0) {
+            fprintf(out, " mean %lu", (unsigned long) (stats->histogram_sums[h] / count));
+            for (uint p = 0; p < sizeof(STATS_PERCENTILES) / sizeof(double); p++) {
+                fprintf(out, " %s %lu", STATS_PERCENTILE_NAMES[p],
+                        (unsigned long) histogram_percentile(stats->histograms[h], count, stats->histogram_maxes[h],
+                                                             STATS_PERCENTILES[p]));
+            }
+            fprintf(out, " max %lu", (unsigned long) stats->histogram_maxes[h]);
         }
-        uint index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void *destination = leaf_node_cell(destination_node, index_within_node);
+        fprintf(out, "\n");
+    }
+    free(stats);
+}
 
-        if (i == cursor->cell_num) {
-            serialize_row(value, leaf_node_value(destination_node, index_within_node));
-            *leaf_node_key(destination_node, index_within_node) = key;
-        } else if (i > cursor->cell_num) {
-            memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+
+/**
+ * the counters, and for each statement type its latency percentiles and the
+ * non-empty histogram buckets as [lowest value, count] pairs
+ */
+void stats_print_json(FILE *out) {
+    auto *stats = (EngineStats *) malloc(sizeof(EngineStats));
+    stats_snapshot(stats);
+    fprintf(out, "{\"counters\": {");
+    for (uint i = 0; i < NUM_STAT_COUNTERS; i++) {
+        fprintf(out, "%s\"%s\": %lu", i ? ", " : "", STAT_COUNTER_NAMES[i], (unsigned long) stats->counters[i]);
+    }
+    fprintf(out, "}, \"latency_ns\": {");
+    for (uint h = 0; h < NUM_STAT_HISTOGRAMS; h++) {
+        uint64_t count = histogram_count(stats->histograms[h]);
+        fprintf(out, "%s\"%s\": {\"count\": %lu, \"sum\": %lu", h ? ", " : "", STAT_HISTOGRAM_NAMES[h],
+                (unsigned long) count, (unsigned long) stats->histogram_sums[h]);
+        for (uint p = 0; p < sizeof(STATS_PERCENTILES) / sizeof(double); p++) {
+            uint64_t value = count ? histogram_percentile(stats->histograms[h], count, stats->histogram_maxes[h],
+                                                          STATS_PERCENTILES[p]) : 0;
+            fprintf(out, ", \"%s\": %lu", STATS_PERCENTILE_NAMES[p], (unsigned long) value);
+        }
+        fprintf(out, ", \"max\": %lu", (unsigned long) stats->histogram_maxes[h]);
+        fprintf(out, ", \"buckets\": [");
+        bool first = true;
+        for (uint i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            if (stats->histograms[h][i] > 0) {
+                fprintf(out, "%s[%lu, %lu]", first ? "" : ", ", (unsigned long) stats_bucket_lower(i),
+                        (unsigned long) stats->histograms[h][i]);
+                first = false;
+            }
         }
+        fprintf(out, "]}");
     }
+    fprintf(out, "}}\n");
+    free(stats);
+}
 
-    // 更新结点数量
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
 
-    if (is_node_root(old_node)) {
-        create_new_root(cursor->table, new_page_num);
-    } else {
-        uint parent_page_num = *node_parent(old_node);
-        uint new_max = get_node_max_key(old_node);
-        void *parent = get_page(cursor->table->pager, parent_page_num);
+uint page_table_slot(Pager *pager, uint page_num) {
+    return (page_num * 2654435761u) & pager->page_table_mask;
+}
 
-        // old_max 更新为 new_max
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
+
+uint page_table_lookup(Pager *pager, uint page_num) {
+    uint slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        uint frame = pager->page_table[slot];
+        if (pager->frames[frame].page_num == page_num) {
+            return frame;
+        }
+        slot = (slot + 1) & pager->page_table_mask;
     }
+    return INVALID_FRAME;
 }
 
 
-void leaf_node_insert(Cursor *cursor, uint key, Row *value) {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-    uint num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        leaf_node_split_and_insert(cursor, key, value);
-        return;
+void page_table_insert(Pager *pager, uint page_num, uint frame) {
+    uint slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != INVALID_FRAME) {
+        slot = (slot + 1) & pager->page_table_mask;
     }
+    pager->page_table[slot] = frame;
+}
 
-    if (cursor->cell_num < num_cells) {
-        for (uint i = num_cells; i > cursor->cell_num; --i) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
+
+/**
+ * linear probing delete: shift later entries of the probe run back into the hole
+ */
+void page_table_remove(Pager *pager, uint page_num) {
+    uint mask = pager->page_table_mask;
+    uint slot = page_table_slot(pager, page_num);
+    while (pager->frames[pager->page_table[slot]].page_num != page_num) {
+        slot = (slot + 1) & mask;
+    }
+    uint hole = slot;
+    for (uint next = (hole + 1) & mask; pager->page_table[next] != INVALID_FRAME; next = (next + 1) & mask) {
+        uint home = page_table_slot(pager, pager->frames[pager->page_table[next]].page_num);
+        // move the entry only if its home slot is not between the hole and its current slot
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            pager->page_table[hole] = pager->page_table[next];
+            hole = next;
         }
     }
-
-    *leaf_node_num_cells(node) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    pager->page_table[hole] = INVALID_FRAME;
 }
 
 
-void indent(uint level) {
-    for (uint i = 0; i < level; ++i) printf("  ");
+void *frame_page(Pager *pager, uint frame) {
+    return pager->frame_data + (size_t) frame * PAGE_SIZE;
 }
 
 
-void print_tree(Pager *pager, uint page_num, uint level) {
-    void *node = get_page(pager, page_num);
-    uint num_keys, child;
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 11
+#define LZ_SKIP_SHIFT 5
 
-    switch (get_node_type(node)) {
-        case NODE_LEAF:
-            num_keys = *leaf_node_num_cells(node);
-            indent(level);
-            printf("- leaf (size %d)\n", num_keys);
-            for (uint i = 0; i < num_keys; i++) {
-                indent(level + 1);
-                printf("- %d\n", *leaf_node_key(node, i));
-            }
-            break;
-        case NODE_INTERNAL:
-            num_keys = *internal_node_num_keys(node);
-            indent(level);
-            printf("- internal (size %d)\n", num_keys);
-            for (uint i = 0; i < num_keys; i++) {
-                child = *internal_node_child(node, i);
-                print_tree(pager, child, level + 1);
+uint32_t lz_load32(const char *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
 
-                indent(level);
-                printf("- key %d\n", *internal_node_key(node, i));
-            }
-            child = *internal_node_right_child(node);
-            print_tree(pager, child, level + 1);
-            break;
+
+char *lz_put_length(char *out, uint length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = (char) 255;
     }
+    *out++ = (char) length;
+    return out;
 }
 
 
-Table *db_open(const char *filename) {
-    Pager *pager = pager_open(filename);
-    auto *table = (Table *) malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
-    if (pager->num_pages == 0) {
-        // new data file
-        void *root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+/**
+ * compresses a page into out, which holds PAGE_COMPRESS_BOUND bytes, and returns
+ * the compressed length. The format is LZ4's block format: sequences of a token
+ * (literal count, match length - LZ_MIN_MATCH), literals and a uint16 match
+ * offset, each count saturating at 15 with 255-continued bytes; the last
+ * sequence is literals alone. A run of zeros is a match one byte back.
+ */
+uint page_compress(const char *page, char *out) {
+    uint16_t table[1 << LZ_HASH_BITS] = {};
+    char *start = out;
+    uint anchor = 0;
+    uint i = 1;
+    while (i + LZ_MIN_MATCH <= PAGE_SIZE) {
+        uint32_t sequence = lz_load32(page + i);
+        uint hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint candidate = table[hash];
+        table[hash] = (uint16_t) i;
+        if (lz_load32(page + candidate) != sequence) {
+            // step faster through bytes that keep failing to match
+            i += 1 + ((i - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+        // extend the match a word at a time, then a byte at a time near the end of the page
+        uint length = LZ_MIN_MATCH;
+        while (i + length + sizeof(uint64_t) <= PAGE_SIZE) {
+            uint64_t a, b;
+            memcpy(&a, page + candidate + length, sizeof(a));
+            memcpy(&b, page + i + length, sizeof(b));
+            if (a != b) {
+                length += __builtin_ctzll(a ^ b) / 8;
+                break;
+            }
+            length += sizeof(uint64_t);
+        }
+        if (i + length + sizeof(uint64_t) > PAGE_SIZE) {
+            while (i + length < PAGE_SIZE && page[candidate + length] == page[i + length]) {
+                length++;
+            }
+        }
+        uint literals = i - anchor;
+        char *token = out++;
+        *token = (char) ((std::min(literals, 15u) << 4) | std::min(length - LZ_MIN_MATCH, 15u));
+        if (literals >= 15) {
+            out = lz_put_length(out, literals - 15);
+        }
+        memcpy(out, page + anchor, literals);
+        out += literals;
+        uint16_t offset = i - candidate;
+        memcpy(out, &offset, sizeof(offset));
+        out += sizeof(offset);
+        if (length - LZ_MIN_MATCH >= 15) {
+            out = lz_put_length(out, length - LZ_MIN_MATCH - 15);
+        }
+        i += length;
+        anchor = i;
     }
-    return table;
+    uint literals = PAGE_SIZE - anchor;
+    *out++ = (char) (std::min(literals, 15u) << 4);
+    if (literals >= 15) {
+        out = lz_put_length(out, literals - 15);
+    }
+    memcpy(out, page + anchor, literals);
+    out += literals;
+    return out - start;
 }
 
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
-    if (strcmp(input_buffer->buffer, ".exit") == 0) {
-        close_input_buffer(input_buffer);
-        printf("Bye~\n");
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-        printf("Constants:\n");
-        print_constants();
-        return META_COMMAND_SUCCESS;
-    } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-        printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
-    } else {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+/**
+ * undoes page_compress, checking every count against both buffers; returns false
+ * unless the input decodes to exactly one page
+ */
+bool page_decompress(const char *in, uint length, char *page) {
+    const char *end = in + length;
+    uint out = 0;
+    auto get_length = [&in, end](uint *count) {
+        uint8_t byte;
+        do {
+            if (in == end) return false;
+            byte = (uint8_t) *in++;
+            *count += byte;
+        } while (byte == 255);
+        return true;
+    };
+    while (in < end) {
+        uint8_t token = (uint8_t) *in++;
+        uint literals = token >> 4;
+        if (literals == 15 && !get_length(&literals)) return false;
+        if (literals > (uint) (end - in) || literals > PAGE_SIZE - out) return false;
+        memcpy(page + out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == end) break;
+
+        uint16_t offset;
+        if (end - in < (ptrdiff_t) sizeof(offset)) return false;
+        memcpy(&offset, in, sizeof(offset));
+        in += sizeof(offset);
+        uint match = token & 15;
+        if (match == 15 && !get_length(&match)) return false;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match > PAGE_SIZE - out) return false;
+        // a match overlapping its own output repeats the bytes before it
+        if (offset >= match) {
+            memcpy(page + out, page + out - offset, match);
+        } else if (offset == 1) {
+            memset(page + out, page[out - 1], match);
+        } else {
+            for (uint j = 0; j < match; j++) {
+                page[out + j] = page[out + j - offset];
+            }
+        }
+        out += match;
     }
+    return out == PAGE_SIZE;
 }
 
 
-Cursor *internal_node_find(Table *table, uint page_num, uint key) {
-    void *node = get_page(table->pager, page_num);
+#define MIN_PENDING_SLOT_RUNS 64u
 
-    uint child_index = internal_node_find_child(node, key);
-    uint child_num = *internal_node_child(node, child_index);
-    void *child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-        case NODE_LEAF:
-            return leaf_node_find(table, child_num, key);
-        case NODE_INTERNAL:
-            return internal_node_find(table, child_num, key);
-        default:
-            printf("Unknown node type\n");
-            exit(EXIT_FAILURE);
-    }
+
+uint slots_for(uint length) {
+    return (length + PAGE_SLOT_SIZE - 1) / PAGE_SLOT_SIZE;
 }
 
 
-Cursor *table_find(Table *table, uint key) {
-    uint root_page_num = table->root_page_num;
-    void *root_node = get_page(table->pager, root_page_num);
+bool slot_is_free(const Pager *pager, uint slot) {
+    return slot / 64 < pager->free_slots.size() && (pager->free_slots[slot / 64] >> (slot % 64) & 1);
+}
+
 
-    if (get_node_type(root_node) == NODE_LEAF) {
-        return leaf_node_find(table, root_page_num, key);
-    } else {
-        return internal_node_find(table, root_page_num, key);
+void pager_release_slots(Pager *pager, SlotRun run) {
+    for (uint slot = run.slot; slot < run.slot + run.count; slot++) {
+        if (slot / 64 >= pager->free_slots.size()) {
+            pager->free_slots.resize(slot / 64 + 1);
+        }
+        pager->free_slots[slot / 64] |= (uint64_t) 1 << (slot % 64);
     }
 }
 
 
-ExecuteResult execute_insert(Statement *statement, Table *table) {
-    void *node = get_page(table->pager, table->root_page_num);
-    uint num_cells = *leaf_node_num_cells(node);
+/**
+ * returns the first slot of the first run of count free slots in [from, to), or
+ * INVALID_PAGE_NUM; words with no free slot are skipped whole
+ */
+uint find_free_slots(const Pager *pager, uint from, uint to, uint count) {
+    uint run_slot = 0;
+    uint run_length = 0;
+    for (uint slot = from; slot < to;) {
+        uint64_t word = slot / 64 < pager->free_slots.size() ? pager->free_slots[slot / 64] >> (slot % 64) : 0;
+        uint bits = std::min(64 - slot % 64, to - slot);
+        if (word == 0) {
+            run_length = 0;
+            slot += bits;
+            continue;
+        }
+        for (uint bit = 0; bit < bits; bit++, slot++) {
+            if (!(word >> bit & 1)) {
+                run_length = 0;
+            } else if (run_length++ == 0) {
+                run_slot = slot;
+            }
+            if (run_length == count) {
+                return run_slot;
+            }
+        }
+    }
+    return INVALID_PAGE_NUM;
+}
 
-    Row *row_to_insert = &(statement->row_to_insert);
-    uint key_to_insert = row_to_insert->id;
-    Cursor *cursor = table_find(table, key_to_insert);
 
-    if (cursor->cell_num < num_cells) {
-        uint key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
+/**
+ * takes the first run of count free slots at or after slot_hint, then from the
+ * start of the file, or else extends the file, starting at any free slots it ends with
+ */
+uint pager_allocate_slots(Pager *pager, uint count) {
+    uint end = pager->end_slot;
+    uint slot = find_free_slots(pager, std::min(pager->slot_hint, end), end, count);
+    if (slot == INVALID_PAGE_NUM) {
+        slot = find_free_slots(pager, COMPRESSED_HEADER_SLOTS, std::min(pager->slot_hint + count, end), count);
+    }
+    uint taken = count;
+    if (slot == INVALID_PAGE_NUM) {
+        slot = end;
+        while (slot > COMPRESSED_HEADER_SLOTS && slot_is_free(pager, slot - 1)) {
+            slot--;
         }
+        pager->end_slot = slot + count;
+        taken = end - slot;
     }
-
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-    return EXECUTE_SUCCESS;
+    for (uint i = slot; i < slot + taken; i++) {
+        pager->free_slots[i / 64] &= ~((uint64_t) 1 << (i % 64));
+    }
+    pager->slot_hint = slot + count;
+    return slot;
 }
 
 
-ExecuteResult execute_statement(Statement *statement, Table *table) {
-    switch (statement->type) {
-        case (STATEMENT_INSERT):
-            return execute_insert(statement, table);
-        case (STATEMENT_SELECT):
-            return execute_select(table);
+void pwrite_all(int fd, const char *bytes, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written == -1) {
+            printf("Error writing\n");
+            exit(EXIT_FAILURE);
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
     }
-    return EXECUTE_FAIL;
 }
 
 
-Cursor *table_start(Table *table) {
-    auto *cursor = table_find(table, 0);
-    void *node = get_page(table->pager, cursor->page_num);
-    uint num_cells = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cells == 0);
-
-    return cursor;
+uint32_t compressed_header_checksum(const CompressedHeader *header) {
+    uint32_t hash = 2166136261u;
+    auto bytes = (const char *) header;
+    for (size_t i = 0; i < offsetof(CompressedHeader, checksum); i++) {
+        hash = (hash ^ (uint8_t) bytes[i]) * 16777619u;
+    }
+    return hash;
 }
 
 
-uint *leaf_node_next_leaf(void *node) {
-    return reinterpret_cast<uint *>((char *) node + LEAF_NODE_NEXT_LEAF_OFFSET);
+/**
+ * writes the page map into free slots and, once it and the pages written before
+ * it are durable, the header copy the last call did not write. The runs
+ * pages moved out of before the new header, and the old map, become free.
+ * Called with Pager::mutex held.
+ */
+void pager_write_page_map(Pager *pager) {
+    uint num_pages = pager->file_length / PAGE_SIZE;
+    uint map_length = num_pages * sizeof(PageMapEntry);
+    SlotRun map_run{pager_allocate_slots(pager, slots_for(map_length)), slots_for(map_length)};
+    // the map and the header are written as whole slots from aligned buffers, as direct I/O needs
+    size_t map_bytes = (size_t) map_run.count * PAGE_SLOT_SIZE;
+    auto *map = (char *) aligned_alloc(PAGE_SLOT_SIZE, std::max(map_bytes, (size_t) PAGE_SLOT_SIZE));
+    memcpy(map, pager->page_map, map_length);
+    memset(map + map_length, 0, map_bytes - map_length);
+    pwrite_all(pager->fd, map, map_bytes, (off_t) map_run.slot * PAGE_SLOT_SIZE);
+    free(map);
+    if (fdatasync(pager->fd) == -1) {
+        printf("Error syncing db file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    CompressedHeader header{COMPRESSED_MAGIC, num_pages, pager->generation + 1, map_run.slot, map_length,
+                            pager->end_slot, 0};
+    header.checksum = compressed_header_checksum(&header);
+    alignas(PAGE_SLOT_SIZE) char header_slot[PAGE_SLOT_SIZE] = {};
+    memcpy(header_slot, &header, sizeof(header));
+    off_t header_offset = (off_t) (1 + header.generation % COMPRESSED_HEADER_COPIES) * PAGE_SLOT_SIZE;
+    pwrite_all(pager->fd, header_slot, PAGE_SLOT_SIZE, header_offset);
+    if (fdatasync(pager->fd) == -1) {
+        printf("Error syncing db file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager->generation = header.generation;
+    pager_release_slots(pager, pager->map_run);
+    pager->map_run = map_run;
+    for (SlotRun run: pager->pending_slots) {
+        pager_release_slots(pager, run);
+    }
+    pager->pending_slots.clear();
 }
 
 
-uint *node_parent(void *node) {
-    return reinterpret_cast<uint *>((char *) node + PARENT_POINTER_OFFSET);
+/**
+ * compresses a page into new slots and frees its old ones, or with
+ * keep_header_pages set leaves them to the next header; returns the bytes
+ * written. Called with Pager::mutex held.
+ */
+uint pager_write_compressed(Pager *pager, uint page_num, const char *page) {
+    if (page_num >= pager->page_map_capacity) {
+        uint capacity = std::max({2 * pager->page_map_capacity, page_num + 1, 64u});
+        pager->page_map = (PageMapEntry *) realloc(pager->page_map, capacity * sizeof(PageMapEntry));
+        memset(pager->page_map + pager->page_map_capacity, 0,
+               (capacity - pager->page_map_capacity) * sizeof(PageMapEntry));
+        pager->page_map_capacity = capacity;
+    }
+    uint length = page_compress(page, pager->compress_buffer);
+    const char *bytes = pager->compress_buffer;
+    if (slots_for(length) >= PAGE_MAX_SLOTS) {
+        length = PAGE_SIZE;
+        bytes = page;
+    } else {
+        memset(pager->compress_buffer + length, 0, slots_for(length) * PAGE_SLOT_SIZE - length);
+    }
+    PageMapEntry *entry = &pager->page_map[page_num];
+    if (entry->slot != 0 && pager->keep_header_pages) {
+        pager->pending_slots.push_back({entry->slot, slots_for(entry->length)});
+    } else if (entry->slot != 0) {
+        pager_release_slots(pager, {entry->slot, slots_for(entry->length)});
+    }
+    uint count = slots_for(length);
+    entry->slot = pager_allocate_slots(pager, count);
+    entry->length = length;
+    pwrite_all(pager->fd, bytes, (size_t) count * PAGE_SLOT_SIZE, (off_t) entry->slot * PAGE_SLOT_SIZE);
+    // between checkpoints the file would only grow, so a new header frees the slots once enough wait on one
+    if (pager->pending_slots.size() >= std::max(MIN_PENDING_SLOT_RUNS, pager->page_map_capacity / 8)) {
+        pager_write_page_map(pager);
+    }
+    return count * PAGE_SLOT_SIZE;
 }
 
 
-void update_internal_node_key(void *node, uint old_key, uint new_key) {
-    uint old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
+/**
+ * reads page_num into page and returns the bytes read from the file, or -1 on an
+ * uncompressed read error. A compressed page never written reads as zeros.
+ */
+ssize_t pager_read_page(Pager *pager, uint page_num, void *page) {
+    if (!pager->compressed) {
+        return pread(pager->fd, page, PAGE_SIZE, (off_t) page_num * PAGE_SIZE);
+    }
+    PageMapEntry entry{0, 0};
+    {
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        if (page_num < pager->page_map_capacity) {
+            entry = pager->page_map[page_num];
+        }
+    }
+    if (entry.slot == 0) {
+        memset(page, 0, PAGE_SIZE);
+        return 0;
+    }
+    // whole slots into an aligned buffer, as direct I/O needs
+    alignas(PAGE_SLOT_SIZE) char compressed[PAGE_SIZE];
+    char *buffer = entry.length == PAGE_SIZE ? (char *) page : compressed;
+    ssize_t bytes_read = pread(pager->fd, buffer, slots_for(entry.length) * PAGE_SLOT_SIZE,
+                               (off_t) entry.slot * PAGE_SLOT_SIZE);
+    if (bytes_read < (ssize_t) entry.length ||
+        (buffer == compressed && !page_decompress(compressed, entry.length, (char *) page))) {
+        printf("Error reading compressed page %d\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    return bytes_read;
 }
 
 
-uint internal_node_find_child(void *node, uint key) {
-    uint num_keys = *internal_node_num_keys(node);
-    uint min_index = 0;
-    uint max_index = num_keys;
+/**
+ * loads the newer valid header copy and its page map, and frees every slot
+ * between the headers and the end of the file that neither uses. Slots past
+ * the end were written after the last sync and are dropped.
+ */
+void pager_open_compressed(Pager *pager) {
+    CompressedHeader headers[COMPRESSED_HEADER_COPIES];
+    const CompressedHeader *header = nullptr;
+    for (uint i = 0; i < COMPRESSED_HEADER_COPIES; i++) {
+        if (pread(pager->fd, &headers[i], sizeof(CompressedHeader), (off_t) (1 + i) * PAGE_SLOT_SIZE) ==
+            sizeof(CompressedHeader) && headers[i].magic == COMPRESSED_MAGIC &&
+            headers[i].checksum == compressed_header_checksum(&headers[i]) &&
+            (header == nullptr || headers[i].generation > header->generation)) {
+            header = &headers[i];
+        }
+    }
+    if (header == nullptr || header->map_length != header->num_pages * sizeof(PageMapEntry)) {
+        printf("Compressed file header is corrupt\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->generation = header->generation;
+    pager->end_slot = header->end_slot;
+    pager->file_length = (off_t) header->num_pages * PAGE_SIZE;
+    pager->num_pages = header->num_pages;
+    pager->map_run = {header->map_slot, slots_for(header->map_length)};
+    pager->page_map_capacity = header->num_pages;
+    pager->page_map = (PageMapEntry *) malloc(std::max(header->map_length, 1u));
+    if (pread(pager->fd, pager->page_map, header->map_length, (off_t) header->map_slot * PAGE_SLOT_SIZE) !=
+        (ssize_t) header->map_length) {
+        printf("Error reading page map\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // lower_bound
-    while (min_index != max_index) {
-        uint index = (min_index + max_index) / 2;
-        uint key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key) {
-            max_index = index;
-        } else {
-            min_index = index + 1;
+    std::vector<SlotRun> used;
+    if (pager->map_run.count > 0) {
+        used.push_back(pager->map_run);
+    }
+    for (uint page_num = 0; page_num < header->num_pages; page_num++) {
+        PageMapEntry entry = pager->page_map[page_num];
+        if (entry.slot != 0) {
+            used.push_back({entry.slot, slots_for(entry.length)});
         }
     }
-    return min_index;
+    std::sort(used.begin(), used.end(), [](SlotRun a, SlotRun b) { return a.slot < b.slot; });
+    uint next = COMPRESSED_HEADER_SLOTS;
+    for (SlotRun run: used) {
+        if (run.slot < next || run.slot + run.count > pager->end_slot) {
+            printf("Page map is corrupt\n");
+            exit(EXIT_FAILURE);
+        }
+        pager_release_slots(pager, {next, run.slot - next});
+        next = run.slot + run.count;
+    }
+    pager_release_slots(pager, {next, pager->end_slot - next});
 }
 
-void internal_node_insert(Table *table, uint parent_page_num, uint child_page_num) {
-    void *parent = get_page(table->pager, parent_page_num);
-    void *child = get_page(table->pager, child_page_num);
-    uint child_max_key = get_node_max_key(child);
-    uint index = internal_node_find_child(parent, child_max_key);
-
-    uint original_num_keys = *internal_node_num_keys(parent);
-    *internal_node_num_keys(parent) = original_num_keys + 1;
 
-    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-        printf("Need to implement splitting internal node\n");
-        exit(EXIT_FAILURE);
+/**
+ * writes the pages of frames[0..count), which hold consecutive page numbers, with one pwritev
+ */
+void pager_write_pages(Pager *pager, const uint *frames, uint count) {
+    iovec iov[IOV_MAX];
+    uint first_page_num = pager->frames[frames[0]].page_num;
+    for (uint i = 0; i < count; i++) {
+        iov[i].iov_base = frame_page(pager, frames[i]);
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    off_t offset = (off_t) first_page_num * PAGE_SIZE;
+    iovec *next = iov;
+    int remaining = (int) count;
+    while (remaining > 0) {
+        ssize_t bytes_written = pwritev(pager->fd, next, remaining, offset);
+        if (bytes_written == -1) {
+            printf("Error writing\n");
+            exit(EXIT_FAILURE);
+        }
+        offset += bytes_written;
+        // skip fully written pages, trim a partially written one
+        while (remaining > 0 && (size_t) bytes_written >= next->iov_len) {
+            bytes_written -= (ssize_t) next->iov_len;
+            next++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            next->iov_base = (char *) next->iov_base + bytes_written;
+            next->iov_len -= bytes_written;
+        }
     }
+}
 
-    uint right_child_page_num = *internal_node_right_child(parent);
-    void *right_child = get_page(table->pager, right_child_page_num);
 
-    if (child_max_key > get_node_max_key(right_child)) {
-        // 当前页面已经是key最大的页面
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) = get_node_max_key(right_child);
-        *internal_node_right_child(parent) = child_page_num;
-    } else {
-        // key 从后向前拷贝
-        for (uint i = original_num_keys; i > index; i--) {
-            void *destination = internal_node_child(parent, i);
-            void *source = internal_node_cell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+/**
+ * writes frames[0..count), which hold consecutive page numbers, and marks them clean
+ */
+void pager_write_run(Pager *pager, const uint *frames, uint count) {
+    uint64_t start_ns = stats_now_ns();
+    uint first_page_num = pager->frames[frames[0]].page_num;
+    uint64_t bytes = (uint64_t) count * PAGE_SIZE;
+    if (pager->compressed) {
+        bytes = 0;
+        for (uint i = 0; i < count; i++) {
+            bytes += pager_write_compressed(pager, first_page_num + i, (const char *) frame_page(pager, frames[i]));
         }
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
+    } else {
+        pager_write_pages(pager, frames, count);
+    }
+    for (uint i = 0; i < count; i++) {
+        pager->frames[frames[i]].dirty = false;
     }
-}
\ No newline at end of file
+    stats_add(STAT_PAGES_WRITTEN, count);
+    stats_add(STAT_BYTES_WRITTEN, bytes);
+    stats_add(STAT_WRITE_NS, stats_now_ns() - start_ns);
+    off_t end = (off_t) (first_page_num + count) * PAGE_SIZE;
+    if (end > pager->file_length) {
+        pager->file_length = end;
+    }
+}
+
+
+void pager_write_frame(Pager *pager, uint frame) {
+    pager_write_run(pager, &frame, 1);
+}
+
+
+/**
+ * CLOCK replacement: sweep the frames, giving referenced pages a second chance,
+ * and write the victim back before its frame is reused. Read-ahead passes
+ * allow_dirty = false so it never waits on a write. A dirty page whose commit is
+ * not in the durable log yet is passed over, so that no sync runs under the
+ * mutex. Returns INVALID_FRAME when every candidate is pinned or waits on the
+ * log. Called with Pager::mutex held.
+ */
+uint pager_find_victim(Pager *pager, bool allow_dirty) {
+    uint64_t durable_lsn = pager->wal != nullptr ? wal_durable_lsn(pager->wal) : UINT64_MAX;
+    for (uint scanned = 0; scanned < 2 * pager->num_frames; scanned++) {
+        uint frame = pager->clock_hand;
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+        Frame *desc = &pager->frames[frame];
+        if (desc->pin_count > 0 || (desc->dirty && (!allow_dirty || desc->lsn > durable_lsn))) continue;
+        if (desc->referenced) {
+            desc->referenced = false;
+            continue;
+        }
+        if (desc->page_num != INVALID_PAGE_NUM) {
+            if (desc->dirty) {
+                pager_write_frame(pager, frame);
+            }
+            page_table_remove(pager, desc->page_num);
+            desc->page_num = INVALID_PAGE_NUM;
+        }
+        return frame;
+    }
+    return INVALID_FRAME;
+}
+
+
+/**
+ * a frame for a page that get_page is about to read in. When every frame is
+ * pinned but some only by read-ahead, waits for those reads to let go of them;
+ * when the only candidates wait on the log, syncs it with the mutex let go,
+ * without lingering for other commits.
+ */
+uint pager_evict(Pager *pager, std::unique_lock<std::mutex> &lock) {
+    uint frame = pager_find_victim(pager, true);
+    uint64_t lsn;
+    while (frame == INVALID_FRAME) {
+        if (pager->readahead_frames > 0) {
+            pager->loaded.wait(lock);
+        } else if (pager->wal != nullptr && (lsn = wal_unsynced_lsn(pager->wal)) != 0) {
+            lock.unlock();
+            wal_flush(pager->wal, lsn, false);
+            lock.lock();
+        } else {
+            break;
+        }
+        frame = pager_find_victim(pager, true);
+    }
+    if (frame == INVALID_FRAME) {
+        printf("Buffer pool exhausted: all %d frames are pinned\n", pager->num_frames);
+        exit(EXIT_FAILURE);
+    }
+    return frame;
+}
+
+
+/**
+ * extends the file and its mapping by whole extents until page_num is mapped
+ */
+void mmap_grow(Pager *pager, uint page_num) {
+    off_t old_length = pager->file_length;
+    uint extents = page_num / MMAP_EXTENT_PAGES + 1;
+    off_t new_length = (off_t) extents * MMAP_EXTENT_PAGES * PAGE_SIZE;
+    if ((size_t) new_length > MMAP_RESERVE_SIZE) {
+        printf("Database file exceeds the mmap reservation of %zu bytes\n", MMAP_RESERVE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    if (ftruncate(pager->fd, new_length) == -1) {
+        printf("Error extending db file\n");
+        exit(EXIT_FAILURE);
+    }
+    void *mapped = mmap(pager->map_base + old_length, new_length - old_length, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_FIXED, pager->fd, old_length);
+    if (mapped == MAP_FAILED) {
+        printf("Error mapping db file\n");
+        exit(EXIT_FAILURE);
+    }
+    // a partial last extent from a file truncated on close already has its latches
+    off_t extent_bytes = (off_t) MMAP_EXTENT_PAGES * PAGE_SIZE;
+    for (off_t extent = (old_length + extent_bytes - 1) / extent_bytes; extent < extents; extent++) {
+        pager->extent_latches[extent] = new std::shared_mutex[MMAP_EXTENT_PAGES];
+    }
+    pager->file_length = new_length;
+}
+
+
+/**
+ * returns the page pinned in the buffer pool; every call must be paired with unpin_page.
+ * In mmap mode the page is a pointer into the mapping and pinning is a no-op.
+ * Threads wanting a page that another thread is reading in wait for that read.
+ */
+void *get_page(Pager *pager, uint page_num) {
+    std::unique_lock<std::mutex> lock(pager->mutex);
+    if (pager->mode == PAGER_MMAP) {
+        if ((off_t) (page_num + 1) * PAGE_SIZE > pager->file_length) {
+            mmap_grow(pager, page_num);
+        }
+        if (pager->num_pages <= page_num) {
+            pager->num_pages = page_num + 1;
+        }
+        return pager->map_base + (size_t) page_num * PAGE_SIZE;
+    }
+    uint frame = page_table_lookup(pager, page_num);
+    if (frame != INVALID_FRAME) {
+        Frame *desc = &pager->frames[frame];
+        desc->pin_count++;
+        desc->referenced = true;
+        pager->loaded.wait(lock, [desc] { return !desc->loading; });
+        stats_add(STAT_PAGE_HITS, 1);
+        return frame_page(pager, frame);
+    }
+
+    stats_add(STAT_PAGE_MISSES, 1);
+    frame = pager_evict(pager, lock);
+    Frame *desc = &pager->frames[frame];
+    desc->page_num = page_num;
+    desc->pin_count = 1;
+    desc->referenced = true;
+    desc->lsn = 0;
+    page_table_insert(pager, page_num, frame);
+    if (pager->num_pages <= page_num) {
+        pager->num_pages = page_num + 1;
+    }
+
+    void *page = frame_page(pager, frame);
+    if ((off_t) page_num * PAGE_SIZE >= pager->file_length) {
+        memset(page, 0, PAGE_SIZE);
+        return page;
+    }
+    desc->loading = true;
+    lock.unlock();
+    ssize_t bytes_read = pager_read_page(pager, page_num, page);
+    if (bytes_read == -1) {
+        printf("Error reading file\n");
+        exit(EXIT_FAILURE);
+    }
+    stats_add(STAT_BYTES_READ, bytes_read);
+    lock.lock();
+    desc->loading = false;
+    pager->loaded.notify_all();
+    return page;
+}
+
+
+/**
+ * must be called before the page is changed: with the log on, the first call in a
+ * transaction saves the page for pager_commit to diff against and pins it until then
+ */
+void mark_page_dirty(Pager *pager, uint page_num) {
+    if (pager->mode == PAGER_MMAP) return;
+    std::lock_guard<std::mutex> lock(pager->mutex);
+    uint frame = page_table_lookup(pager, page_num);
+    if (frame == INVALID_FRAME || pager->frames[frame].pin_count == 0) {
+        printf("Tried to dirty page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Frame *desc = &pager->frames[frame];
+    desc->dirty = true;
+    if (pager->txn_tracking && !desc->in_txn) {
+        if (pager->num_txn_pages == MAX_TXN_PAGES) {
+            printf("Transaction changed more than %d pages\n", MAX_TXN_PAGES);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(pager->txn_before + (size_t) pager->num_txn_pages * PAGE_SIZE, frame_page(pager, frame), PAGE_SIZE);
+        pager->txn_pages[pager->num_txn_pages++] = page_num;
+        desc->in_txn = true;
+        desc->pin_count++;
+    }
+}
+
+
+void unpin_page(Pager *pager, uint page_num) {
+    if (pager->mode == PAGER_MMAP) return;
+    std::lock_guard<std::mutex> lock(pager->mutex);
+    uint frame = page_table_lookup(pager, page_num);
+    if (frame == INVALID_FRAME || pager->frames[frame].pin_count == 0) {
+        printf("Tried to unpin page %d which is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame].pin_count--;
+}
+
+
+/**
+ * the latch of a pinned page: one per frame, or one per page of the mapping in mmap mode
+ */
+std::shared_mutex *page_latch(Pager *pager, uint page_num) {
+    std::lock_guard<std::mutex> lock(pager->mutex);
+    if (pager->mode == PAGER_MMAP) {
+        return &pager->extent_latches[page_num / MMAP_EXTENT_PAGES][page_num % MMAP_EXTENT_PAGES];
+    }
+    return &pager->frame_latches[page_table_lookup(pager, page_num)];
+}
+
+
+/**
+ * pins the page and latches it; release both with unlatch_page
+ */
+void *latch_page(Pager *pager, uint page_num, LatchMode mode) {
+    void *page = get_page(pager, page_num);
+    std::shared_mutex *latch = page_latch(pager, page_num);
+    if (mode == LATCH_SHARED) {
+        latch->lock_shared();
+    } else {
+        latch->lock();
+    }
+    return page;
+}
+
+
+void unlatch_page(Pager *pager, uint page_num, LatchMode mode) {
+    std::shared_mutex *latch = page_latch(pager, page_num);
+    if (mode == LATCH_SHARED) {
+        latch->unlock_shared();
+    } else {
+        latch->unlock();
+    }
+    unpin_page(pager, page_num);
+}
+
+
+/**
+ * a raw io_uring: the submission and completion rings mapped from the kernel,
+ * and a thread reaping completions
+ */
+struct IoRing {
+    int fd;
+    std::mutex mutex;
+    uint *sq_head;
+    uint *sq_tail;
+    uint *sq_mask;
+    uint *sq_entries;
+    uint *sq_array;
+    io_uring_sqe *sqes;
+    uint *cq_head;
+    uint *cq_tail;
+    uint *cq_mask;
+    io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    std::atomic<uint> in_flight;
+    std::atomic<bool> stopping;
+    std::thread reaper;
+};
+
+#define IO_RING_ENTRIES 64
+#define IO_RING_STOP UINT64_MAX
+
+
+/**
+ * marks a read-ahead frame loaded and wakes anyone waiting for it; a failed or
+ * short asynchronous read of an uncompressed page is retried with pread
+ */
+void pager_finish_read(Pager *pager, uint frame, ssize_t bytes_read) {
+    if (!pager->compressed && bytes_read != PAGE_SIZE) {
+        off_t offset = (off_t) pager->frames[frame].page_num * PAGE_SIZE;
+        if (pread(pager->fd, frame_page(pager, frame), PAGE_SIZE, offset) == -1) {
+            printf("Error reading file\n");
+            exit(EXIT_FAILURE);
+        }
+        bytes_read = PAGE_SIZE;
+    }
+    stats_add(STAT_READAHEAD_PAGES, 1);
+    stats_add(STAT_BYTES_READ, bytes_read);
+    std::lock_guard<std::mutex> lock(pager->mutex);
+    Frame *desc = &pager->frames[frame];
+    desc->loading = false;
+    desc->pin_count--;
+    pager->readahead_frames--;
+    pager->loaded.notify_all();
+}
+
+
+void io_ring_reap(Pager *pager, IoRing *ring) {
+    while (true) {
+        uint head = *ring->cq_head;
+        uint tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data != IO_RING_STOP) {
+                pager_finish_read(pager, (uint) cqe->user_data, cqe->res);
+                ring->in_flight--;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (ring->stopping && ring->in_flight == 0) {
+            return;
+        }
+        syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+}
+
+
+/**
+ * queues one submission; called with IoRing::mutex held. Returns false when the
+ * submission ring is full.
+ */
+bool io_ring_queue(IoRing *ring, uint8_t opcode, int fd, void *buffer, uint length, off_t offset, uint64_t user_data) {
+    uint tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == *ring->sq_entries) {
+        return false;
+    }
+    uint index = tail & *ring->sq_mask;
+    io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+void io_ring_submit(IoRing *ring, uint count) {
+    while (count > 0) {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, count, 0, 0, nullptr, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            printf("Error submitting reads\n");
+            exit(EXIT_FAILURE);
+        }
+        count -= submitted;
+    }
+}
+
+
+/**
+ * sets up a ring, or returns null when the kernel refuses (too old, or io_uring
+ * disabled) and read-ahead falls back to threads
+ */
+IoRing *io_ring_create(Pager *pager) {
+    io_uring_params params{};
+    int fd = (int) syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (fd < 0) {
+        return nullptr;
+    }
+    auto *ring = new IoRing();
+    ring->fd = fd;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_map_size = ring->cq_map_size = std::max(ring->sq_map_size, ring->cq_map_size);
+    }
+    ring->sq_map = mmap(nullptr, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) && ring->sq_map != MAP_FAILED) {
+        ring->cq_map = mmap(nullptr, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe *) mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                       fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        printf("Unable to map io_uring\n");
+        exit(EXIT_FAILURE);
+    }
+
+    auto *sq = (char *) ring->sq_map;
+    ring->sq_head = (uint *) (sq + params.sq_off.head);
+    ring->sq_tail = (uint *) (sq + params.sq_off.tail);
+    ring->sq_mask = (uint *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = (uint *) (sq + params.sq_off.ring_entries);
+    ring->sq_array = (uint *) (sq + params.sq_off.array);
+    auto *cq = (char *) ring->cq_map;
+    ring->cq_head = (uint *) (cq + params.cq_off.head);
+    ring->cq_tail = (uint *) (cq + params.cq_off.tail);
+    ring->cq_mask = (uint *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->in_flight = 0;
+    ring->stopping = false;
+    ring->reaper = std::thread(io_ring_reap, pager, ring);
+    return ring;
+}
+
+
+/**
+ * waits for the reads in flight, then tears the ring down
+ */
+void io_ring_destroy(IoRing *ring) {
+    {
+        std::lock_guard<std::mutex> lock(ring->mutex);
+        ring->stopping = true;
+        // wakes the reaper even when nothing else is in flight; every earlier submission was consumed
+        io_ring_queue(ring, IORING_OP_NOP, -1, nullptr, 0, 0, IO_RING_STOP);
+        io_ring_submit(ring, 1);
+    }
+    ring->reaper.join();
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    delete ring;
+}
+
+
+/**
+ * starts reading the given pages into the pool without waiting for them. Pages
+ * already cached or past the end of the file are skipped, as is the rest of the
+ * batch once no clean frame is free or the reads in flight hold
+ * num_frames / READAHEAD_POOL_SHARE frames; get_page on a page still in flight waits
+ * for its read instead of issuing another. In mmap mode this is madvise(WILLNEED).
+ */
+void pager_prefetch(Pager *pager, const uint *page_nums, uint count) {
+    if (pager->mode == PAGER_MMAP) {
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        for (uint i = 0; i < count; i++) {
+            if ((off_t) (page_nums[i] + 1) * PAGE_SIZE <= pager->file_length) {
+                madvise(pager->map_base + (size_t) page_nums[i] * PAGE_SIZE, PAGE_SIZE, MADV_WILLNEED);
+            }
+        }
+        return;
+    }
+
+    uint frames[READAHEAD_LEAVES];
+    uint num_reads = 0;
+    {
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        uint budget = pager->num_frames / READAHEAD_POOL_SHARE;
+        uint available = budget > pager->readahead_frames ? budget - pager->readahead_frames : 0;
+        for (uint i = 0; i < count && num_reads < std::min<uint>(available, READAHEAD_LEAVES); i++) {
+            uint page_num = page_nums[i];
+            if ((off_t) (page_num + 1) * PAGE_SIZE > pager->file_length ||
+                page_table_lookup(pager, page_num) != INVALID_FRAME) {
+                continue;
+            }
+            uint frame = pager_find_victim(pager, false);
+            if (frame == INVALID_FRAME) {
+                break;
+            }
+            // the read holds a pin until pager_finish_read
+            pager->frames[frame] = {page_num, 1, true, false, true, false, 0};
+            page_table_insert(pager, page_num, frame);
+            frames[num_reads++] = frame;
+        }
+        pager->readahead_frames += num_reads;
+    }
+    if (num_reads == 0) {
+        return;
+    }
+
+    if (pager->io_ring == nullptr) {
+        for (uint i = 0; i < num_reads; i++) {
+            uint frame = frames[i];
+            thread_pool_submit(pager->io_pool, [pager, frame] {
+                uint page_num = pager->frames[frame].page_num;
+                pager_finish_read(pager, frame, pager_read_page(pager, page_num, frame_page(pager, frame)));
+            });
+        }
+        return;
+    }
+    IoRing *ring = pager->io_ring;
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    uint queued = 0;
+    for (uint i = 0; i < num_reads; i++) {
+        uint frame = frames[i];
+        off_t offset = (off_t) pager->frames[frame].page_num * PAGE_SIZE;
+        ring->in_flight++;
+        while (!io_ring_queue(ring, IORING_OP_READ, pager->fd, frame_page(pager, frame), PAGE_SIZE, offset, frame)) {
+            io_ring_submit(ring, queued);
+            queued = 0;
+        }
+        queued++;
+    }
+    io_ring_submit(ring, queued);
+}
+
+
+void pager_open_mmap(Pager *pager) {
+    void *reserved = mmap(nullptr, MMAP_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+        printf("Unable to reserve address space for mmap pager\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->map_base = (char *) reserved;
+    pager->extent_latches = new std::shared_mutex *[MMAP_RESERVE_SIZE / ((size_t) MMAP_EXTENT_PAGES * PAGE_SIZE)]();
+    for (off_t extent = 0; extent * MMAP_EXTENT_PAGES * PAGE_SIZE < pager->file_length; extent++) {
+        pager->extent_latches[extent] = new std::shared_mutex[MMAP_EXTENT_PAGES];
+    }
+    if (pager->file_length > 0) {
+        if ((size_t) pager->file_length > MMAP_RESERVE_SIZE) {
+            printf("Database file exceeds the mmap reservation of %zu bytes\n", MMAP_RESERVE_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        void *mapped = mmap(pager->map_base, pager->file_length, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, pager->fd, 0);
+        if (mapped == MAP_FAILED) {
+            printf("Error mapping db file\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/**
+ * maps the buffer pool's frames, rounding size up to whole huge pages when they
+ * can back it
+ */
+char *frame_arena_map(size_t *size) {
+    if (*size >= HUGE_PAGE_SIZE) {
+        size_t huge_size = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *arena = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                           -1, 0);
+        if (arena != MAP_FAILED) {
+            *size = huge_size;
+            return (char *) arena;
+        }
+    }
+    void *arena = mmap(nullptr, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        printf("Unable to allocate the buffer pool\n");
+        exit(EXIT_FAILURE);
+    }
+    madvise(arena, *size, MADV_HUGEPAGE);
+    return (char *) arena;
+}
+
+
+Pager *pager_open(const char *filename, const DbOptions *options) {
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+
+    auto *pager = new Pager();
+    pager->fd = fd;
+    pager->file_length = file_length;
+    pager->num_pages = (file_length / PAGE_SIZE);
+
+    uint32_t magic = 0;
+    if (file_length >= (off_t) sizeof(magic) && pread(fd, &magic, sizeof(magic), 0) == -1) {
+        printf("Error reading file\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->compressed = magic == COMPRESSED_MAGIC || (file_length == 0 && options->compress);
+    pager->page_map = nullptr;
+    pager->page_map_capacity = 0;
+    pager->compress_buffer = nullptr;
+    if ((pager->compressed || options->compress) && options->pager_mode == PAGER_MMAP) {
+        printf("Compressed files need the buffer pool pager\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options->direct_io && options->pager_mode == PAGER_MMAP) {
+        printf("Direct I/O needs the buffer pool pager\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pager->compressed) {
+        pager->compress_buffer = (char *) aligned_alloc(PAGE_SLOT_SIZE, slots_for(PAGE_COMPRESS_BOUND) * PAGE_SLOT_SIZE);
+        if (file_length == 0) {
+            pager->generation = 0;
+            pager->end_slot = COMPRESSED_HEADER_SLOTS;
+            pager->map_run = {COMPRESSED_HEADER_SLOTS, 0};
+            pwrite_all(fd, (const char *) &COMPRESSED_MAGIC, sizeof(COMPRESSED_MAGIC), 0);
+            pager_write_page_map(pager);
+        } else {
+            pager_open_compressed(pager);
+        }
+    } else if (file_length % PAGE_SIZE) {
+        printf("DB file is not a whole number of pages. Corrupt file\n");
+        exit(EXIT_FAILURE);
+    }
+    // the reads above need not be aligned; from here on every read and write is
+    if (options->direct_io && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == -1) {
+        printf("Direct I/O is not supported for this file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager->mode = options->pager_mode;
+    pager->map_base = nullptr;
+    pager->extent_latches = nullptr;
+    pager->io_ring = nullptr;
+    pager->io_pool = nullptr;
+    pager->wal = nullptr;
+    pager->txn_tracking = false;
+    pager->num_txn_pages = 0;
+    pager->txn_before = nullptr;
+    if (pager->mode == PAGER_MMAP) {
+        pager->num_frames = 0;
+        pager->frame_data = nullptr;
+        pager->frames = nullptr;
+        pager->frame_latches = nullptr;
+        pager->flush_frames = nullptr;
+        pager->page_table = nullptr;
+        pager_open_mmap(pager);
+        return pager;
+    }
+
+    uint pool_frames = options->pool_frames;
+    if (pool_frames < MIN_POOL_FRAMES) {
+        pool_frames = MIN_POOL_FRAMES;
+    }
+    pager->num_frames = pool_frames;
+    pager->frame_data_size = (size_t) pool_frames * PAGE_SIZE;
+    pager->frame_data = frame_arena_map(&pager->frame_data_size);
+    pager->frames = (Frame *) malloc(pool_frames * sizeof(Frame));
+    for (uint i = 0; i < pool_frames; i++) {
+        pager->frames[i] = {INVALID_PAGE_NUM, 0, false, false, false, false, 0};
+    }
+    pager->frame_latches = new std::shared_mutex[pool_frames];
+    pager->flush_frames = (uint *) malloc(pool_frames * sizeof(uint));
+    pager->clock_hand = 0;
+    pager->readahead_frames = 0;
+
+    // keep the page table at most half full
+    uint table_size = 1;
+    while (table_size < 2 * pool_frames) table_size <<= 1;
+    pager->page_table = (uint *) malloc(table_size * sizeof(uint));
+    for (uint i = 0; i < table_size; i++) {
+        pager->page_table[i] = INVALID_FRAME;
+    }
+    pager->page_table_mask = table_size - 1;
+
+    // ring reads land in the frame as they are on disk, which a compressed page is not
+    pager->io_ring = pager->compressed ? nullptr : io_ring_create(pager);
+    if (pager->io_ring == nullptr) {
+        pager->io_pool = thread_pool_create(READAHEAD_THREADS);
+    }
+    return pager;
+}
+
+
+void pager_flush(Pager *pager, uint page_num) {
+    if (pager->mode == PAGER_MMAP) {
+        if (msync(pager->map_base + (size_t) page_num * PAGE_SIZE, PAGE_SIZE, MS_SYNC) == -1) {
+            printf("Error syncing\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    // the log must be durable up to the page's last commit; it is synced with the mutex let go
+    std::unique_lock<std::mutex> lock(pager->mutex);
+    while (true) {
+        uint frame = page_table_lookup(pager, page_num);
+        if (frame == INVALID_FRAME) {
+            printf("Tried to flush page %d which is not cached\n", page_num);
+            exit(EXIT_FAILURE);
+        }
+        Frame *desc = &pager->frames[frame];
+        if (!desc->dirty || desc->in_txn) {
+            return;
+        }
+        if (pager->wal == nullptr || desc->lsn <= wal_durable_lsn(pager->wal)) {
+            pager_write_frame(pager, frame);
+            return;
+        }
+        uint64_t lsn = desc->lsn;
+        lock.unlock();
+        wal_flush(pager->wal, lsn, false);
+        lock.lock();
+    }
+}
+
+
+/**
+ * writes back every committed dirty page in page number order, one pwritev per run of adjacent pages
+ */
+void pager_flush_all(Pager *pager) {
+    if (pager->mode == PAGER_MMAP) {
+        if (pager->num_pages > 0 && msync(pager->map_base, (size_t) pager->num_pages * PAGE_SIZE, MS_SYNC) == -1) {
+            printf("Error syncing\n");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if (pager->wal != nullptr) {
+        wal_flush(pager->wal, pager->wal->appended_lsn, false);
+    }
+    std::lock_guard<std::mutex> lock(pager->mutex);
+    uint *dirty = pager->flush_frames;
+    uint num_dirty = 0;
+    for (uint i = 0; i < pager->num_frames; i++) {
+        Frame *desc = &pager->frames[i];
+        if (desc->page_num != INVALID_PAGE_NUM && desc->dirty && !desc->in_txn) {
+            dirty[num_dirty++] = i;
+        }
+    }
+    std::sort(dirty, dirty + num_dirty, [pager](uint a, uint b) {
+        return pager->frames[a].page_num < pager->frames[b].page_num;
+    });
+
+    uint run_start = 0;
+    for (uint i = 1; i <= num_dirty; i++) {
+        bool run_ends = i == num_dirty || i - run_start == IOV_MAX ||
+                        pager->frames[dirty[i]].page_num != pager->frames[dirty[i - 1]].page_num + 1;
+        if (run_ends) {
+            pager_write_run(pager, dirty + run_start, i - run_start);
+            run_start = i;
+        }
+    }
+}
+
+
+uint32_t wal_checksum(const WalRecordHeader *header, const char *payload) {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const char *bytes, size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            hash = (hash ^ (uint8_t) bytes[i]) * 16777619u;
+        }
+    };
+    mix((const char *) header, offsetof(WalRecordHeader, checksum));
+    mix(payload, header->length);
+    return hash;
+}
+
+
+/**
+ * appends a record to the log buffer and returns the lsn just past it
+ */
+uint64_t wal_append(Wal *wal, WalRecordType type, uint page_num, const char *payload, uint length) {
+    WalRecordHeader header{type, page_num, length, 0};
+    header.checksum = wal_checksum(&header, payload);
+    std::lock_guard<std::mutex> lock(wal->mutex);
+    size_t needed = wal->buffer_length + sizeof(header) + length;
+    if (needed > wal->buffer_capacity) {
+        wal->buffer_capacity = std::max(needed, 2 * wal->buffer_capacity);
+        wal->buffer = (char *) realloc(wal->buffer, wal->buffer_capacity);
+    }
+    memcpy(wal->buffer + wal->buffer_length, &header, sizeof(header));
+    memcpy(wal->buffer + wal->buffer_length + sizeof(header), payload, length);
+    wal->buffer_length = needed;
+    wal->appended_lsn += sizeof(header) + length;
+    return wal->appended_lsn;
+}
+
+
+uint64_t wal_durable_lsn(Wal *wal) {
+    std::lock_guard<std::mutex> lock(wal->mutex);
+    return wal->durable_lsn;
+}
+
+
+/**
+ * the end of the log when part of it is not durable yet, 0 when all of it is
+ */
+uint64_t wal_unsynced_lsn(Wal *wal) {
+    std::lock_guard<std::mutex> lock(wal->mutex);
+    return wal->durable_lsn < wal->appended_lsn ? wal->appended_lsn : 0;
+}
+
+
+/**
+ * returns once the log is durable up to lsn. Group commit: the first waiter
+ * becomes the leader, lingers group_commit_us when linger is set so more commits
+ * can join, then writes and syncs everything buffered; the rest wait on its
+ * sync. Only commits linger: a write-back waiting on the log does not.
+ */
+void wal_flush(Wal *wal, uint64_t lsn, bool linger) {
+    std::unique_lock<std::mutex> lock(wal->mutex);
+    while (wal->durable_lsn < lsn) {
+        if (wal->flushing) {
+            wal->flushed.wait(lock);
+            continue;
+        }
+        wal->flushing = true;
+        if (linger && wal->group_commit_us > 0) {
+            lock.unlock();
+            usleep(wal->group_commit_us);
+            lock.lock();
+        }
+        std::swap(wal->buffer, wal->spare);
+        std::swap(wal->buffer_capacity, wal->spare_capacity);
+        size_t length = wal->buffer_length;
+        off_t offset = (off_t) (wal->buffer_lsn - wal->file_start_lsn);
+        uint64_t end_lsn = wal->appended_lsn;
+        wal->buffer_length = 0;
+        wal->buffer_lsn = end_lsn;
+        lock.unlock();
+
+        size_t written = 0;
+        while (written < length) {
+            ssize_t bytes_written = pwrite(wal->fd, wal->spare + written, length - written, offset + (off_t) written);
+            if (bytes_written == -1) {
+                printf("Error writing log\n");
+                exit(EXIT_FAILURE);
+            }
+            written += bytes_written;
+        }
+        if (fdatasync(wal->fd) == -1) {
+            printf("Error syncing log\n");
+            exit(EXIT_FAILURE);
+        }
+        stats_add(STAT_LOG_BYTES_WRITTEN, length);
+        stats_add(STAT_LOG_SYNCS, 1);
+
+        lock.lock();
+        wal->durable_lsn = end_lsn;
+        wal->flushing = false;
+        wal->flushed.notify_all();
+    }
+}
+
+
+/**
+ * appends the byte runs that differ between before and after, merging runs
+ * separated by fewer than WAL_RUN_GAP equal bytes, and returns the payload length
+ */
+uint wal_page_delta(const char *before, const char *after, char *payload) {
+    uint length = 0;
+    uint i = 0;
+    while (i < PAGE_SIZE) {
+        if (before[i] == after[i]) {
+            i++;
+            continue;
+        }
+        uint start = i;
+        uint end = i + 1;
+        for (uint j = end; j < PAGE_SIZE && j - end < WAL_RUN_GAP; j++) {
+            if (before[j] != after[j]) {
+                end = j + 1;
+            }
+        }
+        auto run_offset = (uint16_t) start;
+        auto run_length = (uint16_t) (end - start);
+        memcpy(payload + length, &run_offset, sizeof(run_offset));
+        memcpy(payload + length + sizeof(run_offset), &run_length, sizeof(run_length));
+        memcpy(payload + length + 2 * sizeof(uint16_t), after + start, run_length);
+        length += 2 * sizeof(uint16_t) + run_length;
+        i = end;
+    }
+    return length;
+}
+
+
+void wal_apply_delta(Pager *pager, uint page_num, const char *payload, uint length) {
+    char *page = (char *) get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    uint pos = 0;
+    while (pos + 2 * sizeof(uint16_t) <= length) {
+        uint16_t run_offset, run_length;
+        memcpy(&run_offset, payload + pos, sizeof(run_offset));
+        memcpy(&run_length, payload + pos + sizeof(run_offset), sizeof(run_length));
+        pos += 2 * sizeof(uint16_t);
+        if (pos + run_length > length || run_offset + run_length > PAGE_SIZE) break;
+        memcpy(page + run_offset, payload + pos, run_length);
+        pos += run_length;
+    }
+    unpin_page(pager, page_num);
+}
+
+
+/**
+ * redoes every committed transaction in the log, stopping at the first torn or
+ * corrupt record, and returns how many were redone
+ */
+uint wal_replay(Pager *pager, int fd) {
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        return 0;
+    }
+    auto *log = (char *) malloc(size);
+    off_t bytes_read = 0;
+    while (bytes_read < size) {
+        ssize_t n = pread(fd, log + bytes_read, size - bytes_read, bytes_read);
+        if (n <= 0) {
+            printf("Error reading log\n");
+            exit(EXIT_FAILURE);
+        }
+        bytes_read += n;
+    }
+
+    uint num_txns = 0;
+    off_t txn_start = 0;
+    off_t pos = 0;
+    while (pos + (off_t) sizeof(WalRecordHeader) <= size) {
+        WalRecordHeader header{};
+        memcpy(&header, log + pos, sizeof(header));
+        const char *payload = log + pos + sizeof(header);
+        if (pos + (off_t) sizeof(header) + header.length > size ||
+            wal_checksum(&header, payload) != header.checksum) {
+            break;
+        }
+        if (header.type == WAL_COMMIT) {
+            off_t record = txn_start;
+            while (record < pos) {
+                WalRecordHeader delta{};
+                memcpy(&delta, log + record, sizeof(delta));
+                wal_apply_delta(pager, delta.page_num, log + record + sizeof(delta), delta.length);
+                record += sizeof(delta) + delta.length;
+            }
+            num_txns++;
+            txn_start = pos + sizeof(header);
+        } else if (header.type != WAL_PAGE_DELTA) {
+            break;
+        }
+        pos += sizeof(header) + header.length;
+    }
+    free(log);
+    return num_txns;
+}
+
+
+void pager_sync(Pager *pager) {
+    pager_flush_all(pager);
+    if (fdatasync(pager->fd) == -1) {
+        printf("Error syncing db file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pager->compressed) {
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        pager_write_page_map(pager);
+    }
+}
+
+
+/**
+ * replays a log left behind by a crash into the database file, then empties it;
+ * with the log enabled it stays open for writing and transactions are tracked
+ */
+void wal_open(Pager *pager, const char *filename, const DbOptions *options) {
+    size_t path_length = strlen(filename) + sizeof("-wal");
+    auto *path = (char *) malloc(path_length);
+    snprintf(path, path_length, "%s-wal", filename);
+
+    if (options->wal && pager->mode == PAGER_MMAP) {
+        printf("The write-ahead log needs the buffer pool pager\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = open(path, options->wal ? O_RDWR | O_CREAT : O_RDWR, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        if (options->wal) {
+            printf("Unable to open log file %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        free(path);
+        return;
+    }
+    pager->keep_header_pages = true;
+    uint num_txns = wal_replay(pager, fd);
+    if (num_txns > 0) {
+        pager_sync(pager);
+        printf("Recovered %d transactions from %s\n", num_txns, path);
+    }
+    if (ftruncate(fd, 0) == -1 || fdatasync(fd) == -1) {
+        printf("Error truncating log\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!options->wal) {
+        close(fd);
+        unlink(path);
+        free(path);
+        pager->keep_header_pages = false;
+        return;
+    }
+
+    Wal *wal = new Wal();
+    wal->fd = fd;
+    wal->path = path;
+    wal->buffer_capacity = wal->spare_capacity = 64 * PAGE_SIZE;
+    wal->buffer = (char *) malloc(wal->buffer_capacity);
+    wal->spare = (char *) malloc(wal->spare_capacity);
+    wal->group_commit_us = options->group_commit_us;
+    wal->checkpoint_bytes = options->checkpoint_bytes ? options->checkpoint_bytes : DEFAULT_WAL_CHECKPOINT_BYTES;
+    pager->wal = wal;
+    pager->txn_before = (char *) malloc((size_t) MAX_TXN_PAGES * PAGE_SIZE);
+    pager->txn_tracking = true;
+}
+
+
+/**
+ * writes every page to the database file and empties the log. Must not run
+ * inside a transaction.
+ */
+void pager_checkpoint(Pager *pager) {
+    Wal *wal = pager->wal;
+    pager_sync(pager);
+    if (wal == nullptr) {
+        return;
+    }
+    if (ftruncate(wal->fd, 0) == -1 || fdatasync(wal->fd) == -1) {
+        printf("Error truncating log\n");
+        exit(EXIT_FAILURE);
+    }
+    std::lock_guard<std::mutex> lock(wal->mutex);
+    wal->file_start_lsn = wal->appended_lsn;
+}
+
+
+/**
+ * logs the changes to every page the transaction dirtied and releases the pages.
+ * Returns the lsn the commit is durable at, for wal_flush, or 0 without a log.
+ * The writer calls this; waiting for the flush can happen after it lets go.
+ */
+uint64_t pager_log_commit(Pager *pager) {
+    Wal *wal = pager->wal;
+    if (wal == nullptr || pager->num_txn_pages == 0) {
+        return 0;
+    }
+    char payload[2 * PAGE_SIZE];
+    uint frames[MAX_TXN_PAGES];
+    {
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        for (uint i = 0; i < pager->num_txn_pages; i++) {
+            frames[i] = page_table_lookup(pager, pager->txn_pages[i]);
+        }
+    }
+    for (uint i = 0; i < pager->num_txn_pages; i++) {
+        uint page_num = pager->txn_pages[i];
+        const char *before = pager->txn_before + (size_t) i * PAGE_SIZE;
+        uint length = wal_page_delta(before, (const char *) frame_page(pager, frames[i]), payload);
+        if (length > 0) {
+            wal_append(wal, WAL_PAGE_DELTA, page_num, payload, length);
+        }
+    }
+    uint64_t commit_lsn = wal_append(wal, WAL_COMMIT, 0, "", 0);
+    {
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        for (uint i = 0; i < pager->num_txn_pages; i++) {
+            Frame *desc = &pager->frames[frames[i]];
+            desc->lsn = commit_lsn;
+            desc->in_txn = false;
+            desc->pin_count--;
+        }
+    }
+    pager->num_txn_pages = 0;
+
+    if (wal->appended_lsn - wal->file_start_lsn > wal->checkpoint_bytes) {
+        pager_checkpoint(pager);
+    }
+    return commit_lsn;
+}
+
+
+/**
+ * logs the transaction and returns once it is durable
+ */
+void pager_commit(Pager *pager) {
+    uint64_t commit_lsn = pager_log_commit(pager);
+    if (commit_lsn != 0) {
+        wal_flush(pager->wal, commit_lsn, true);
+    }
+}
+
+
+void pager_close(Pager *pager) {
+    if (pager->io_ring != nullptr) {
+        io_ring_destroy(pager->io_ring);
+    }
+    if (pager->io_pool != nullptr) {
+        thread_pool_destroy(pager->io_pool);
+    }
+
+    Wal *wal = pager->wal;
+    if (wal != nullptr) {
+        pager_checkpoint(pager);
+        close(wal->fd);
+        unlink(wal->path);
+        free(wal->path);
+        free(wal->buffer);
+        free(wal->spare);
+        delete wal;
+        free(pager->txn_before);
+    } else if (pager->compressed) {
+        pager_sync(pager);
+    } else {
+        pager_flush_all(pager);
+    }
+    if (pager->compressed && ftruncate(pager->fd, (off_t) pager->end_slot * PAGE_SLOT_SIZE) == -1) {
+        printf("Error truncating db file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pager->mode == PAGER_MMAP) {
+        munmap(pager->map_base, MMAP_RESERVE_SIZE);
+        for (off_t extent = 0; extent * MMAP_EXTENT_PAGES * PAGE_SIZE < pager->file_length; extent++) {
+            delete[] pager->extent_latches[extent];
+        }
+        delete[] pager->extent_latches;
+        // drop the unused tail of the last extent
+        if (ftruncate(pager->fd, (off_t) pager->num_pages * PAGE_SIZE) == -1) {
+            printf("Error truncating db file\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int result = close(pager->fd);
+    if (result == -1) {
+        printf("Error closing db file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(pager->page_map);
+    free(pager->compress_buffer);
+    free(pager->page_table);
+    free(pager->flush_frames);
+    free(pager->frames);
+    if (pager->frame_data != nullptr) {
+        munmap(pager->frame_data, pager->frame_data_size);
+    }
+    delete[] pager->frame_latches;
+    delete pager;
+}
+
+
+/**
+ * 1. flushes the page cache to disk, checkpointing and removing the log
+ * 2. closes the database file
+ * 3. frees the memory for the pager and table data structures
+ * @param table
+ */
+void db_close(Table *table) {
+    thread_pool_destroy(table->scan_pool);
+    pager_close(table->pager);
+    if (table->output_fd != STDOUT_FILENO) {
+        close(table->output_fd);
+    }
+    free(table->filename);
+    delete table;
+}
+
+
+/* the table this thread is inside the gate of, and how many nested calls deep */
+thread_local Table *entered_table = nullptr;
+thread_local uint entered_depth = 0;
+
+
+void table_gate_release(Table *table) {
+    if (table->num_entered.fetch_sub(1) == 1 && table->swapping.load()) {
+        std::lock_guard<std::mutex> lock(table->gate_mutex);
+        table->gate_changed.notify_all();
+    }
+}
+
+
+/**
+ * statements run between table_enter and table_leave, which nest within a thread.
+ * table_vacuum closes the gate to swap the table's file: it waits for the
+ * statements inside to leave and holds new ones back until it opens it again.
+ * Threads working for a statement, like scan workers, rely on its entry.
+ */
+void table_enter(Table *table) {
+    if (entered_table == table) {
+        entered_depth++;
+        return;
+    }
+    while (true) {
+        table->num_entered.fetch_add(1);
+        if (!table->swapping.load()) {
+            break;
+        }
+        table_gate_release(table);
+        std::unique_lock<std::mutex> lock(table->gate_mutex);
+        table->gate_changed.wait(lock, [table] { return !table->swapping.load(); });
+    }
+    if (entered_table == nullptr) {
+        entered_table = table;
+        entered_depth = 1;
+    }
+}
+
+
+void table_leave(Table *table) {
+    if (entered_table == table) {
+        if (--entered_depth > 0) {
+            return;
+        }
+        entered_table = nullptr;
+    }
+    table_gate_release(table);
+}
+
+
+struct TableGuard {
+    Table *table;
+
+    explicit TableGuard(Table *table) : table(table) { table_enter(table); }
+
+    ~TableGuard() { table_leave(table); }
+};
+
+
+/**
+ * waits for every statement to leave the gate and keeps new ones out
+ */
+void table_close_gate(Table *table) {
+    table->swapping = true;
+    std::unique_lock<std::mutex> lock(table->gate_mutex);
+    table->gate_changed.wait(lock, [table] { return table->num_entered.load() == 0; });
+}
+
+
+void table_open_gate(Table *table) {
+    {
+        std::lock_guard<std::mutex> lock(table->gate_mutex);
+        table->swapping = false;
+    }
+    table->gate_changed.notify_all();
+}
+
+
+uint *leaf_node_num_cells(void *node) {
+    return reinterpret_cast<uint *>((char *) node + LEAF_NODE_NUM_CELLS_OFFSET);
+}
+
+
+uint *leaf_node_key(void *node, uint cell_num) {
+    return reinterpret_cast<uint *>((char *) node + LEAF_NODE_KEYS_OFFSET) + cell_num;
+}
+
+
+uint16_t *leaf_node_heap_start(void *node) {
+    return reinterpret_cast<uint16_t *>((char *) node + LEAF_NODE_HEAP_START_OFFSET);
+}
+
+
+/**
+ * the slot directory sits right after the key array, so it moves as cells come and go
+ */
+uint16_t *leaf_node_slots(void *node) {
+    return reinterpret_cast<uint16_t *>((char *) leaf_node_key(node, *leaf_node_num_cells(node)));
+}
+
+
+void *leaf_node_value(void *node, uint cell_num) {
+    return (char *) node + leaf_node_slots(node)[cell_num];
+}
+
+
+uint leaf_node_free_space(void *node) {
+    return *leaf_node_heap_start(node) - LEAF_NODE_KEYS_OFFSET - *leaf_node_num_cells(node) * LEAF_NODE_CELL_OVERHEAD;
+}
+
+
+/**
+ * puts a row at cell_num; the caller has checked that the page has room for it
+ */
+void leaf_node_insert_cell(void *node, uint cell_num, uint key, const Row *value) {
+    uint num_cells = *leaf_node_num_cells(node);
+    uint16_t *slots = leaf_node_slots(node);
+
+    // the directory shifts by one key: move its tail (past the new slot) first, then its head, then the keys
+    memmove(slots + 2 + cell_num + 1, slots + cell_num, (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+    memmove(slots + 2, slots, cell_num * LEAF_NODE_SLOT_SIZE);
+    memmove(leaf_node_key(node, cell_num + 1), leaf_node_key(node, cell_num),
+            (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+
+    uint16_t heap_start = *leaf_node_heap_start(node) - serialized_row_size(value);
+    serialize_row(value, (char *) node + heap_start);
+    *leaf_node_heap_start(node) = heap_start;
+    *leaf_node_key(node, cell_num) = key;
+    *leaf_node_num_cells(node) = num_cells + 1;
+    leaf_node_slots(node)[cell_num] = heap_start;
+}
+
+
+/**
+ * rewrites a leaf's body from scratch with the given cells, packing the rows
+ * and zeroing the free space between directory and rows
+ */
+void leaf_node_build(void *node, uint num_cells, const uint *keys, void *const *values) {
+    *leaf_node_num_cells(node) = num_cells;
+    memcpy(leaf_node_key(node, 0), keys, num_cells * LEAF_NODE_KEY_SIZE);
+    uint16_t *slots = leaf_node_slots(node);
+    uint heap_start = PAGE_SIZE;
+    for (uint i = 0; i < num_cells; i++) {
+        uint size = serialized_size(values[i]);
+        heap_start -= size;
+        memcpy((char *) node + heap_start, values[i], size);
+        slots[i] = heap_start;
+    }
+    *leaf_node_heap_start(node) = heap_start;
+    char *free_start = (char *) (slots + num_cells);
+    memset(free_start, 0, (char *) node + heap_start - free_start);
+}
+
+
+/**
+ * removes the row at cell_num, repacking the rows so the freed bytes count as free space
+ */
+void leaf_node_remove_cell(void *node, uint cell_num) {
+    char copy[PAGE_SIZE];
+    memcpy(copy, node, PAGE_SIZE);
+    uint num_cells = *leaf_node_num_cells(copy);
+    uint keys[LEAF_NODE_MAX_CELLS];
+    void *values[LEAF_NODE_MAX_CELLS];
+    for (uint i = 0, n = 0; i < num_cells; i++) {
+        if (i != cell_num) {
+            keys[n] = *leaf_node_key(copy, i);
+            values[n++] = leaf_node_value(copy, i);
+        }
+    }
+    leaf_node_build(node, num_cells - 1, keys, values);
+}
+
+
+uint leaf_node_used_bytes(void *node) {
+    return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+}
+
+
+/**
+ * index of the first key >= key in a sorted array (lower bound). Binary search
+ * narrows the range to a few cache lines, then a vector kernel counts the keys
+ * below the target: on sorted input that count is the answer.
+ */
+const uint KEY_SEARCH_LINEAR_THRESHOLD = 32;
+
+uint count_keys_below_scalar(const uint *keys, uint num_keys, uint key) {
+    uint count = 0;
+    for (uint i = 0; i < num_keys; i++) {
+        count += keys[i] < key;
+    }
+    return count;
+}
+
+#if defined(__x86_64__)
+
+uint count_keys_below_sse2(const uint *keys, uint num_keys, uint key) {
+    // SSE compares are signed; flipping the sign bit orders unsigned keys correctly
+    const __m128i bias = _mm_set1_epi32((int) 0x80000000);
+    const __m128i target = _mm_xor_si128(_mm_set1_epi32((int) key), bias);
+    uint count = 0;
+    uint i = 0;
+    for (; i + 4 <= num_keys; i += 4) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (keys + i)), bias);
+        count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, v))));
+    }
+    return count + count_keys_below_scalar(keys + i, num_keys - i, key);
+}
+
+__attribute__((target("avx2")))
+uint count_keys_below_avx2(const uint *keys, uint num_keys, uint key) {
+    const __m256i bias = _mm256_set1_epi32((int) 0x80000000);
+    const __m256i target = _mm256_xor_si256(_mm256_set1_epi32((int) key), bias);
+    uint count = 0;
+    uint i = 0;
+    for (; i + 8 <= num_keys; i += 8) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (keys + i)), bias);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, v))));
+    }
+    return count + count_keys_below_sse2(keys + i, num_keys - i, key);
+}
+
+typedef uint (*CountKeysBelowFn)(const uint *, uint, uint);
+
+CountKeysBelowFn select_count_keys_below() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? count_keys_below_avx2 : count_keys_below_sse2;
+}
+
+const CountKeysBelowFn count_keys_below = select_count_keys_below();
+
+#else
+
+uint (*const count_keys_below)(const uint *, uint, uint) = count_keys_below_scalar;
+
+#endif
+
+uint key_lower_bound(const uint *keys, uint num_keys, uint key) {
+    uint min_index = 0;
+    uint max_index = num_keys;
+    while (max_index - min_index > KEY_SEARCH_LINEAR_THRESHOLD) {
+        uint index = (min_index + max_index) / 2;
+        if (keys[index] >= key) {
+            max_index = index;
+        } else {
+            min_index = index + 1;
+        }
+    }
+    return min_index + count_keys_below(keys + min_index, max_index - min_index, key);
+}
+
+
+/**
+ * whether node, latched, still holds the cursor's key at the cursor's cell
+ */
+bool cursor_is_current(Cursor *cursor, void *node) {
+    return get_node_type(node) == NODE_LEAF && cursor->cell_num < *leaf_node_num_cells(node) &&
+           *leaf_node_key(node, cursor->cell_num) == cursor->key;
+}
+
+
+/**
+ * the value's page stays latched shared; release it with
+ * unlatch_page(pager, cursor->page_num, LATCH_SHARED). Returns null when the
+ * cursor's row is gone and nothing follows it.
+ */
+void *cursor_value(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    while (!cursor->end_of_table) {
+        void *node = latch_page(pager, cursor->page_num, LATCH_SHARED);
+        if (cursor_is_current(cursor, node)) {
+            return leaf_node_value(node, cursor->cell_num);
+        }
+        unlatch_page(pager, cursor->page_num, LATCH_SHARED);
+        cursor_seek(cursor, cursor->key);
+    }
+    return nullptr;
+}
+
+
+/**
+ * starts reading the READAHEAD_LEAVES leaves after the cursor's, taking their
+ * page numbers from the leaf's parent, and sets the key half way through them
+ * at which the next batch is requested
+ */
+void cursor_readahead(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    uint page_num = cursor->table->root_page_num;
+    void *node = latch_page(pager, page_num, LATCH_SHARED);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint child_index = internal_node_find_child(node, cursor->key);
+        uint child_page_num = *internal_node_child(node, child_index);
+        void *child = latch_page(pager, child_page_num, LATCH_SHARED);
+        if (get_node_type(child) == NODE_LEAF) {
+            unlatch_page(pager, child_page_num, LATCH_SHARED);
+            uint num_keys = *internal_node_num_keys(node);
+            uint last = std::min(child_index + READAHEAD_LEAVES, num_keys);
+            uint page_nums[READAHEAD_LEAVES];
+            uint count = 0;
+            for (uint i = child_index + 1; i <= last; i++) {
+                page_nums[count++] = *internal_node_child(node, i);
+            }
+            // past the parent's last separator the next batch lives under another parent
+            uint trigger = std::min(child_index + READAHEAD_LEAVES / 2, num_keys);
+            cursor->readahead_key = trigger < num_keys ? *internal_node_key(node, trigger) : cursor->key;
+            unlatch_page(pager, page_num, LATCH_SHARED);
+            pager_prefetch(pager, page_nums, count);
+            return;
+        }
+        unlatch_page(pager, page_num, LATCH_SHARED);
+        page_num = child_page_num;
+        node = child;
+    }
+    unlatch_page(pager, page_num, LATCH_SHARED);
+}
+
+
+void cursor_advance(Cursor *cursor) {
+    Pager *pager = cursor->table->pager;
+    if (cursor->key == UINT32_MAX) {
+        cursor->end_of_table = true;
+        return;
+    }
+    uint page_num = cursor->page_num;
+    void *node = latch_page(pager, page_num, LATCH_SHARED);
+    if (cursor_is_current(cursor, node)) {
+        leaf_node_find(cursor, page_num, node, cursor->key + 1);
+    } else {
+        unlatch_page(pager, page_num, LATCH_SHARED);
+        cursor_seek(cursor, cursor->key + 1);
+    }
+    // only scans cross leaves, so point lookups never read ahead
+    if (cursor->page_num != page_num && !cursor->end_of_table && cursor->key > cursor->readahead_key) {
+        cursor_readahead(cursor);
+    }
+}
+
+
+/**
+ * cursor_next_row for threads that run inside their statement's entry
+ */
+bool cursor_read_row(Cursor *cursor, uint id_hi, Row *row) {
+    if (cursor->end_of_table) {
+        return false;
+    }
+    void *value = cursor_value(cursor);
+    if (value == nullptr) {
+        return false;
+    }
+    deserialize_row(value, row);
+    unlatch_page(cursor->table->pager, cursor->page_num, LATCH_SHARED);
+    if (row->id > id_hi) {
+        return false;
+    }
+    cursor_advance(cursor);
+    return true;
+}
+
+
+/**
+ * reads the row under the cursor into row and moves past it
+ * @return false at the end of the table or once the row's id is past id_hi
+ */
+bool cursor_next_row(Cursor *cursor, uint id_hi, Row *row) {
+    TableGuard guard(cursor->table);
+    return cursor_read_row(cursor, id_hi, row);
+}
+
+
+/**
+ * stops a parallel scan after limit rows
+ */
+struct LimitSink {
+    uint limit;
+    uint num_rows;
+    RowSink sink;
+    void *context;
+};
+
+
+bool limit_row_sink(const Row *row, void *context) {
+    auto *limited = (LimitSink *) context;
+    if (limited->num_rows == limited->limit) {
+        return false;
+    }
+    return limited->sink(row, limited->context) && ++limited->num_rows < limited->limit;
+}
+
+
+#define INDEX_LOOKUP_BATCH 64
+
+
+/**
+ * hands the rows a select statement matches to sink, on the calling thread; a
+ * select count(*) goes to table_count_rows instead. An offset into an id range
+ * is skipped through the tree's row counts, one into an index lookup row by row.
+ * Safe to run from several threads at once, alongside a writer.
+ */
+ExecuteResult table_select(Table *table, const Statement *statement, RowSink sink, void *context) {
+    StatsTimer timer(STAT_SELECT_NS);
+    TableGuard guard(table);
+    if (statement->by_index) {
+        // ids come from the index a batch at a time, and no index page is latched while rows are fetched
+        uint ids[INDEX_LOOKUP_BATCH];
+        uint from_id = statement->id_lo;
+        uint num_rows = 0;
+        uint num_skipped = 0;
+        while (num_rows < statement->limit) {
+            uint count = index_lookup(table, statement->index_column, statement->index_key, from_id, ids, INDEX_LOOKUP_BATCH);
+            for (uint i = 0; i < count && num_rows < statement->limit; i++) {
+                Row row;
+                if (ids[i] > statement->id_hi) {
+                    return EXECUTE_SUCCESS;
+                }
+                if (!table_get(table, ids[i], &row)) {
+                    continue;
+                }
+                if (num_skipped < statement->offset) {
+                    num_skipped++;
+                    continue;
+                }
+                num_rows++;
+                if (!sink(&row, context)) {
+                    return EXECUTE_SUCCESS;
+                }
+            }
+            if (count < INDEX_LOOKUP_BATCH || ids[count - 1] == UINT32_MAX) {
+                break;
+            }
+            from_id = ids[count - 1] + 1;
+        }
+        return EXECUTE_SUCCESS;
+    }
+    uint id_lo = statement->id_lo;
+    if (statement->offset > 0) {
+        uint64_t position = (uint64_t) table_rank(table, id_lo) + statement->offset;
+        Cursor first = table_seek_rank(table, (uint) std::min<uint64_t>(position, UINT32_MAX));
+        if (first.end_of_table) {
+            return EXECUTE_SUCCESS;
+        }
+        id_lo = first.key;
+    }
+    if (statement->scan_mode != SCAN_SERIAL) {
+        LimitSink limited{statement->limit, 0, sink, context};
+        table_parallel_scan(table, id_lo, statement->id_hi,
+                            statement->scan_mode == SCAN_PARALLEL_ORDERED, limit_row_sink, &limited);
+        return EXECUTE_SUCCESS;
+    }
+    Cursor cursor = table_seek(table, id_lo);
+    Row row;
+    for (uint num_rows = 0; num_rows < statement->limit && cursor_next_row(&cursor, statement->id_hi, &row); num_rows++) {
+        if (!sink(&row, context)) {
+            break;
+        }
+    }
+    return EXECUTE_SUCCESS;
+}
+
+
+/**
+ * the row with this id, if there is one
+ */
+bool table_get(Table *table, uint id, Row *row) {
+    TableGuard guard(table);
+    Cursor cursor = table_seek(table, id);
+    if (cursor.end_of_table) {
+        return false;
+    }
+    void *value = cursor_value(&cursor);
+    if (value == nullptr) {
+        return false;
+    }
+    uint key;
+    memcpy(&key, (char *) value + ROW_ID_OFFSET, ID_SIZE);
+    bool found = key == id;
+    if (found) {
+        deserialize_row(value, row);
+    }
+    unlatch_page(table->pager, cursor.page_num, LATCH_SHARED);
+    return found;
+}
+
+
+bool count_row_sink(const Row *, void *context) {
+    (*(uint *) context)++;
+    return true;
+}
+
+
+/**
+ * the number of rows a select statement returns: from the tree's row counts for
+ * an id range, and by reading the rows of an index lookup
+ */
+ExecuteResult table_count_rows(Table *table, const Statement *statement, uint *num_rows) {
+    if (statement->by_index) {
+        *num_rows = 0;
+        return table_select(table, statement, count_row_sink, num_rows);
+    }
+    StatsTimer timer(STAT_SELECT_NS);
+    uint count = table_count(table, statement->id_lo, statement->id_hi);
+    *num_rows = count > statement->offset ? std::min(count - statement->offset, statement->limit) : 0;
+    return EXECUTE_SUCCESS;
+}
+
+
+bool print_row_sink(const Row *row, void *context) {
+    result_sink_row((ResultSink *) context, row);
+    return true;
+}
+
+
+/**
+ * seeks through the tree to the first key in the range and stops at the upper bound
+ */
+ExecuteResult execute_select(Statement *statement, Table *table) {
+    ResultSink output;
+    result_sink_open(&output, table);
+    ExecuteResult result;
+    if (statement->count) {
+        uint num_rows;
+        result = table_count_rows(table, statement, &num_rows);
+        result_sink_count(&output, num_rows);
+    } else {
+        result = table_select(table, statement, print_row_sink, &output);
+    }
+    result_sink_flush(&output);
+    return result;
+}
+
+
+void print_constants() {
+    printf("ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_CELL_OVERHEAD: %d\n", LEAF_NODE_CELL_OVERHEAD);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+}
+
+
+/**
+ * positions the cursor on the first key >= key, starting in the leaf page_num,
+ * which the caller has latched shared, and moving right along the leaves as
+ * needed. Each leaf is latched before the one to its left is let go; the latch
+ * is released on return.
+ */
+void leaf_node_find(Cursor *cursor, uint page_num, void *node, uint key) {
+    Pager *pager = cursor->table->pager;
+    uint cell_num = key_lower_bound(leaf_node_key(node, 0), *leaf_node_num_cells(node), key);
+    while (cell_num >= *leaf_node_num_cells(node)) {
+        uint next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            break;
+        }
+        void *next_node = latch_page(pager, next_page_num, LATCH_SHARED);
+        unlatch_page(pager, page_num, LATCH_SHARED);
+        page_num = next_page_num;
+        node = next_node;
+        cell_num = 0;
+    }
+    cursor->page_num = page_num;
+    cursor->cell_num = cell_num;
+    cursor->end_of_table = cell_num >= *leaf_node_num_cells(node);
+    cursor->key = cursor->end_of_table ? 0 : *leaf_node_key(node, cell_num);
+    unlatch_page(pager, page_num, LATCH_SHARED);
+}
+
+
+NodeType get_node_type(void *node) {
+    uint8 value = *((uint8 *) ((char *) node + NODE_TYPE_OFFSET));
+    return static_cast<NodeType>(value);
+}
+
+
+void set_node_type(void *node, NodeType type) {
+    uint8 value = type;
+    *((uint8 *) ((char *) node + NODE_TYPE_OFFSET)) = value;
+}
+
+
+uint *internal_node_num_keys(void *node) {
+    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+
+uint *internal_node_right_child(void *node) {
+    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+
+uint *internal_node_keys(void *node) {
+    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_KEYS_OFFSET);
+}
+
+
+uint *internal_node_children(void *node) {
+    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_CHILDREN_OFFSET);
+}
+
+
+uint *internal_node_child(void *node, uint child_num) {
+    uint num_keys = *internal_node_num_keys(node);
+    if (child_num > num_keys) {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+        exit(EXIT_FAILURE);
+    } else if (child_num == num_keys) {
+        return internal_node_right_child(node);
+    } else {
+        return internal_node_children(node) + child_num;
+    }
+}
+
+
+uint *internal_node_key(void *node, uint key_num) {
+    return internal_node_keys(node) + key_num;
+}
+
+
+uint *internal_node_counts(void *node) {
+    return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_COUNTS_OFFSET);
+}
+
+
+/**
+ * the number of rows under child child_num, which is the right child at num_keys
+ */
+uint *internal_node_count(void *node, uint child_num) {
+    uint num_keys = *internal_node_num_keys(node);
+    if (child_num == num_keys) {
+        return reinterpret_cast<uint *>((char *) node + INTERNAL_NODE_RIGHT_COUNT_OFFSET);
+    }
+    return internal_node_counts(node) + child_num;
+}
+
+
+/**
+ * rows under a node: a leaf's cells, or the sum of an internal node's child counts
+ */
+uint node_row_count(void *node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return *leaf_node_num_cells(node);
+    }
+    uint num_keys = *internal_node_num_keys(node);
+    const uint *counts = internal_node_counts(node);
+    uint total = *internal_node_count(node, num_keys);
+    for (uint i = 0; i < num_keys; i++) {
+        total += counts[i];
+    }
+    return total;
+}
+
+
+/**
+ * an internal node keeps no key for its right child, so its max key is found
+ * by following right children down to a leaf
+ */
+uint get_node_max_key(Pager *pager, void *node) {
+    switch (get_node_type(node)) {
+        case NODE_INTERNAL: {
+            uint right_child_page_num = *internal_node_right_child(node);
+            void *right_child = get_page(pager, right_child_page_num);
+            uint max_key = get_node_max_key(pager, right_child);
+            unpin_page(pager, right_child_page_num);
+            return max_key;
+        }
+        case NODE_LEAF:
+            return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+        default:
+            printf("Unknown node type\n");
+            exit(EXIT_FAILURE);
+    }
+}
+
+
+bool is_node_root(void *node) {
+    uint8 value = *((uint8 *) ((char *) node + IS_ROOT_OFFSET));
+    return value;
+}
+
+
+void set_node_root(void *node, bool is_root) {
+    uint8 value = is_root;
+    *((uint8 *) ((char *) node + IS_ROOT_OFFSET)) = value;
+}
+
+
+/**
+ * takes the first page off the free list in the meta page, or the page past the
+ * end of the file when the list is empty. While db_open sets up a new file
+ * page 0 is not a meta page yet, and pages only come from the end.
+ */
+uint get_unused_page_num(Pager *pager) {
+    char *meta = (char *) get_page(pager, META_PAGE_NUM);
+    uint32_t magic;
+    uint page_num = 0;
+    memcpy(&magic, meta + META_MAGIC_OFFSET, sizeof(uint32_t));
+    if (magic == META_MAGIC) {
+        memcpy(&page_num, meta + META_FREE_LIST_OFFSET, sizeof(uint));
+    }
+    if (page_num == 0) {
+        unpin_page(pager, META_PAGE_NUM);
+        std::lock_guard<std::mutex> lock(pager->mutex);
+        return pager->num_pages;
+    }
+    char *page = (char *) get_page(pager, page_num);
+    mark_page_dirty(pager, META_PAGE_NUM);
+    memcpy(meta + META_FREE_LIST_OFFSET, page + FREE_PAGE_NEXT_OFFSET, sizeof(uint));
+    unpin_page(pager, page_num);
+    unpin_page(pager, META_PAGE_NUM);
+    return page_num;
+}
+
+
+/**
+ * puts a page nothing points to any more at the head of the free list
+ */
+void free_page(Pager *pager, uint page_num) {
+    char *meta = (char *) get_page(pager, META_PAGE_NUM);
+    char *page = (char *) get_page(pager, page_num);
+    mark_page_dirty(pager, META_PAGE_NUM);
+    mark_page_dirty(pager, page_num);
+    memset(page, 0, PAGE_SIZE);
+    set_node_type(page, NODE_FREE);
+    memcpy(page + FREE_PAGE_NEXT_OFFSET, meta + META_FREE_LIST_OFFSET, sizeof(uint));
+    memcpy(meta + META_FREE_LIST_OFFSET, &page_num, sizeof(uint));
+    unpin_page(pager, page_num);
+    unpin_page(pager, META_PAGE_NUM);
+}
+
+
+void initialize_leaf_node(void *node) {
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;
+    *leaf_node_heap_start(node) = PAGE_SIZE;
+}
+
+
+void initialize_internal_node(void *node) {
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    *internal_node_count(node, 0) = 0;
+}
+
+
+/**
+ * latches page_num exclusively for the writer until table_unlatch_all
+ */
+void *table_latch(Table *table, uint page_num) {
+    void *node = latch_page(table->pager, page_num, LATCH_EXCLUSIVE);
+    table->latched_pages[table->num_latched++] = page_num;
+    return node;
+}
+
+
+bool table_latched(Table *table, uint page_num) {
+    for (uint i = 0; i < table->num_latched; i++) {
+        if (table->latched_pages[i] == page_num) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * lets go of one of the writer's latches ahead of table_unlatch_all
+ */
+void table_unlatch(Table *table, uint page_num) {
+    for (uint i = 0; i < table->num_latched; i++) {
+        if (table->latched_pages[i] == page_num) {
+            unlatch_page(table->pager, page_num, LATCH_EXCLUSIVE);
+            table->latched_pages[i] = table->latched_pages[--table->num_latched];
+            return;
+        }
+    }
+}
+
+
+void table_unlatch_all(Table *table) {
+    for (uint i = 0; i < table->num_latched; i++) {
+        unlatch_page(table->pager, table->latched_pages[i], LATCH_EXCLUSIVE);
+    }
+    table->num_latched = 0;
+}
+
+
+/**
+ * descends to the leaf for key, recording the internal nodes passed in path, and
+ * latches exclusively every node an insert of needed bytes might change. Latch
+ * crabbing: a child that cannot split (a leaf with room, an internal node below
+ * its fanout) lets go of everything above it. Splits walk back up the path
+ * instead of following parent pointers, and only ever reach latched nodes.
+ * Each node passed counts the new row under the child taken, before it is let go,
+ * so the caller must have checked with table_has_key that key is not there yet.
+ */
+uint table_latch_path(Table *table, uint key, uint needed, TreePath *path) {
+    path->depth = 0;
+    uint page_num = table->root_page_num;
+    void *node = table_latch(table, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        if (path->depth == MAX_TREE_DEPTH) {
+            printf("Tree deeper than %d levels\n", MAX_TREE_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        path->page_num[path->depth++] = page_num;
+        uint child_index = internal_node_find_child(node, key);
+        mark_page_dirty(table->pager, page_num);
+        (*internal_node_count(node, child_index))++;
+        page_num = *internal_node_child(node, child_index);
+        node = latch_page(table->pager, page_num, LATCH_EXCLUSIVE);
+        bool safe = get_node_type(node) == NODE_LEAF ? leaf_node_free_space(node) >= needed
+                                                       : *internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS;
+        if (safe) {
+            table_unlatch_all(table);
+        }
+        table->latched_pages[table->num_latched++] = page_num;
+    }
+    return page_num;
+}
+
+
+/**
+ * whether the table holds key, found under shared latches. The latch paths count
+ * a row in every node they pass, so a writer asks first and takes them only for
+ * a row that really comes or goes; holding Table::writer, nothing changes the
+ * answer before its descent.
+ */
+bool table_has_key(Table *table, uint key) {
+    Cursor cursor = table_seek(table, key);
+    return !cursor.end_of_table && cursor.key == key;
+}
+
+
+void create_new_root(Table *table, uint right_child_page_num) {
+    stats_add(STAT_ROOT_SPLITS, 1);
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    void *root = get_page(table->pager, table->root_page_num);
+    void *right_child = get_page(table->pager, right_child_page_num);
+    uint left_child_page_num = get_unused_page_num(table->pager);
+    void *left_child = get_page(table->pager, left_child_page_num);
+    mark_page_dirty(table->pager, table->root_page_num);
+    mark_page_dirty(table->pager, right_child_page_num);
+    mark_page_dirty(table->pager, left_child_page_num);
+
+    /* Left child has data copied from old root */
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    /* Root node is a new internal node with one key and two children */
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+
+    *internal_node_child(root, 0) = left_child_page_num;
+    uint left_child_max_key = get_node_max_key(table->pager, left_child);
+    *internal_node_key(root, 0) = left_child_max_key;
+    *internal_node_count(root, 0) = node_row_count(left_child);
+    *internal_node_right_child(root) = right_child_page_num;
+    *internal_node_count(root, 1) = node_row_count(right_child);
+
+    unpin_page(table->pager, left_child_page_num);
+    unpin_page(table->pager, right_child_page_num);
+    unpin_page(table->pager, table->root_page_num);
+}
+
+
+void leaf_node_split_and_insert(Cursor *cursor, uint key, const Row *value, TreePath *path) {
+    /**
+     * 创建新的页面，将后一半的内容拷贝到新分配的页面
+     */
+    stats_add(STAT_LEAF_SPLITS, 1);
+    Pager *pager = cursor->table->pager;
+    void *old_node = get_page(pager, cursor->page_num);
+    uint old_max = get_node_max_key(pager, old_node);
+    uint new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, cursor->page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_leaf_node(new_node);
+
+    /* gather every row, the new one included, in key order; the old page is rebuilt so read from a copy */
+    char old_copy[PAGE_SIZE];
+    char new_row[ROW_MAX_SIZE];
+    memcpy(old_copy, old_node, PAGE_SIZE);
+    serialize_row(value, new_row);
+    uint num_cells = *leaf_node_num_cells(old_copy);
+    uint total = num_cells + 1;
+    uint keys[LEAF_NODE_MAX_CELLS + 1];
+    void *values[LEAF_NODE_MAX_CELLS + 1];
+    uint total_bytes = 0;
+    for (uint i = 0; i < total; i++) {
+        if (i == cursor->cell_num) {
+            keys[i] = key;
+            values[i] = new_row;
+        } else {
+            uint source = i > cursor->cell_num ? i - 1 : i;
+            keys[i] = *leaf_node_key(old_copy, source);
+            values[i] = leaf_node_value(old_copy, source);
+        }
+        total_bytes += serialized_size(values[i]) + LEAF_NODE_CELL_OVERHEAD;
+    }
+
+    /**
+     * appending past the last key of the rightmost leaf keeps the old leaf full
+     * and starts the new one with just the new row, so ascending inserts pack pages.
+     * Otherwise split so each half gets about the same number of bytes.
+     */
+    bool appending = cursor->cell_num == num_cells && *leaf_node_next_leaf(old_copy) == 0;
+    uint left_count = num_cells;
+    if (!appending) {
+        uint left_bytes = 0;
+        left_count = 0;
+        while (left_count < total - 1 && left_bytes < total_bytes / 2) {
+            left_bytes += serialized_size(values[left_count]) + LEAF_NODE_CELL_OVERHEAD;
+            left_count++;
+        }
+        left_count = std::max(left_count, 1u);
+    }
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+    if (*leaf_node_next_leaf(new_node) == 0) {
+        cursor->table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    }
+
+    // 更新结点数量
+    leaf_node_build(old_node, left_count, keys, values);
+    leaf_node_build(new_node, total - left_count, keys + left_count, values + left_count);
+
+    if (is_node_root(old_node)) {
+        create_new_root(cursor->table, new_page_num);
+    } else {
+        uint parent_page_num = path->page_num[path->depth - 1];
+        uint new_max = get_node_max_key(pager, old_node);
+        void *parent = get_page(pager, parent_page_num);
+
+        // old_max 更新为 new_max
+        mark_page_dirty(pager, parent_page_num);
+        update_internal_node_key(parent, old_max, new_max);
+        *internal_node_count(parent, internal_node_child_index(parent, cursor->page_num)) = left_count;
+        unpin_page(pager, parent_page_num);
+        internal_node_insert(cursor->table, path, path->depth - 1, new_page_num);
+    }
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, cursor->page_num);
+}
+
+
+/**
+ * path leads from the root to the cursor's leaf; a split updates the nodes on it
+ */
+void leaf_node_insert(Cursor *cursor, uint key, const Row *value, TreePath *path) {
+    void *node = get_page(cursor->table->pager, cursor->page_num);
+    if (leaf_node_free_space(node) < serialized_row_size(value) + LEAF_NODE_CELL_OVERHEAD) {
+        unpin_page(cursor->table->pager, cursor->page_num);
+        leaf_node_split_and_insert(cursor, key, value, path);
+        return;
+    }
+
+    mark_page_dirty(cursor->table->pager, cursor->page_num);
+    leaf_node_insert_cell(node, cursor->cell_num, key, value);
+    unpin_page(cursor->table->pager, cursor->page_num);
+}
+
+
+void indent(uint level) {
+    for (uint i = 0; i < level; ++i) printf("  ");
+}
+
+
+void print_tree(Pager *pager, uint page_num, uint level) {
+    void *node = get_page(pager, page_num);
+    uint num_keys, child;
+
+    switch (get_node_type(node)) {
+        case NODE_LEAF:
+            num_keys = *leaf_node_num_cells(node);
+            indent(level);
+            printf("- leaf (size %d)\n", num_keys);
+            for (uint i = 0; i < num_keys; i++) {
+                indent(level + 1);
+                printf("- %d\n", *leaf_node_key(node, i));
+            }
+            break;
+        case NODE_INTERNAL:
+            num_keys = *internal_node_num_keys(node);
+            indent(level);
+            printf("- internal (size %d)\n", num_keys);
+            for (uint i = 0; i < num_keys; i++) {
+                child = *internal_node_child(node, i);
+                print_tree(pager, child, level + 1);
+
+                indent(level);
+                printf("- key %d\n", *internal_node_key(node, i));
+            }
+            child = *internal_node_right_child(node);
+            print_tree(pager, child, level + 1);
+            break;
+        case NODE_INDEX_INTERNAL:
+        case NODE_INDEX_LEAF:
+        case NODE_FREE:
+            // the primary tree links only to its own nodes
+            indent(level);
+            printf("- unexpected node type %d\n", get_node_type(node));
+            break;
+    }
+    unpin_page(pager, page_num);
+}
+
+
+void write_meta_page(Table *table) {
+    Pager *pager = table->pager;
+    char *meta = (char *) get_page(pager, META_PAGE_NUM);
+    mark_page_dirty(pager, META_PAGE_NUM);
+    memset(meta, 0, PAGE_SIZE);
+    memcpy(meta + META_MAGIC_OFFSET, &META_MAGIC, sizeof(uint32_t));
+    memcpy(meta + META_ROOT_OFFSET, &table->root_page_num, sizeof(uint));
+    memcpy(meta + META_INDEX_ROOTS_OFFSET, table->index_root_page_num, sizeof(table->index_root_page_num));
+    unpin_page(pager, META_PAGE_NUM);
+}
+
+
+uint create_index_root(Pager *pager) {
+    uint page_num = get_unused_page_num(pager);
+    void *root = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    initialize_index_node(root, NODE_INDEX_LEAF);
+    set_node_root(root, true);
+    unpin_page(pager, page_num);
+    return page_num;
+}
+
+
+/**
+ * how far a walk over a tree in the original layout has got: the pages it has
+ * reached, the rows it has checked and the last key among them, and the leaf
+ * the last leaf links to. Rows go to loader as they are checked when there is one.
+ */
+struct V0Walk {
+    BulkLoader *loader;
+    std::vector<bool> reached;
+    uint num_rows;
+    bool has_key;
+    uint last_key;
+    uint num_leaves;
+    uint next_leaf;
+};
+
+
+bool v0_walk_leaf(const char *node, uint page_num, V0Walk *walk) {
+    uint num_cells;
+    uint next_leaf;
+    memcpy(&num_cells, node + V0_LEAF_NODE_NUM_CELLS_OFFSET, sizeof(uint));
+    memcpy(&next_leaf, node + V0_LEAF_NODE_NEXT_LEAF_OFFSET, sizeof(uint));
+    if (num_cells > V0_LEAF_NODE_MAX_CELLS || (walk->num_leaves > 0 && walk->next_leaf != page_num)) {
+        return false;
+    }
+    walk->num_leaves++;
+    walk->next_leaf = next_leaf;
+
+    Row row;
+    for (uint i = 0; i < num_cells; i++) {
+        const char *cell = node + V0_LEAF_NODE_HEADER_SIZE + i * V0_LEAF_NODE_CELL_SIZE;
+        const char *value = cell + V0_LEAF_NODE_VALUE_OFFSET;
+        uint key;
+        memcpy(&key, cell, sizeof(uint));
+        memcpy(&row.id, value + V0_ROW_ID_OFFSET, sizeof(uint));
+        memcpy(row.username, value + V0_ROW_USERNAME_OFFSET, sizeof(row.username));
+        memcpy(row.email, value + V0_ROW_EMAIL_OFFSET, sizeof(row.email));
+        if (row.id != key || (walk->has_key && key <= walk->last_key) ||
+            memchr(row.username, '\0', sizeof(row.username)) == nullptr ||
+            memchr(row.email, '\0', sizeof(row.email)) == nullptr) {
+            return false;
+        }
+        walk->has_key = true;
+        walk->last_key = key;
+        walk->num_rows++;
+        if (walk->loader != nullptr) {
+            bulk_load_add(walk->loader, &row);
+        }
+    }
+    return true;
+}
+
+
+/**
+ * checks the subtree at page_num against the original layout in key order: every
+ * key above the keys before it and no greater than the separator over it, each
+ * row under its own key, and the leaves linked in the order they are reached
+ * @return false at the first node that does not fit
+ */
+bool v0_walk_node(Pager *pager, uint page_num, uint depth, V0Walk *walk) {
+    if (page_num >= pager->num_pages || walk->reached[page_num] || depth >= MAX_TREE_DEPTH) {
+        return false;
+    }
+    walk->reached[page_num] = true;
+    // a copy, so a deep tree does not hold a pin per level
+    char node[PAGE_SIZE];
+    memcpy(node, get_page(pager, page_num), PAGE_SIZE);
+    unpin_page(pager, page_num);
+    if (node[IS_ROOT_OFFSET] != (depth == 0)) {
+        return false;
+    }
+    if (node[NODE_TYPE_OFFSET] == NODE_LEAF) {
+        return v0_walk_leaf(node, page_num, walk);
+    }
+    if (node[NODE_TYPE_OFFSET] != NODE_INTERNAL) {
+        return false;
+    }
+
+    uint num_keys;
+    uint right_child;
+    memcpy(&num_keys, node + V0_INTERNAL_NODE_NUM_KEYS_OFFSET, sizeof(uint));
+    memcpy(&right_child, node + V0_INTERNAL_NODE_RIGHT_CHILD_OFFSET, sizeof(uint));
+    if (num_keys > V0_INTERNAL_NODE_MAX_CELLS) {
+        return false;
+    }
+    for (uint i = 0; i < num_keys; i++) {
+        const char *cell = node + V0_INTERNAL_NODE_HEADER_SIZE + i * V0_INTERNAL_NODE_CELL_SIZE;
+        uint child_page_num;
+        uint key;
+        memcpy(&child_page_num, cell, sizeof(uint));
+        memcpy(&key, cell + V0_INTERNAL_NODE_KEY_OFFSET, sizeof(uint));
+        if (!v0_walk_node(pager, child_page_num, depth + 1, walk) || (walk->has_key && key < walk->last_key)) {
+            return false;
+        }
+        // rows to the right of the separator are above it
+        walk->has_key = true;
+        walk->last_key = key;
+    }
+    return v0_walk_node(pager, right_child, depth + 1, walk);
+}
+
+
+/**
+ * checks a file without a meta page against the original layout, from the root
+ * at page 0, handing its rows to loader in key order when there is one. Pages
+ * no node links to are allowed: a bulk load leaves its top page behind when it
+ * copies it into the root.
+ * @return false if the file is in some other layout or damaged, with num_rows
+ * set to the number of rows in it otherwise
+ */
+bool v0_read_tree(Pager *pager, BulkLoader *loader, uint *num_rows) {
+    V0Walk walk{loader, std::vector<bool>(pager->num_pages), 0, false, 0, 0, 0};
+    bool fits = v0_walk_node(pager, META_PAGE_NUM, 0, &walk) && walk.next_leaf == 0;
+    *num_rows = walk.num_rows;
+    return fits;
+}
+
+
+/**
+ * the first leaf of a tree whose internal nodes have the layout from before row
+ * counts; leaves have not changed since
+ */
+uint v1_first_leaf(Pager *pager, uint page_num) {
+    void *node = get_page(pager, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint child_page_num = *internal_node_right_child(node);
+        if (*internal_node_num_keys(node) > 0) {
+            memcpy(&child_page_num, (char *) node + V1_INTERNAL_NODE_CHILDREN_OFFSET, sizeof(uint));
+        }
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+        node = get_page(pager, page_num);
+    }
+    unpin_page(pager, page_num);
+    return page_num;
+}
+
+
+/**
+ * files written before the meta page are in the original layout with the root
+ * at page 0, and files with a META_MAGIC_V1 meta page keep no row counts in
+ * internal nodes. Their rows are copied into <db>-vacuum by the bulk loader,
+ * which counts them and builds the indexes, and the copy is renamed over the
+ * file only once it holds every row the file does, so a crash or a short read
+ * part way leaves the old file as it was. Reopens the table on the copy.
+ */
+void upgrade_file_format(Table *table, uint root_page_num) {
+    Pager *pager = table->pager;
+    // only the original layout keeps its root at page 0; check it before writing anything
+    bool original_layout = root_page_num == META_PAGE_NUM;
+    uint num_rows = 0;
+    if (original_layout && !v0_read_tree(pager, nullptr, &num_rows)) {
+        printf("Unsupported file format in %s\n", table->filename);
+        exit(EXIT_FAILURE);
+    }
+    if (pager->wal != nullptr) {
+        pager_checkpoint(pager);
+    }
+    Table *copy = rewrite_begin(table);
+    BulkLoader loader{};
+    bulk_load_begin(copy, DEFAULT_BULK_LOAD_FILL, &loader);
+    uint num_read = 0;
+    if (original_layout) {
+        v0_read_tree(pager, &loader, &num_read);
+    } else {
+        Row row;
+        uint page_num = v1_first_leaf(pager, root_page_num);
+        while (true) {
+            void *leaf = get_page(pager, page_num);
+            for (uint i = 0; i < *leaf_node_num_cells(leaf); i++) {
+                deserialize_row(leaf_node_value(leaf, i), &row);
+                bulk_load_add(&loader, &row);
+                num_read++;
+            }
+            uint next_page_num = *leaf_node_next_leaf(leaf);
+            unpin_page(pager, page_num);
+            if (next_page_num == 0) {
+                break;
+            }
+            page_num = next_page_num;
+        }
+        num_rows = num_read;
+    }
+    bulk_load_finish(&loader);
+    if (num_read != num_rows || table_num_rows(copy) != num_rows) {
+        printf("Upgrading %s copied %u of its %u rows; the file is unchanged\n",
+               table->filename, table_num_rows(copy), num_rows);
+        char *path = strdup(copy->filename);
+        db_close(copy);
+        unlink(path);
+        free(path);
+        exit(EXIT_FAILURE);
+    }
+    rewrite_finish(table, copy);
+    pager_close(pager);
+    table_open_file(table);
+}
+
+
+/**
+ * opens table->filename with table->options and finds the roots, setting up a
+ * new file or upgrading one in an older format first
+ */
+void table_open_file(Table *table) {
+    Pager *pager = pager_open(table->filename, &table->options);
+    wal_open(pager, table->filename, &table->options);
+    table->pager = pager;
+    table->root_page_num = 0;
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    if (pager->num_pages == 0) {
+        // new data file: the meta page, then the roots
+        table->root_page_num = META_PAGE_NUM + 1;
+        void *root_node = get_page(pager, table->root_page_num);
+        mark_page_dirty(pager, table->root_page_num);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+        unpin_page(pager, table->root_page_num);
+        for (uint column = 0; column < NUM_INDEXES; column++) {
+            table->index_root_page_num[column] = create_index_root(pager);
+        }
+        write_meta_page(table);
+        pager_commit(pager);
+        return;
+    }
+
+    char *meta = (char *) get_page(pager, META_PAGE_NUM);
+    uint32_t magic;
+    memcpy(&magic, meta + META_MAGIC_OFFSET, sizeof(uint32_t));
+    if (magic == META_MAGIC) {
+        memcpy(&table->root_page_num, meta + META_ROOT_OFFSET, sizeof(uint));
+        memcpy(table->index_root_page_num, meta + META_INDEX_ROOTS_OFFSET, sizeof(table->index_root_page_num));
+        unpin_page(pager, META_PAGE_NUM);
+    } else {
+        uint root_page_num = META_PAGE_NUM;
+        if (magic == META_MAGIC_V1) {
+            memcpy(&root_page_num, meta + META_ROOT_OFFSET, sizeof(uint));
+        }
+        unpin_page(pager, META_PAGE_NUM);
+        upgrade_file_format(table, root_page_num);
+    }
+}
+
+
+char *vacuum_path(const char *filename) {
+    size_t path_length = strlen(filename) + sizeof("-vacuum");
+    auto *path = (char *) malloc(path_length);
+    snprintf(path, path_length, "%s-vacuum", filename);
+    return path;
+}
+
+
+Table *db_open(const char *filename, const DbOptions *options) {
+    DbOptions defaults{DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, false, 0, 0, 0, false, false};
+    if (options == nullptr) {
+        options = &defaults;
+    }
+    auto *table = new Table();
+    table->filename = strdup(filename);
+    table->options = *options;
+    table->num_entered = 0;
+    table->swapping = false;
+    uint scan_threads = options->scan_threads ? options->scan_threads : std::thread::hardware_concurrency();
+    table->scan_pool = thread_pool_create(std::max(1u, scan_threads));
+    table->output_format = OUTPUT_TABLE;
+    table->output_fd = STDOUT_FILENO;
+    // a vacuum that crashed before its rename leaves its copy behind
+    char *path = vacuum_path(filename);
+    unlink(path);
+    free(path);
+    table_open_file(table);
+    return table;
+}
+
+
+/**
+ * .load <file> [fill_factor]: bulk loads rows of "id username email", sorted by id,
+ * into an empty table. Nothing is loaded if any line is rejected.
+ */
+void load_file(Table *table, const char *path, double fill_factor) {
+    FILE *file = fopen(path, "r");
+    if (file == nullptr) {
+        printf("Unable to open %s\n", path);
+        return;
+    }
+    std::lock_guard<std::mutex> writer(table->writer);
+    BulkLoader loader{};
+    if (bulk_load_begin(table, fill_factor, &loader) == EXECUTE_TABLE_NOT_EMPTY) {
+        printf("Error: .load needs an empty table\n");
+        fclose(file);
+        return;
+    }
+
+    char *line = nullptr;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    uint line_num = 0;
+    Row row{};
+    while ((line_length = getline(&line, &line_capacity, file)) != -1) {
+        line_num++;
+        if (line_length > 0 && line[line_length - 1] == '\n') {
+            line[line_length - 1] = 0;
+        }
+        char *id_string = strtok(line, " \t");
+        if (id_string == nullptr) continue;
+        char *username = strtok(nullptr, " \t");
+        char *email = strtok(nullptr, " \t");
+        const char *error = nullptr;
+        switch (prepare_row(id_string, username, email, &row)) {
+            case PREPARE_SUCCESS:
+                break;
+            case PREPARE_NEGATIVE_ID:
+                error = "ID must be positive";
+                break;
+            case PREPARE_STRING_TOO_LONG:
+                error = "String is too long";
+                break;
+            default:
+                error = "Syntax error";
+                break;
+        }
+        if (error == nullptr) {
+            switch (bulk_load_add(&loader, &row)) {
+                case EXECUTE_DUPLICATE_KEY:
+                    error = "Duplicate key";
+                    break;
+                case EXECUTE_KEY_OUT_OF_ORDER:
+                    error = "Input is not sorted by id";
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (error != nullptr) {
+            printf("Error: %s on line %d, nothing loaded\n", error, line_num);
+            bulk_load_abort(&loader);
+            free(line);
+            fclose(file);
+            return;
+        }
+    }
+    uint num_rows = loader.num_rows;
+    bulk_load_finish(&loader);
+    printf("Loaded %d rows\n", num_rows);
+    free(line);
+    fclose(file);
+}
+
+
+/**
+ * .import reads the file IMPORT_WINDOW_BYTES at a time, and each window is
+ * split between the scan pool's workers on line boundaries
+ */
+#define IMPORT_WINDOW_BYTES (16 << 20)
+#define IMPORT_CHUNKS_PER_WORKER 4
+
+/**
+ * a parsed CSV row; the strings point into the mapped file, past any opening
+ * quote, and a string's escaped flag is set when it still has doubled quotes in it
+ */
+struct ImportRecord {
+    uint id;
+    uint8 username_length;
+    uint8 email_length;
+    bool username_escaped;
+    bool email_escaped;
+    const char *username;
+    const char *email;
+};
+
+struct ImportChunk {
+    const char *begin;
+    const char *end;
+    /* set by the validating pass: the first error and the line it is on, counted from begin */
+    uint num_lines;
+    uint error_line;
+    const char *error;
+    /* set by the loading pass */
+    std::vector<ImportRecord> records;
+};
+
+struct ImportJob {
+    std::mutex mutex;
+    std::condition_variable finished;
+    uint num_running;
+};
+
+
+/**
+ * one CSV field ending at a comma or at end; a quoted field doubles its quotes.
+ * @return the byte past the field, or nullptr if it is malformed
+ */
+const char *import_field(const char *field, const char *end, const char **value, uint *length, bool *escaped) {
+    if (field < end && *field == '"') {
+        const char *c = field + 1;
+        *value = c;
+        *length = 0;
+        while (true) {
+            if (c == end) {
+                return nullptr;
+            }
+            if (*c == '"') {
+                if (c + 1 < end && c[1] == '"') {
+                    *escaped = true;
+                    c++;
+                } else {
+                    break;
+                }
+            }
+            (*length)++;
+            c++;
+        }
+        c++;
+        return c == end || *c == ',' ? c : nullptr;
+    }
+    const char *c = (const char *) memchr(field, ',', end - field);
+    if (c == nullptr) {
+        c = end;
+    }
+    *value = field;
+    *length = c - field;
+    return c;
+}
+
+
+/**
+ * parses "id,username,email" in [line, end)
+ * @return nullptr, or what is wrong with the line
+ */
+const char *import_parse_line(const char *line, const char *end, ImportRecord *record) {
+    const char *c = line;
+    if (c < end && *c == '-') {
+        return "ID must be positive";
+    }
+    uint64_t id = 0;
+    for (; c < end && *c >= '0' && *c <= '9'; c++) {
+        id = id * 10 + (*c - '0');
+        if (id > UINT32_MAX) {
+            return "Syntax error";
+        }
+    }
+    if (c == line || c == end || *c != ',') {
+        return "Syntax error";
+    }
+    record->id = id;
+    record->username_escaped = false;
+    record->email_escaped = false;
+    uint username_length;
+    uint email_length;
+    c = import_field(c + 1, end, &record->username, &username_length, &record->username_escaped);
+    if (c == nullptr || c == end) {
+        return "Syntax error";
+    }
+    c = import_field(c + 1, end, &record->email, &email_length, &record->email_escaped);
+    if (c != end) {
+        return "Syntax error";
+    }
+    if (username_length > COLUMN_USERNAME_SIZE || email_length > COLUMN_EMAIL_SIZE) {
+        return "String is too long";
+    }
+    record->username_length = username_length;
+    record->email_length = email_length;
+    return nullptr;
+}
+
+
+/**
+ * walks the lines of a chunk, skipping blank ones and a header line at the start
+ * of the file; keeps the records when keep_records is set and stops at the first error
+ */
+void import_chunk(ImportChunk *chunk, const char *file_begin, bool keep_records) {
+    chunk->num_lines = 0;
+    chunk->error = nullptr;
+    chunk->records.clear();
+    const char *line = chunk->begin;
+    while (line < chunk->end) {
+        auto *newline = (const char *) memchr(line, '\n', chunk->end - line);
+        const char *line_end = newline != nullptr ? newline : chunk->end;
+        const char *next = newline != nullptr ? newline + 1 : chunk->end;
+        chunk->num_lines++;
+        if (line_end > line && line_end[-1] == '\r') {
+            line_end--;
+        }
+        bool header = line == file_begin && line_end - line > 3 && memcmp(line, "id,", 3) == 0;
+        if (line_end > line && !header) {
+            ImportRecord record;
+            const char *error = import_parse_line(line, line_end, &record);
+            if (error != nullptr) {
+                chunk->error = error;
+                chunk->error_line = chunk->num_lines;
+                return;
+            }
+            if (keep_records) {
+                chunk->records.push_back(record);
+            }
+        }
+        line = next;
+    }
+}
+
+
+/**
+ * splits [begin, end) on line boundaries into chunks.size() pieces, some maybe empty
+ */
+void import_split(const char *begin, const char *end, std::vector<ImportChunk> &chunks) {
+    size_t num_chunks = chunks.size();
+    const char *start = begin;
+    for (size_t i = 0; i < num_chunks; i++) {
+        const char *stop = end;
+        if (i + 1 < num_chunks) {
+            stop = std::max(start, begin + (end - begin) * (i + 1) / num_chunks);
+            auto *newline = (const char *) memchr(stop, '\n', end - stop);
+            stop = newline != nullptr ? newline + 1 : end;
+        }
+        chunks[i].begin = start;
+        chunks[i].end = stop;
+        start = stop;
+    }
+}
+
+
+/**
+ * runs import_chunk over every chunk on the scan pool and waits for them all
+ */
+void import_run(Table *table, std::vector<ImportChunk> &chunks, const char *file_begin, bool keep_records) {
+    ImportJob job;
+    job.num_running = chunks.size();
+    for (ImportChunk &chunk: chunks) {
+        thread_pool_submit(table->scan_pool, [&job, &chunk, file_begin, keep_records] {
+            import_chunk(&chunk, file_begin, keep_records);
+            if (keep_records) {
+                std::sort(chunk.records.begin(), chunk.records.end(),
+                          [](const ImportRecord &a, const ImportRecord &b) { return a.id < b.id; });
+            }
+            std::lock_guard<std::mutex> lock(job.mutex);
+            if (--job.num_running == 0) {
+                job.finished.notify_one();
+            }
+        });
+    }
+    std::unique_lock<std::mutex> lock(job.mutex);
+    job.finished.wait(lock, [&job] { return job.num_running == 0; });
+}
+
+
+void import_copy_field(const char *value, uint length, bool escaped, char *out) {
+    if (!escaped) {
+        memcpy(out, value, length);
+    } else {
+        for (uint i = 0; i < length; i++) {
+            out[i] = *value;
+            value += *value == '"' ? 2 : 1;
+        }
+    }
+    out[length] = 0;
+}
+
+
+/**
+ * .import <file>: bulk ingest of "id,username,email" CSV lines, quoted as .mode csv writes
+ * them. The file is mapped and validated in parallel first, so nothing is imported if any
+ * line is rejected. Then each window is parsed in parallel, sorted by id and inserted;
+ * into an empty table rows go through the bulk loader for as long as they arrive in
+ * ascending order. Ids already in the table are skipped.
+ */
+void import_file(Table *table, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        printf("Unable to open %s\n", path);
+        return;
+    }
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    if (file_length <= 0) {
+        close(fd);
+        printf("Imported 0 rows\n");
+        return;
+    }
+    auto *file = (const char *) mmap(nullptr, file_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        printf("Unable to map %s\n", path);
+        return;
+    }
+    madvise((void *) file, file_length, MADV_SEQUENTIAL);
+    const char *file_end = file + file_length;
+    std::vector<ImportChunk> chunks(table->scan_pool->workers.size() * IMPORT_CHUNKS_PER_WORKER);
+
+    import_split(file, file_end, chunks);
+    import_run(table, chunks, file, false);
+    uint line_num = 0;
+    for (ImportChunk &chunk: chunks) {
+        if (chunk.error != nullptr) {
+            printf("Error: %s on line %u, nothing imported\n", chunk.error, line_num + chunk.error_line);
+            munmap((void *) file, file_length);
+            return;
+        }
+        line_num += chunk.num_lines;
+    }
+
+    std::lock_guard<std::mutex> writer(table->writer);
+    BulkLoader loader{};
+    bool bulk = bulk_load_begin(table, DEFAULT_BULK_LOAD_FILL, &loader) == EXECUTE_SUCCESS;
+    uint num_rows = 0;
+    uint num_duplicates = 0;
+    std::vector<ImportRecord> window;
+    Row row;
+    for (const char *window_begin = file; window_begin < file_end;) {
+        const char *window_end = file_end;
+        if (file_end - window_begin > IMPORT_WINDOW_BYTES) {
+            auto *newline = (const char *) memchr(window_begin + IMPORT_WINDOW_BYTES, '\n',
+                                                  file_end - window_begin - IMPORT_WINDOW_BYTES);
+            window_end = newline != nullptr ? newline + 1 : file_end;
+        }
+        import_split(window_begin, window_end, chunks);
+        import_run(table, chunks, file, true);
+        window.clear();
+        for (ImportChunk &chunk: chunks) {
+            window.insert(window.end(), chunk.records.begin(), chunk.records.end());
+        }
+        std::sort(window.begin(), window.end(), [](const ImportRecord &a, const ImportRecord &b) { return a.id < b.id; });
+
+        uint64_t commit_lsn = 0;
+        for (ImportRecord &record: window) {
+            row.id = record.id;
+            import_copy_field(record.username, record.username_length, record.username_escaped, row.username);
+            import_copy_field(record.email, record.email_length, record.email_escaped, row.email);
+            if (bulk && (loader.num_rows == 0 || record.id >= loader.last_key)) {
+                if (bulk_load_add(&loader, &row) == EXECUTE_DUPLICATE_KEY) {
+                    num_duplicates++;
+                } else {
+                    num_rows++;
+                }
+                continue;
+            }
+            if (bulk) {
+                // this window reaches back below the loaded rows: finish the tree and insert from here on
+                bulk_load_finish(&loader);
+                bulk = false;
+            }
+            if (execute_insert(&row, table) == EXECUTE_DUPLICATE_KEY) {
+                num_duplicates++;
+            } else {
+                num_rows++;
+            }
+            commit_lsn = pager_log_commit(table->pager);
+            table_unlatch_all(table);
+        }
+        // one log sync per window
+        if (commit_lsn != 0) {
+            wal_flush(table->pager->wal, commit_lsn, true);
+        }
+        window_begin = window_end;
+    }
+    if (bulk) {
+        bulk_load_finish(&loader);
+    }
+    munmap((void *) file, file_length);
+    if (num_duplicates > 0) {
+        printf("Imported %u rows, skipped %u duplicate ids\n", num_rows, num_duplicates);
+    } else {
+        printf("Imported %u rows\n", num_rows);
+    }
+}
+
+
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table) {
+    if (strcmp(input_buffer->buffer, ".exit") == 0) {
+        close_input_buffer(input_buffer);
+        printf("Bye~\n");
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+        printf("Constants:\n");
+        print_constants();
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+        stats_print(stdout);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats json") == 0) {
+        stats_print_json(stdout);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats reset") == 0) {
+        stats_reset();
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+        printf("Tree:\n");
+        print_tree(table->pager, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".load ", 6) == 0) {
+        strtok(input_buffer->buffer, " ");
+        char *path = strtok(nullptr, " ");
+        char *fill_string = strtok(nullptr, " ");
+        double fill_factor = fill_string ? atof(fill_string) : DEFAULT_BULK_LOAD_FILL;
+        if (path == nullptr || fill_factor <= 0 || fill_factor > 1) {
+            printf("Usage: .load <file> [fill_factor in (0, 1]]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        load_file(table, path, fill_factor);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".vacuum") == 0 || strncmp(input_buffer->buffer, ".vacuum ", 8) == 0) {
+        char *fill_string = input_buffer->buffer[7] ? input_buffer->buffer + 8 : nullptr;
+        double fill_factor = fill_string ? atof(fill_string) : DEFAULT_BULK_LOAD_FILL;
+        if (fill_factor <= 0 || fill_factor > 1) {
+            printf("Usage: .vacuum [fill_factor in (0, 1]]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        uint num_pages = table->pager->num_pages;
+        table_vacuum(table, fill_factor);
+        printf("Vacuumed %u pages into %u\n", num_pages, table->pager->num_pages);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+        import_file(table, input_buffer->buffer + 8);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".mode ", 6) == 0) {
+        const char *mode = input_buffer->buffer + 6;
+        if (strcmp(mode, "table") == 0) {
+            table->output_format = OUTPUT_TABLE;
+        } else if (strcmp(mode, "csv") == 0) {
+            table->output_format = OUTPUT_CSV;
+        } else if (strcmp(mode, "tsv") == 0) {
+            table->output_format = OUTPUT_TSV;
+        } else if (strcmp(mode, "binary") == 0) {
+            table->output_format = OUTPUT_BINARY;
+        } else {
+            printf("Usage: .mode table|csv|tsv|binary\n");
+        }
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".output ", 8) == 0) {
+        const char *path = input_buffer->buffer + 8;
+        int fd = STDOUT_FILENO;
+        if (strcmp(path, "stdout") != 0) {
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+            if (fd == -1) {
+                printf("Unable to open %s\n", path);
+                return META_COMMAND_SUCCESS;
+            }
+        }
+        if (table->output_fd != STDOUT_FILENO) {
+            close(table->output_fd);
+        }
+        table->output_fd = fd;
+        return META_COMMAND_SUCCESS;
+    } else {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+
+
+/**
+ * descends from the internal node page_num, latched shared by the caller, by
+ * latch crabbing: the child is latched before the parent is released, so a
+ * concurrent split is either seen whole or not at all
+ */
+void internal_node_find(Cursor *cursor, uint page_num, void *node, uint key) {
+    Pager *pager = cursor->table->pager;
+    uint child_num = *internal_node_child(node, internal_node_find_child(node, key));
+    void *child = latch_page(pager, child_num, LATCH_SHARED);
+    unlatch_page(pager, page_num, LATCH_SHARED);
+    switch (get_node_type(child)) {
+        case NODE_LEAF:
+            leaf_node_find(cursor, child_num, child, key);
+            return;
+        case NODE_INTERNAL:
+            internal_node_find(cursor, child_num, child, key);
+            return;
+        default:
+            printf("Unknown node type\n");
+            exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * repositions the cursor on the first key >= key
+ */
+void cursor_seek(Cursor *cursor, uint key) {
+    Table *table = cursor->table;
+    void *root_node = latch_page(table->pager, table->root_page_num, LATCH_SHARED);
+    if (get_node_type(root_node) == NODE_LEAF) {
+        leaf_node_find(cursor, table->root_page_num, root_node, key);
+    } else {
+        internal_node_find(cursor, table->root_page_num, root_node, key);
+    }
+}
+
+
+uint16_t *index_node_num_cells(void *node) {
+    return (uint16_t *) ((char *) node + INDEX_NODE_NUM_CELLS_OFFSET);
+}
+
+
+uint *index_node_link(void *node) {
+    return (uint *) ((char *) node + INDEX_NODE_LINK_OFFSET);
+}
+
+
+uint16_t *index_node_heap_start(void *node) {
+    return (uint16_t *) ((char *) node + INDEX_NODE_HEAP_START_OFFSET);
+}
+
+
+uint16_t *index_node_slot(void *node, uint cell_num) {
+    return (uint16_t *) ((char *) node + INDEX_NODE_HEADER_SIZE + cell_num * INDEX_NODE_SLOT_SIZE);
+}
+
+
+char *index_node_cell(void *node, uint cell_num) {
+    return (char *) node + *index_node_slot(node, cell_num);
+}
+
+
+/**
+ * the entry of a cell: the cell itself in a leaf, past the child in an internal node
+ */
+char *index_cell_entry(void *node, char *cell) {
+    return get_node_type(node) == NODE_INDEX_INTERNAL ? cell + INDEX_CELL_CHILD_SIZE : cell;
+}
+
+
+uint index_cell_child(char *cell) {
+    uint child;
+    memcpy(&child, cell, sizeof(uint));
+    return child;
+}
+
+
+uint index_entry_id(const char *entry) {
+    uint id;
+    memcpy(&id, entry + INDEX_ENTRY_ID_OFFSET, sizeof(uint));
+    return id;
+}
+
+
+uint index_entry_size(const char *entry) {
+    return INDEX_ENTRY_KEY_OFFSET + (uint8) entry[INDEX_ENTRY_KEY_LENGTH_OFFSET];
+}
+
+
+uint index_cell_size(void *node, char *cell) {
+    return index_entry_size(index_cell_entry(node, cell)) + (get_node_type(node) == NODE_INDEX_INTERNAL ? INDEX_CELL_CHILD_SIZE : 0);
+}
+
+
+uint index_node_free_space(void *node) {
+    return *index_node_heap_start(node) - INDEX_NODE_HEADER_SIZE - *index_node_num_cells(node) * INDEX_NODE_SLOT_SIZE;
+}
+
+
+void initialize_index_node(void *node, NodeType type) {
+    set_node_type(node, type);
+    set_node_root(node, false);
+    *index_node_num_cells(node) = 0;
+    *index_node_link(node) = 0;
+    *index_node_heap_start(node) = PAGE_SIZE;
+}
+
+
+/**
+ * orders (key, id) against an entry: by key bytes, a prefix first, then by id
+ */
+int index_compare(const char *key, uint key_length, uint id, const char *entry) {
+    uint entry_length = (uint8) entry[INDEX_ENTRY_KEY_LENGTH_OFFSET];
+    int order = memcmp(key, entry + INDEX_ENTRY_KEY_OFFSET, std::min(key_length, entry_length));
+    if (order != 0) {
+        return order;
+    }
+    if (key_length != entry_length) {
+        return key_length < entry_length ? -1 : 1;
+    }
+    uint entry_id = index_entry_id(entry);
+    return id < entry_id ? -1 : id > entry_id ? 1 : 0;
+}
+
+
+/**
+ * the first cell whose entry is >= (key, id), or the cell count if there is none
+ */
+uint index_node_lower_bound(void *node, const char *key, uint key_length, uint id) {
+    uint lo = 0;
+    uint hi = *index_node_num_cells(node);
+    while (lo < hi) {
+        uint mid = (lo + hi) / 2;
+        if (index_compare(key, key_length, id, index_cell_entry(node, index_node_cell(node, mid))) > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/**
+ * the child of an internal node that holds (key, id)
+ */
+uint index_node_find_child(void *node, const char *key, uint key_length, uint id) {
+    uint cell_num = index_node_lower_bound(node, key, key_length, id);
+    return cell_num < *index_node_num_cells(node) ? index_cell_child(index_node_cell(node, cell_num))
+                                                   : *index_node_link(node);
+}
+
+
+/**
+ * the caller has checked that the cell and its slot fit
+ */
+void index_node_insert_cell(void *node, uint cell_num, const char *cell, uint size) {
+    uint num_cells = *index_node_num_cells(node);
+    uint16_t heap_start = *index_node_heap_start(node) - size;
+    memcpy((char *) node + heap_start, cell, size);
+    memmove(index_node_slot(node, cell_num + 1), index_node_slot(node, cell_num),
+            (num_cells - cell_num) * INDEX_NODE_SLOT_SIZE);
+    *index_node_slot(node, cell_num) = heap_start;
+    *index_node_heap_start(node) = heap_start;
+    *index_node_num_cells(node) = num_cells + 1;
+}
+
+
+/**
+ * refills a node with the given cells, keeping its type, root flag and link
+ */
+void index_node_build(void *node, const char **cells, const uint *sizes, uint count) {
+    *index_node_num_cells(node) = 0;
+    *index_node_heap_start(node) = PAGE_SIZE;
+    for (uint i = 0; i < count; i++) {
+        index_node_insert_cell(node, i, cells[i], sizes[i]);
+    }
+}
+
+
+/**
+ * the index pages an insert has latched exclusively: page_num[first_latched..depth]
+ * from the root down (a root split pushes a level in under the root), and the
+ * right halves its splits created
+ */
+struct IndexPath {
+    uint depth;
+    uint first_latched;
+    uint page_num[MAX_TREE_DEPTH + 1];
+    uint num_created;
+    uint created[2 * (MAX_TREE_DEPTH + 1)];
+};
+
+
+/**
+ * a new, empty index page, latched exclusively; the caller records it in the path
+ */
+uint index_create_page(Pager *pager, NodeType type) {
+    uint page_num = get_unused_page_num(pager);
+    void *node = latch_page(pager, page_num, LATCH_EXCLUSIVE);
+    mark_page_dirty(pager, page_num);
+    initialize_index_node(node, type);
+    return page_num;
+}
+
+
+/**
+ * adds a cell to the node at level of path. A full node is compacted if that
+ * makes room, and split otherwise: the old page keeps the lower half, a new page
+ * takes the upper half, and the parent gets a cell for the old page. A full root
+ * first moves its cells down to a new page, so the root page never changes.
+ */
+void index_node_add(Pager *pager, IndexPath *path, uint level, const char *cell, uint size, uint cell_num) {
+    uint page_num = path->page_num[level];
+    void *node = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    if (index_node_free_space(node) >= size + INDEX_NODE_SLOT_SIZE) {
+        index_node_insert_cell(node, cell_num, cell, size);
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    char old[PAGE_SIZE];
+    memcpy(old, node, PAGE_SIZE);
+    uint count = *index_node_num_cells(old) + 1;
+    const char *cells[INDEX_NODE_MAX_CELLS + 1];
+    uint sizes[INDEX_NODE_MAX_CELLS + 1];
+    uint total = 0;
+    for (uint i = 0; i < count; i++) {
+        if (i == cell_num) {
+            cells[i] = cell;
+            sizes[i] = size;
+        } else {
+            char *old_cell = index_node_cell(old, i > cell_num ? i - 1 : i);
+            cells[i] = old_cell;
+            sizes[i] = index_cell_size(old, old_cell);
+        }
+        total += sizes[i] + INDEX_NODE_SLOT_SIZE;
+    }
+    if (total <= INDEX_NODE_SPACE_FOR_CELLS) {
+        index_node_build(node, cells, sizes, count);
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    if (level == 0) {
+        if (path->depth == MAX_TREE_DEPTH) {
+            printf("Index deeper than %d levels\n", MAX_TREE_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint child_page_num = index_create_page(pager, get_node_type(old));
+        void *child = get_page(pager, child_page_num);
+        memcpy(child, old, PAGE_SIZE);
+        set_node_root(child, false);
+        initialize_index_node(node, NODE_INDEX_INTERNAL);
+        set_node_root(node, true);
+        *index_node_link(node) = child_page_num;
+        unpin_page(pager, page_num);
+        memmove(&path->page_num[2], &path->page_num[1], path->depth * sizeof(uint));
+        path->page_num[1] = child_page_num;
+        path->depth++;
+        level = 1;
+        page_num = child_page_num;
+        node = child;
+    }
+
+    bool internal = get_node_type(old) == NODE_INDEX_INTERNAL;
+    uint split = 0;
+    uint left_bytes = 0;
+    while (split < count - 2 && left_bytes + sizes[split] + INDEX_NODE_SLOT_SIZE <= total / 2) {
+        left_bytes += sizes[split++] + INDEX_NODE_SLOT_SIZE;
+    }
+    split = std::max(split, 1u);
+    stats_add(STAT_INDEX_SPLITS, 1);
+    uint right_page_num = index_create_page(pager, internal ? NODE_INDEX_INTERNAL : NODE_INDEX_LEAF);
+    path->created[path->num_created++] = right_page_num;
+    void *right = get_page(pager, right_page_num);
+    // the separator for the old page is the largest entry left in it
+    const char *separator;
+    if (internal) {
+        // cells[split] moves up: its child becomes the left node's rightmost child
+        separator = cells[split] + INDEX_CELL_CHILD_SIZE;
+        index_node_build(node, cells, sizes, split);
+        *index_node_link(node) = index_cell_child((char *) cells[split]);
+        index_node_build(right, cells + split + 1, sizes + split + 1, count - split - 1);
+        *index_node_link(right) = *index_node_link(old);
+    } else {
+        separator = cells[split - 1];
+        index_node_build(node, cells, sizes, split);
+        index_node_build(right, cells + split, sizes + split, count - split);
+        *index_node_link(right) = *index_node_link(old);
+        *index_node_link(node) = right_page_num;
+    }
+    unpin_page(pager, right_page_num);
+    unpin_page(pager, page_num);
+
+    // the parent's cell for this page now covers the right half; the left half gets a new cell before it
+    uint parent_page_num = path->page_num[level - 1];
+    void *parent = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    uint num_parent_cells = *index_node_num_cells(parent);
+    uint parent_cell_num = 0;
+    while (parent_cell_num < num_parent_cells && index_cell_child(index_node_cell(parent, parent_cell_num)) != page_num) {
+        parent_cell_num++;
+    }
+    if (parent_cell_num == num_parent_cells) {
+        *index_node_link(parent) = right_page_num;
+    } else {
+        memcpy(index_node_cell(parent, parent_cell_num), &right_page_num, sizeof(uint));
+    }
+    unpin_page(pager, parent_page_num);
+
+    char parent_cell[INDEX_MAX_CELL_SIZE];
+    uint separator_size = index_entry_size(separator);
+    memcpy(parent_cell, &page_num, sizeof(uint));
+    memcpy(parent_cell + INDEX_CELL_CHILD_SIZE, separator, separator_size);
+    index_node_add(pager, path, level - 1, parent_cell, INDEX_CELL_CHILD_SIZE + separator_size, parent_cell_num);
+}
+
+
+const char *row_index_key(const Row *row, IndexColumn column) {
+    return column == INDEX_USERNAME ? row->username : row->email;
+}
+
+
+/**
+ * adds (key, id) to an index; runs with Table::writer held. Crabs down with
+ * exclusive latches, letting go of everything above a node with room for any
+ * cell, and releases the rest once the entry is in.
+ */
+void index_insert(Table *table, IndexColumn column, const char *key, uint id) {
+    Pager *pager = table->pager;
+    uint key_length = strlen(key);
+    IndexPath path;
+    path.depth = 0;
+    path.first_latched = 0;
+    path.num_created = 0;
+    path.page_num[0] = table->index_root_page_num[column];
+    void *node = latch_page(pager, path.page_num[0], LATCH_EXCLUSIVE);
+    while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+        if (path.depth == MAX_TREE_DEPTH) {
+            printf("Index deeper than %d levels\n", MAX_TREE_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint child_page_num = index_node_find_child(node, key, key_length, id);
+        node = latch_page(pager, child_page_num, LATCH_EXCLUSIVE);
+        path.page_num[++path.depth] = child_page_num;
+        if (index_node_free_space(node) >= INDEX_MAX_CELL_SIZE + INDEX_NODE_SLOT_SIZE) {
+            for (uint i = path.first_latched; i < path.depth; i++) {
+                unlatch_page(pager, path.page_num[i], LATCH_EXCLUSIVE);
+            }
+            path.first_latched = path.depth;
+        }
+    }
+
+    char cell[INDEX_MAX_CELL_SIZE];
+    memcpy(cell + INDEX_ENTRY_ID_OFFSET, &id, sizeof(uint));
+    cell[INDEX_ENTRY_KEY_LENGTH_OFFSET] = (char) key_length;
+    memcpy(cell + INDEX_ENTRY_KEY_OFFSET, key, key_length);
+    uint cell_num = index_node_lower_bound(node, key, key_length, id);
+    index_node_add(pager, &path, path.depth, cell, INDEX_ENTRY_KEY_OFFSET + key_length, cell_num);
+
+    for (uint i = path.first_latched; i <= path.depth; i++) {
+        unlatch_page(pager, path.page_num[i], LATCH_EXCLUSIVE);
+    }
+    for (uint i = 0; i < path.num_created; i++) {
+        unlatch_page(pager, path.created[i], LATCH_EXCLUSIVE);
+    }
+}
+
+
+/**
+ * adds a newly inserted row to every index
+ */
+void index_row(Table *table, const Row *row) {
+    for (uint column = 0; column < NUM_INDEXES; column++) {
+        index_insert(table, (IndexColumn) column, row_index_key(row, (IndexColumn) column), row->id);
+    }
+}
+
+
+void index_node_remove_cell(void *node, uint cell_num) {
+    uint num_cells = *index_node_num_cells(node);
+    memmove(index_node_slot(node, cell_num), index_node_slot(node, cell_num + 1),
+            (num_cells - cell_num - 1) * INDEX_NODE_SLOT_SIZE);
+    *index_node_num_cells(node) = num_cells - 1;
+}
+
+
+/**
+ * frees an emptied leaf: its right sibling moves into it, or, when it is its
+ * parent's last child, its left sibling takes over its link. Lookups latch
+ * leaves left to right, so the leaf is let go while its left sibling is latched.
+ */
+void index_leaf_merge(Pager *pager, uint parent_page_num, uint page_num) {
+    void *parent = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    uint num_cells = *index_node_num_cells(parent);
+    uint cell_num = 0;
+    while (cell_num < num_cells && index_cell_child(index_node_cell(parent, cell_num)) != page_num) {
+        cell_num++;
+    }
+    if (cell_num < num_cells) {
+        char *right_cell = cell_num + 1 < num_cells ? index_node_cell(parent, cell_num + 1) : nullptr;
+        uint right_page_num = right_cell != nullptr ? index_cell_child(right_cell) : *index_node_link(parent);
+        void *right = latch_page(pager, right_page_num, LATCH_EXCLUSIVE);
+        void *node = get_page(pager, page_num);
+        mark_page_dirty(pager, page_num);
+        memcpy(node, right, PAGE_SIZE);
+        unpin_page(pager, page_num);
+        if (right_cell != nullptr) {
+            memcpy(right_cell, &page_num, sizeof(uint));
+        } else {
+            *index_node_link(parent) = page_num;
+        }
+        index_node_remove_cell(parent, cell_num);
+        free_page(pager, right_page_num);
+        unlatch_page(pager, right_page_num, LATCH_EXCLUSIVE);
+    } else if (num_cells > 0) {
+        uint left_page_num = index_cell_child(index_node_cell(parent, num_cells - 1));
+        unlatch_page(pager, page_num, LATCH_EXCLUSIVE);
+        void *left = latch_page(pager, left_page_num, LATCH_EXCLUSIVE);
+        void *node = latch_page(pager, page_num, LATCH_EXCLUSIVE);
+        mark_page_dirty(pager, left_page_num);
+        *index_node_link(left) = *index_node_link(node);
+        *index_node_link(parent) = left_page_num;
+        index_node_remove_cell(parent, num_cells - 1);
+        free_page(pager, page_num);
+        unlatch_page(pager, left_page_num, LATCH_EXCLUSIVE);
+    }
+    unpin_page(pager, parent_page_num);
+}
+
+
+/**
+ * removes (key, id) from an index. Only a leaf changes unless it empties, so
+ * each node is let go once its child is latched, except that a leaf's parent
+ * is kept while the leaf has a single entry; an emptied leaf is freed. Holes
+ * left in a leaf are reclaimed when an insert next needs the room.
+ */
+void index_remove(Table *table, IndexColumn column, const char *key, uint id) {
+    Pager *pager = table->pager;
+    uint key_length = strlen(key);
+    uint parent_page_num = INVALID_PAGE_NUM;
+    uint page_num = table->index_root_page_num[column];
+    void *node = latch_page(pager, page_num, LATCH_EXCLUSIVE);
+    while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+        uint child_page_num = index_node_find_child(node, key, key_length, id);
+        void *child = latch_page(pager, child_page_num, LATCH_EXCLUSIVE);
+        if (parent_page_num != INVALID_PAGE_NUM) {
+            unlatch_page(pager, parent_page_num, LATCH_EXCLUSIVE);
+        }
+        parent_page_num = page_num;
+        page_num = child_page_num;
+        node = child;
+    }
+    if (parent_page_num != INVALID_PAGE_NUM && *index_node_num_cells(node) > 1) {
+        unlatch_page(pager, parent_page_num, LATCH_EXCLUSIVE);
+        parent_page_num = INVALID_PAGE_NUM;
+    }
+
+    uint cell_num = index_node_lower_bound(node, key, key_length, id);
+    if (cell_num < *index_node_num_cells(node) &&
+        index_compare(key, key_length, id, index_node_cell(node, cell_num)) == 0) {
+        mark_page_dirty(pager, page_num);
+        index_node_remove_cell(node, cell_num);
+        if (*index_node_num_cells(node) == 0 && parent_page_num != INVALID_PAGE_NUM) {
+            index_leaf_merge(pager, parent_page_num, page_num);
+        }
+    }
+    unlatch_page(pager, page_num, LATCH_EXCLUSIVE);
+    if (parent_page_num != INVALID_PAGE_NUM) {
+        unlatch_page(pager, parent_page_num, LATCH_EXCLUSIVE);
+    }
+}
+
+
+void index_remove_row(Table *table, const Row *row) {
+    for (uint column = 0; column < NUM_INDEXES; column++) {
+        index_remove(table, (IndexColumn) column, row_index_key(row, (IndexColumn) column), row->id);
+    }
+}
+
+
+/**
+ * collects, in id order, up to capacity ids of rows whose column equals key,
+ * starting from from_id. Readers crab down with shared latches and hold none
+ * when this returns, so the rows can be fetched without holding index pages.
+ * @return the number of ids found; capacity means there may be more
+ */
+uint index_lookup(Table *table, IndexColumn column, const char *key, uint from_id, uint *ids, uint capacity) {
+    Pager *pager = table->pager;
+    uint key_length = strlen(key);
+    uint page_num = table->index_root_page_num[column];
+    void *node = latch_page(pager, page_num, LATCH_SHARED);
+    while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+        uint child_page_num = index_node_find_child(node, key, key_length, from_id);
+        void *child = latch_page(pager, child_page_num, LATCH_SHARED);
+        unlatch_page(pager, page_num, LATCH_SHARED);
+        page_num = child_page_num;
+        node = child;
+    }
+
+    uint count = 0;
+    uint cell_num = index_node_lower_bound(node, key, key_length, from_id);
+    while (count < capacity) {
+        if (cell_num == *index_node_num_cells(node)) {
+            uint next_page_num = *index_node_link(node);
+            if (next_page_num == 0) {
+                break;
+            }
+            void *next = latch_page(pager, next_page_num, LATCH_SHARED);
+            unlatch_page(pager, page_num, LATCH_SHARED);
+            page_num = next_page_num;
+            node = next;
+            cell_num = 0;
+            continue;
+        }
+        char *entry = index_node_cell(node, cell_num++);
+        if ((uint8) entry[INDEX_ENTRY_KEY_LENGTH_OFFSET] != key_length ||
+            memcmp(entry + INDEX_ENTRY_KEY_OFFSET, key, key_length) != 0) {
+            break;
+        }
+        ids[count++] = index_entry_id(entry);
+    }
+    unlatch_page(pager, page_num, LATCH_SHARED);
+    return count;
+}
+
+
+/**
+ * the rightmost leaf, with the internal nodes above it in table->right_spine, is
+ * cached on the table; splits on the right edge and merges reset it to
+ * INVALID_PAGE_NUM, and so does anything else that reshapes the tree
+ */
+uint table_rightmost_leaf(Table *table) {
+    if (table->rightmost_leaf_page_num != INVALID_PAGE_NUM) {
+        return table->rightmost_leaf_page_num;
+    }
+    uint page_num = table->root_page_num;
+    table->right_spine_depth = 0;
+    while (true) {
+        void *node = get_page(table->pager, page_num);
+        if (get_node_type(node) == NODE_LEAF) {
+            unpin_page(table->pager, page_num);
+            break;
+        }
+        table->right_spine[table->right_spine_depth++] = page_num;
+        uint child_page_num = *internal_node_right_child(node);
+        unpin_page(table->pager, page_num);
+        page_num = child_page_num;
+    }
+    table->rightmost_leaf_page_num = page_num;
+    return page_num;
+}
+
+
+/**
+ * ascending ids land past the end of the rightmost leaf: when the row fits there,
+ * latch down the right spine without searching the nodes, each counting the row
+ * under its right child, and append it. The leaf is checked first under a shared
+ * latch; with Table::writer held, what that found still stands once the spine is latched.
+ * @return false, with nothing latched, when the row must take table_latch_path
+ */
+bool table_append(Table *table, const Row *row, uint needed) {
+    Pager *pager = table->pager;
+    uint leaf_page_num = table_rightmost_leaf(table);
+    void *leaf = latch_page(pager, leaf_page_num, LATCH_SHARED);
+    uint num_cells = *leaf_node_num_cells(leaf);
+    bool appending = num_cells > 0 && row->id > *leaf_node_key(leaf, num_cells - 1) &&
+                     leaf_node_free_space(leaf) >= needed;
+    unlatch_page(pager, leaf_page_num, LATCH_SHARED);
+    if (!appending) {
+        return false;
+    }
+
+    // latch crabbing from the root, as in table_latch_path: a node is let go once its child is latched
+    for (uint level = 0; level < table->right_spine_depth; level++) {
+        uint page_num = table->right_spine[level];
+        void *node = table_latch(table, page_num);
+        if (level > 0) {
+            table_unlatch(table, table->right_spine[level - 1]);
+        }
+        mark_page_dirty(pager, page_num);
+        (*internal_node_count(node, *internal_node_num_keys(node)))++;
+    }
+    table_latch(table, leaf_page_num);
+    if (table->right_spine_depth > 0) {
+        table_unlatch(table, table->right_spine[table->right_spine_depth - 1]);
+    }
+    Cursor cursor{table, leaf_page_num, num_cells, false, row->id};
+    leaf_node_insert(&cursor, row->id, row, nullptr);
+    return true;
+}
+
+
+/**
+ * runs with Table::writer held; the pages it latches stay latched until the caller's table_unlatch_all
+ */
+ExecuteResult execute_insert(const Row *row_to_insert, Table *table) {
+    uint key_to_insert = row_to_insert->id;
+    uint needed = serialized_row_size(row_to_insert) + LEAF_NODE_CELL_OVERHEAD;
+    if (table_append(table, row_to_insert, needed)) {
+        index_row(table, row_to_insert);
+        return EXECUTE_SUCCESS;
+    }
+    if (table_has_key(table, key_to_insert)) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    TreePath path{};
+    uint page_num = table_latch_path(table, key_to_insert, needed, &path);
+    void *node = get_page(table->pager, page_num);
+    uint cell_num = key_lower_bound(leaf_node_key(node, 0), *leaf_node_num_cells(node), key_to_insert);
+    unpin_page(table->pager, page_num);
+
+    Cursor cursor{table, page_num, cell_num, false, key_to_insert};
+    leaf_node_insert(&cursor, key_to_insert, row_to_insert, &path);
+    index_row(table, row_to_insert);
+    return EXECUTE_SUCCESS;
+}
+
+
+/**
+ * inserts and commits one row
+ */
+ExecuteResult table_insert(Table *table, const Row *row) {
+    StatsTimer timer(STAT_INSERT_NS);
+    // one writer at a time; the commit waits for the log only after letting go, so writers can share a sync
+    ExecuteResult result;
+    uint64_t commit_lsn;
+    {
+        std::lock_guard<std::mutex> writer(table->writer);
+        // never waits: the gate only closes under the writer lock
+        table_enter(table);
+        result = execute_insert(row, table);
+        commit_lsn = pager_log_commit(table->pager);
+        table_unlatch_all(table);
+    }
+    if (commit_lsn != 0) {
+        wal_flush(table->pager->wal, commit_lsn, true);
+    }
+    table_leave(table);
+    return result;
+}
+
+
+ExecuteResult execute_statement(Statement *statement, Table *table) {
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+            return table_insert(table, &statement->row_to_insert);
+        case (STATEMENT_SELECT):
+            return execute_select(statement, table);
+        case (STATEMENT_DELETE):
+            return table_delete(table, statement->id_lo, statement->id_hi, nullptr);
+    }
+    return EXECUTE_FAIL;
+}
+
+
+Cursor table_start(Table *table) {
+    return table_seek(table, 0);
+}
+
+
+/**
+ * a cursor on the first key >= key, at the end of the table if there is none
+ */
+Cursor table_seek(Table *table, uint key) {
+    TableGuard guard(table);
+    Cursor cursor{table, 0, 0, false, 0, 0};
+    cursor_seek(&cursor, key);
+    return cursor;
+}
+
+
+/**
+ * the number of rows in the table, from the root's child counts
+ */
+uint table_num_rows(Table *table) {
+    TableGuard guard(table);
+    void *root = latch_page(table->pager, table->root_page_num, LATCH_SHARED);
+    uint num_rows = node_row_count(root);
+    unlatch_page(table->pager, table->root_page_num, LATCH_SHARED);
+    return num_rows;
+}
+
+
+/**
+ * the number of rows with an id below key: the counts of the children left of
+ * the path down to key's leaf, and the cells left of key in it
+ */
+uint table_rank(Table *table, uint key) {
+    TableGuard guard(table);
+    Pager *pager = table->pager;
+    uint rank = 0;
+    uint page_num = table->root_page_num;
+    void *node = latch_page(pager, page_num, LATCH_SHARED);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint child_index = internal_node_find_child(node, key);
+        const uint *counts = internal_node_counts(node);
+        for (uint i = 0; i < child_index; i++) {
+            rank += counts[i];
+        }
+        uint child_page_num = *internal_node_child(node, child_index);
+        void *child = latch_page(pager, child_page_num, LATCH_SHARED);
+        unlatch_page(pager, page_num, LATCH_SHARED);
+        page_num = child_page_num;
+        node = child;
+    }
+    rank += key_lower_bound(leaf_node_key(node, 0), *leaf_node_num_cells(node), key);
+    unlatch_page(pager, page_num, LATCH_SHARED);
+    return rank;
+}
+
+
+/**
+ * a cursor on the row at position rank in id order, counting from 0, at the
+ * end of the table when there are no more rows than that
+ */
+Cursor table_seek_rank(Table *table, uint rank) {
+    TableGuard guard(table);
+    Pager *pager = table->pager;
+    Cursor cursor{table, 0, 0, false, 0, 0};
+    uint page_num = table->root_page_num;
+    void *node = latch_page(pager, page_num, LATCH_SHARED);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        uint num_keys = *internal_node_num_keys(node);
+        const uint *counts = internal_node_counts(node);
+        uint child_index = 0;
+        while (child_index < num_keys && rank >= counts[child_index]) {
+            rank -= counts[child_index++];
+        }
+        uint child_page_num = *internal_node_child(node, child_index);
+        void *child = latch_page(pager, child_page_num, LATCH_SHARED);
+        unlatch_page(pager, page_num, LATCH_SHARED);
+        page_num = child_page_num;
+        node = child;
+    }
+    uint num_cells = *leaf_node_num_cells(node);
+    cursor.page_num = page_num;
+    cursor.cell_num = std::min(rank, num_cells);
+    cursor.end_of_table = rank >= num_cells;
+    cursor.key = cursor.end_of_table ? 0 : *leaf_node_key(node, rank);
+    unlatch_page(pager, page_num, LATCH_SHARED);
+    return cursor;
+}
+
+
+/**
+ * the number of rows with id_lo <= id <= id_hi, from two descents
+ */
+uint table_count(Table *table, uint id_lo, uint id_hi) {
+    if (id_lo > id_hi) {
+        return 0;
+    }
+    TableGuard guard(table);
+    uint upper = id_hi == UINT32_MAX ? table_num_rows(table) : table_rank(table, id_hi + 1);
+    uint lower = table_rank(table, id_lo);
+    // a writer may have moved between the descents
+    return upper > lower ? upper - lower : 0;
+}
+
+
+uint *leaf_node_next_leaf(void *node) {
+    return reinterpret_cast<uint *>((char *) node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+
+void update_internal_node_key(void *node, uint old_key, uint new_key) {
+    uint old_child_index = internal_node_find_child(node, old_key);
+    // the right child has no key of its own
+    if (old_child_index < *internal_node_num_keys(node)) {
+        *internal_node_key(node, old_child_index) = new_key;
+    }
+}
+
+
+uint internal_node_find_child(void *node, uint key) {
+    return key_lower_bound(internal_node_keys(node), *internal_node_num_keys(node), key);
+}
+
+/**
+ * splits a full internal node while adding child_page_num to it. The old page keeps
+ * the lower half, a new page takes the upper half and is inserted into the parent
+ * (or under a new root when the old node was the root).
+ */
+void internal_node_split_and_insert(Table *table, TreePath *path, uint level, uint child_page_num) {
+    stats_add(STAT_INTERNAL_SPLITS, 1);
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+    Pager *pager = table->pager;
+    uint old_page_num = path->page_num[level];
+    void *old_node = get_page(pager, old_page_num);
+    void *child = get_page(pager, child_page_num);
+    uint old_max = get_node_max_key(pager, old_node);
+    uint child_max = get_node_max_key(pager, child);
+    uint child_count = node_row_count(child);
+    unpin_page(pager, child_page_num);
+
+    /* gather every child with its max key and row count, the new one included, in key order */
+    uint old_num_keys = *internal_node_num_keys(old_node);
+    uint num_children = old_num_keys + 2;
+    uint children[INTERNAL_NODE_MAX_CELLS + 2];
+    uint keys[INTERNAL_NODE_MAX_CELLS + 2];
+    uint counts[INTERNAL_NODE_MAX_CELLS + 2];
+    uint n = 0;
+    bool inserted = false;
+    for (uint i = 0; i <= old_num_keys; i++) {
+        uint key = i < old_num_keys ? *internal_node_key(old_node, i) : old_max;
+        if (!inserted && child_max < key) {
+            children[n] = child_page_num;
+            counts[n] = child_count;
+            keys[n++] = child_max;
+            inserted = true;
+        }
+        children[n] = *internal_node_child(old_node, i);
+        counts[n] = *internal_node_count(old_node, i);
+        keys[n++] = key;
+    }
+    if (!inserted) {
+        children[n] = child_page_num;
+        counts[n] = child_count;
+        keys[n++] = child_max;
+    }
+
+    uint left_count = num_children / 2;
+    uint new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, old_page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+    internal_node_fill(old_node, children, keys, counts, left_count);
+    internal_node_fill(new_node, children + left_count, keys + left_count, counts + left_count, num_children - left_count);
+
+    if (is_node_root(old_node)) {
+        unpin_page(pager, new_page_num);
+        unpin_page(pager, old_page_num);
+        create_new_root(table, new_page_num);
+        return;
+    }
+
+    uint parent_page_num = path->page_num[level - 1];
+    void *parent = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    update_internal_node_key(parent, old_max, keys[left_count - 1]);
+    *internal_node_count(parent, internal_node_child_index(parent, old_page_num)) = node_row_count(old_node);
+    unpin_page(pager, parent_page_num);
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, old_page_num);
+    internal_node_insert(table, path, level - 1, new_page_num);
+}
+
+
+/**
+ * adds child_page_num to the internal node at path->page_num[level]
+ */
+void internal_node_insert(Table *table, TreePath *path, uint level, uint child_page_num) {
+    uint parent_page_num = path->page_num[level];
+    void *parent = get_page(table->pager, parent_page_num);
+    uint original_num_keys = *internal_node_num_keys(parent);
+    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
+        unpin_page(table->pager, parent_page_num);
+        internal_node_split_and_insert(table, path, level, child_page_num);
+        return;
+    }
+
+    void *child = get_page(table->pager, child_page_num);
+    uint child_max_key = get_node_max_key(table->pager, child);
+    uint child_count = node_row_count(child);
+    uint index = internal_node_find_child(parent, child_max_key);
+
+    mark_page_dirty(table->pager, parent_page_num);
+    uint right_count = *internal_node_count(parent, original_num_keys);
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+
+    uint right_child_page_num = *internal_node_right_child(parent);
+    void *right_child = get_page(table->pager, right_child_page_num);
+
+    if (child_max_key > get_node_max_key(table->pager, right_child)) {
+        // 当前页面已经是key最大的页面
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *internal_node_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
+        *internal_node_count(parent, original_num_keys) = right_count;
+        *internal_node_right_child(parent) = child_page_num;
+        *internal_node_count(parent, original_num_keys + 1) = child_count;
+    } else {
+        // key 从后向前拷贝
+        uint moved = original_num_keys - index;
+        memmove(internal_node_children(parent) + index + 1, internal_node_children(parent) + index,
+                moved * INTERNAL_NODE_CHILD_SIZE);
+        memmove(internal_node_keys(parent) + index + 1, internal_node_keys(parent) + index,
+                moved * INTERNAL_NODE_KEY_SIZE);
+        memmove(internal_node_counts(parent) + index + 1, internal_node_counts(parent) + index,
+                moved * INTERNAL_NODE_COUNT_SIZE);
+        *internal_node_child(parent, index) = child_page_num;
+        *internal_node_key(parent, index) = child_max_key;
+        *internal_node_count(parent, index) = child_count;
+    }
+    unpin_page(table->pager, right_child_page_num);
+    unpin_page(table->pager, child_page_num);
+    unpin_page(table->pager, parent_page_num);
+}
+
+
+uint internal_node_child_index(void *node, uint child_page_num) {
+    uint num_keys = *internal_node_num_keys(node);
+    for (uint i = 0; i < num_keys; i++) {
+        if (internal_node_children(node)[i] == child_page_num) {
+            return i;
+        }
+    }
+    return num_keys;
+}
+
+
+/**
+ * sets a node's children to the given count, each with its max key and row
+ * count; the last one becomes the right child and its key is dropped
+ */
+void internal_node_fill(void *node, const uint *children, const uint *keys, const uint *counts, uint count) {
+    *internal_node_num_keys(node) = count - 1;
+    memcpy(internal_node_children(node), children, (count - 1) * INTERNAL_NODE_CHILD_SIZE);
+    memcpy(internal_node_keys(node), keys, (count - 1) * INTERNAL_NODE_KEY_SIZE);
+    memcpy(internal_node_counts(node), counts, (count - 1) * INTERNAL_NODE_COUNT_SIZE);
+    *internal_node_right_child(node) = children[count - 1];
+    *internal_node_count(node, count - 1) = counts[count - 1];
+}
+
+
+/**
+ * drops child child_index once its rows have moved into the child before it,
+ * which takes over its key, or its place as the right child, and its row count
+ */
+void internal_node_remove_child(void *node, uint child_index, uint merged_count) {
+    uint num_keys = *internal_node_num_keys(node);
+    if (child_index == num_keys) {
+        *internal_node_right_child(node) = internal_node_children(node)[num_keys - 1];
+    } else {
+        uint moved = num_keys - child_index;
+        internal_node_children(node)[child_index] = internal_node_children(node)[child_index - 1];
+        memmove(internal_node_children(node) + child_index - 1, internal_node_children(node) + child_index,
+                moved * INTERNAL_NODE_CHILD_SIZE);
+        memmove(internal_node_keys(node) + child_index - 1, internal_node_keys(node) + child_index,
+                moved * INTERNAL_NODE_KEY_SIZE);
+        memmove(internal_node_counts(node) + child_index - 1, internal_node_counts(node) + child_index,
+                moved * INTERNAL_NODE_COUNT_SIZE);
+    }
+    *internal_node_num_keys(node) = num_keys - 1;
+    *internal_node_count(node, child_index - 1) = merged_count;
+}
+
+
+/**
+ * gives a keyless internal node, which the bulk loader can leave at the right
+ * edge of a level, a second child from a sibling, so that its children have a
+ * sibling to merge with. The parent's key count does not change.
+ */
+void internal_node_take_child(Table *table, uint parent_page_num, uint child_index, uint page_num) {
+    Pager *pager = table->pager;
+    void *parent = get_page(pager, parent_page_num);
+    if (*internal_node_num_keys(parent) == 0) {
+        unpin_page(pager, parent_page_num);
+        return;
+    }
+    uint sibling_page_num = *internal_node_child(parent, child_index > 0 ? child_index - 1 : child_index + 1);
+    if (!table_latched(table, sibling_page_num)) {
+        table_latch(table, sibling_page_num);
+    }
+    void *sibling = get_page(pager, sibling_page_num);
+    uint sibling_keys = *internal_node_num_keys(sibling);
+    if (sibling_keys < 2) {
+        unpin_page(pager, sibling_page_num);
+        unpin_page(pager, parent_page_num);
+        return;
+    }
+    void *node = get_page(pager, page_num);
+    mark_page_dirty(pager, parent_page_num);
+    mark_page_dirty(pager, sibling_page_num);
+    mark_page_dirty(pager, page_num);
+    uint node_count = *internal_node_count(node, 0);
+    uint moved_count;
+    *internal_node_num_keys(node) = 1;
+    if (child_index > 0) {
+        // the left sibling's right child moves over, bounded by the parent's key for the sibling
+        moved_count = *internal_node_count(sibling, sibling_keys);
+        *internal_node_child(node, 0) = *internal_node_right_child(sibling);
+        *internal_node_key(node, 0) = *internal_node_key(parent, child_index - 1);
+        *internal_node_count(node, 0) = moved_count;
+        *internal_node_count(node, 1) = node_count;
+        *internal_node_right_child(sibling) = internal_node_children(sibling)[sibling_keys - 1];
+        *internal_node_count(sibling, sibling_keys) = internal_node_counts(sibling)[sibling_keys - 1];
+        *internal_node_key(parent, child_index - 1) = *internal_node_key(sibling, sibling_keys - 1);
+        *internal_node_count(parent, child_index - 1) -= moved_count;
+    } else {
+        moved_count = internal_node_counts(sibling)[0];
+        *internal_node_child(node, 0) = *internal_node_right_child(node);
+        *internal_node_key(node, 0) = *internal_node_key(parent, child_index);
+        *internal_node_count(node, 0) = node_count;
+        *internal_node_right_child(node) = internal_node_children(sibling)[0];
+        *internal_node_count(node, 1) = moved_count;
+        *internal_node_key(parent, child_index) = *internal_node_key(sibling, 0);
+        *internal_node_count(parent, child_index + 1) -= moved_count;
+        memmove(internal_node_children(sibling), internal_node_children(sibling) + 1,
+                (sibling_keys - 1) * INTERNAL_NODE_CHILD_SIZE);
+        memmove(internal_node_keys(sibling), internal_node_keys(sibling) + 1, (sibling_keys - 1) * INTERNAL_NODE_KEY_SIZE);
+        memmove(internal_node_counts(sibling), internal_node_counts(sibling) + 1,
+                (sibling_keys - 1) * INTERNAL_NODE_COUNT_SIZE);
+    }
+    *internal_node_count(parent, child_index) += moved_count;
+    *internal_node_num_keys(sibling) = sibling_keys - 1;
+    unpin_page(pager, page_num);
+    unpin_page(pager, sibling_page_num);
+    unpin_page(pager, parent_page_num);
+}
+
+
+/**
+ * the delete counterpart of table_latch_path: a child that losing a row or a
+ * child cannot leave under-full lets go of everything above it, and each node
+ * passed takes the row off its child's count, so key must be in the table
+ */
+uint table_latch_delete_path(Table *table, uint key, TreePath *path) {
+    path->depth = 0;
+    uint page_num = table->root_page_num;
+    void *node = table_latch(table, page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        if (path->depth == MAX_TREE_DEPTH) {
+            printf("Tree deeper than %d levels\n", MAX_TREE_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint parent_page_num = page_num;
+        uint child_index = internal_node_find_child(node, key);
+        path->page_num[path->depth++] = page_num;
+        mark_page_dirty(table->pager, page_num);
+        (*internal_node_count(node, child_index))--;
+        page_num = *internal_node_child(node, child_index);
+        node = latch_page(table->pager, page_num, LATCH_EXCLUSIVE);
+        bool leaf = get_node_type(node) == NODE_LEAF;
+        bool safe = leaf ? leaf_node_used_bytes(node) >= LEAF_NODE_MIN_FILL_BYTES + ROW_MAX_SIZE + LEAF_NODE_CELL_OVERHEAD
+                         : *internal_node_num_keys(node) > INTERNAL_NODE_MIN_KEYS;
+        if (safe) {
+            table_unlatch_all(table);
+        }
+        table->latched_pages[table->num_latched++] = page_num;
+        if (!leaf && *internal_node_num_keys(node) == 0) {
+            internal_node_take_child(table, parent_page_num, child_index, page_num);
+        }
+    }
+    return page_num;
+}
+
+
+/**
+ * the internal node at level of path may have lost a child. A root left with
+ * one child takes that child's place; a non-root node below INTERNAL_NODE_MIN_KEYS
+ * merges with a sibling, or evens out their children when they do not fit in one node.
+ */
+void internal_node_rebalance(Table *table, TreePath *path, uint level) {
+    Pager *pager = table->pager;
+    uint page_num = path->page_num[level];
+    void *node = get_page(pager, page_num);
+    uint num_keys = *internal_node_num_keys(node);
+    if (level == 0) {
+        if (num_keys == 0) {
+            uint child_page_num = *internal_node_right_child(node);
+            void *child = get_page(pager, child_page_num);
+            mark_page_dirty(pager, page_num);
+            memcpy(node, child, PAGE_SIZE);
+            set_node_root(node, true);
+            unpin_page(pager, child_page_num);
+            free_page(pager, child_page_num);
+            table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+        }
+        unpin_page(pager, page_num);
+        return;
+    }
+    unpin_page(pager, page_num);
+    if (num_keys >= INTERNAL_NODE_MIN_KEYS) {
+        return;
+    }
+
+    uint parent_page_num = path->page_num[level - 1];
+    void *parent = get_page(pager, parent_page_num);
+    uint parent_keys = *internal_node_num_keys(parent);
+    if (parent_keys == 0) {
+        unpin_page(pager, parent_page_num);
+        return;
+    }
+    uint child_index = internal_node_child_index(parent, page_num);
+    uint left_index = child_index < parent_keys ? child_index : child_index - 1;
+    uint left_page_num = *internal_node_child(parent, left_index);
+    uint right_page_num = *internal_node_child(parent, left_index + 1);
+    // no reader moves sideways between internal nodes, so siblings latch in any order
+    uint sibling_page_num = left_page_num == page_num ? right_page_num : left_page_num;
+    if (!table_latched(table, sibling_page_num)) {
+        table_latch(table, sibling_page_num);
+    }
+    void *left = get_page(pager, left_page_num);
+    void *right = get_page(pager, right_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, right_page_num);
+
+    // every child of both nodes with its max key and row count; the parent's key bounds the left node's right child
+    uint children[2 * INTERNAL_NODE_MAX_CELLS + 2];
+    uint keys[2 * INTERNAL_NODE_MAX_CELLS + 2];
+    uint counts[2 * INTERNAL_NODE_MAX_CELLS + 2];
+    uint n = 0;
+    for (void *sibling: {left, right}) {
+        uint sibling_keys = *internal_node_num_keys(sibling);
+        memcpy(children + n, internal_node_children(sibling), sibling_keys * INTERNAL_NODE_CHILD_SIZE);
+        memcpy(keys + n, internal_node_keys(sibling), sibling_keys * INTERNAL_NODE_KEY_SIZE);
+        memcpy(counts + n, internal_node_counts(sibling), sibling_keys * INTERNAL_NODE_COUNT_SIZE);
+        n += sibling_keys;
+        children[n] = *internal_node_right_child(sibling);
+        counts[n] = *internal_node_count(sibling, sibling_keys);
+        keys[n++] = sibling == left ? *internal_node_key(parent, left_index) : 0;
+    }
+
+    if (n - 1 <= INTERNAL_NODE_MAX_CELLS) {
+        internal_node_fill(left, children, keys, counts, n);
+        internal_node_remove_child(parent, left_index + 1, node_row_count(left));
+        unpin_page(pager, right_page_num);
+        unpin_page(pager, left_page_num);
+        unpin_page(pager, parent_page_num);
+        free_page(pager, right_page_num);
+        table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+        internal_node_rebalance(table, path, level - 1);
+        return;
+    }
+    uint left_count = n / 2;
+    internal_node_fill(left, children, keys, counts, left_count);
+    internal_node_fill(right, children + left_count, keys + left_count, counts + left_count, n - left_count);
+    *internal_node_key(parent, left_index) = keys[left_count - 1];
+    *internal_node_count(parent, left_index) = node_row_count(left);
+    *internal_node_count(parent, left_index + 1) = node_row_count(right);
+    unpin_page(pager, right_page_num);
+    unpin_page(pager, left_page_num);
+    unpin_page(pager, parent_page_num);
+}
+
+
+/**
+ * merges an under-full leaf with a sibling, or evens out their bytes when they
+ * do not fit in one page. Scans latch leaves left to right along the chain, so
+ * the leaf is let go while its left sibling is latched.
+ */
+void leaf_node_rebalance(Table *table, TreePath *path, uint page_num) {
+    Pager *pager = table->pager;
+    uint parent_page_num = path->page_num[path->depth - 1];
+    void *parent = get_page(pager, parent_page_num);
+    uint parent_keys = *internal_node_num_keys(parent);
+    if (parent_keys == 0) {
+        unpin_page(pager, parent_page_num);
+        return;
+    }
+    uint child_index = internal_node_child_index(parent, page_num);
+    uint left_index = child_index < parent_keys ? child_index : child_index - 1;
+    uint left_page_num = *internal_node_child(parent, left_index);
+    uint right_page_num = *internal_node_child(parent, left_index + 1);
+    if (left_page_num == page_num) {
+        table_latch(table, right_page_num);
+    } else {
+        table_unlatch(table, page_num);
+        table_latch(table, left_page_num);
+        table_latch(table, page_num);
+    }
+    void *left = get_page(pager, left_page_num);
+    void *right = get_page(pager, right_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, right_page_num);
+
+    // both leaves are rebuilt, so read their rows from copies
+    char left_copy[PAGE_SIZE];
+    char right_copy[PAGE_SIZE];
+    memcpy(left_copy, left, PAGE_SIZE);
+    memcpy(right_copy, right, PAGE_SIZE);
+    uint keys[2 * LEAF_NODE_MAX_CELLS];
+    void *values[2 * LEAF_NODE_MAX_CELLS];
+    uint total = 0;
+    uint total_bytes = 0;
+    for (void *sibling: {(void *) left_copy, (void *) right_copy}) {
+        for (uint i = 0; i < *leaf_node_num_cells(sibling); i++) {
+            keys[total] = *leaf_node_key(sibling, i);
+            values[total] = leaf_node_value(sibling, i);
+            total_bytes += serialized_size(values[total++]) + LEAF_NODE_CELL_OVERHEAD;
+        }
+    }
+
+    if (total_bytes <= LEAF_NODE_SPACE_FOR_CELLS) {
+        leaf_node_build(left, total, keys, values);
+        *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right_copy);
+        internal_node_remove_child(parent, left_index + 1, total);
+        unpin_page(pager, right_page_num);
+        unpin_page(pager, left_page_num);
+        unpin_page(pager, parent_page_num);
+        free_page(pager, right_page_num);
+        table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+        internal_node_rebalance(table, path, path->depth - 1);
+        return;
+    }
+    uint left_count = 0;
+    uint left_bytes = 0;
+    while (left_count < total - 1 && left_bytes < total_bytes / 2) {
+        left_bytes += serialized_size(values[left_count++]) + LEAF_NODE_CELL_OVERHEAD;
+    }
+    leaf_node_build(left, left_count, keys, values);
+    leaf_node_build(right, total - left_count, keys + left_count, values + left_count);
+    *internal_node_key(parent, left_index) = keys[left_count - 1];
+    *internal_node_count(parent, left_index) = left_count;
+    *internal_node_count(parent, left_index + 1) = total - left_count;
+    unpin_page(pager, right_page_num);
+    unpin_page(pager, left_page_num);
+    unpin_page(pager, parent_page_num);
+}
+
+
+/**
+ * removes the row with key, which the caller has found in the table, and its index
+ * entries; runs with Table::writer held, and the pages it latches stay latched
+ * until the caller's table_unlatch_all
+ */
+void execute_delete(Table *table, uint key) {
+    Pager *pager = table->pager;
+    TreePath path{};
+    uint page_num = table_latch_delete_path(table, key, &path);
+    void *node = get_page(pager, page_num);
+    uint cell_num = key_lower_bound(leaf_node_key(node, 0), *leaf_node_num_cells(node), key);
+    Row row;
+    deserialize_row(leaf_node_value(node, cell_num), &row);
+    mark_page_dirty(pager, page_num);
+    leaf_node_remove_cell(node, cell_num);
+    bool under_full = !is_node_root(node) && leaf_node_used_bytes(node) < LEAF_NODE_MIN_FILL_BYTES;
+    unpin_page(pager, page_num);
+    if (under_full) {
+        leaf_node_rebalance(table, &path, page_num);
+    }
+    index_remove_row(table, &row);
+}
+
+
+/**
+ * deletes the rows with id_lo <= id <= id_hi. Each row commits on its own, so a
+ * range of any size stays within MAX_TXN_PAGES, and the log is synced once at the end.
+ */
+ExecuteResult table_delete(Table *table, uint id_lo, uint id_hi, uint *num_deleted) {
+    StatsTimer timer(STAT_DELETE_NS);
+    uint count = 0;
+    uint64_t commit_lsn = 0;
+    {
+        std::lock_guard<std::mutex> writer(table->writer);
+        table_enter(table);
+        uint key = id_lo;
+        while (key <= id_hi) {
+            Cursor cursor = table_seek(table, key);
+            if (cursor.end_of_table || cursor.key > id_hi) {
+                break;
+            }
+            // the seek is the delete's probe: table_latch_delete_path only runs for a row that is there
+            key = cursor.key;
+            execute_delete(table, key);
+            count++;
+            commit_lsn = std::max(commit_lsn, pager_log_commit(table->pager));
+            table_unlatch_all(table);
+            if (key == UINT32_MAX) {
+                break;
+            }
+            key++;
+        }
+    }
+    if (commit_lsn != 0) {
+        wal_flush(table->pager->wal, commit_lsn, true);
+    }
+    table_leave(table);
+    if (num_deleted != nullptr) {
+        *num_deleted = count;
+    }
+    return EXECUTE_SUCCESS;
+}
+
+
+ExecuteResult bulk_load_begin(Table *table, double fill_factor, BulkLoader *loader) {
+    void *root = get_page(table->pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    unpin_page(table->pager, table->root_page_num);
+    if (!empty) {
+        return EXECUTE_TABLE_NOT_EMPTY;
+    }
+
+    loader->table = table;
+    loader->leaf_fill_bytes = (uint) (LEAF_NODE_SPACE_FOR_CELLS * fill_factor);
+    loader->internal_target = std::max(1u, (uint) (INTERNAL_NODE_MAX_CELLS * fill_factor));
+    loader->first_leaf_page_num = INVALID_PAGE_NUM;
+    loader->leaf_page_num = INVALID_PAGE_NUM;
+    loader->leaf = nullptr;
+    loader->last_key = 0;
+    loader->num_rows = 0;
+    loader->num_levels = 0;
+    // loaded pages bypass the log; bulk_load_finish makes them durable before linking them in
+    table->pager->txn_tracking = false;
+    return EXECUTE_SUCCESS;
+}
+
+
+/**
+ * hands a finished node to the open node one level up, starting a new one there when it is full
+ */
+void bulk_load_push(BulkLoader *loader, uint level, uint child_page_num, uint child_max) {
+    Pager *pager = loader->table->pager;
+    void *child = get_page(pager, child_page_num);
+    uint child_count = node_row_count(child);
+    unpin_page(pager, child_page_num);
+    if (level == MAX_TREE_DEPTH) {
+        printf("Bulk load exceeded the maximum tree depth\n");
+        exit(EXIT_FAILURE);
+    }
+    if (level == loader->num_levels) {
+        loader->num_levels++;
+        loader->level_page_num[level] = INVALID_PAGE_NUM;
+    }
+
+    uint page_num = loader->level_page_num[level];
+    void *node = page_num == INVALID_PAGE_NUM ? nullptr : get_page(pager, page_num);
+    if (node != nullptr && *internal_node_num_keys(node) >= loader->internal_target) {
+        unpin_page(pager, page_num);
+        bulk_load_push(loader, level + 1, page_num, loader->level_right_max[level]);
+        node = nullptr;
+    }
+    if (node == nullptr) {
+        page_num = get_unused_page_num(pager);
+        node = get_page(pager, page_num);
+        initialize_internal_node(node);
+        *internal_node_right_child(node) = child_page_num;
+        *internal_node_count(node, 0) = child_count;
+        loader->level_page_num[level] = page_num;
+    } else {
+        uint num_keys = *internal_node_num_keys(node);
+        internal_node_children(node)[num_keys] = *internal_node_right_child(node);
+        internal_node_counts(node)[num_keys] = *internal_node_count(node, num_keys);
+        *internal_node_key(node, num_keys) = loader->level_right_max[level];
+        *internal_node_num_keys(node) = num_keys + 1;
+        *internal_node_right_child(node) = child_page_num;
+        *internal_node_count(node, num_keys + 1) = child_count;
+    }
+    loader->level_right_max[level] = child_max;
+    mark_page_dirty(pager, page_num);
+    unpin_page(pager, page_num);
+}
+
+
+void bulk_load_close_leaf(BulkLoader *loader) {
+    mark_page_dirty(loader->table->pager, loader->leaf_page_num);
+    unpin_page(loader->table->pager, loader->leaf_page_num);
+    loader->leaf = nullptr;
+}
+
+
+ExecuteResult bulk_load_add(BulkLoader *loader, const Row *row) {
+    Pager *pager = loader->table->pager;
+    if (loader->num_rows > 0 && row->id <= loader->last_key) {
+        return row->id == loader->last_key ? EXECUTE_DUPLICATE_KEY : EXECUTE_KEY_OUT_OF_ORDER;
+    }
+
+    uint needed = serialized_row_size(row) + LEAF_NODE_CELL_OVERHEAD;
+    bool leaf_full = loader->leaf == nullptr || leaf_node_free_space(loader->leaf) < needed ||
+                     (*leaf_node_num_cells(loader->leaf) > 0 &&
+                      LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(loader->leaf) + needed > loader->leaf_fill_bytes);
+    if (leaf_full) {
+        uint next_page_num = get_unused_page_num(pager);
+        void *next_leaf = get_page(pager, next_page_num);
+        initialize_leaf_node(next_leaf);
+        if (loader->leaf != nullptr) {
+            uint full_page_num = loader->leaf_page_num;
+            *leaf_node_next_leaf(loader->leaf) = next_page_num;
+            bulk_load_close_leaf(loader);
+            bulk_load_push(loader, 0, full_page_num, loader->last_key);
+        } else {
+            loader->first_leaf_page_num = next_page_num;
+        }
+        loader->leaf_page_num = next_page_num;
+        loader->leaf = next_leaf;
+    }
+
+    leaf_node_insert_cell(loader->leaf, *leaf_node_num_cells(loader->leaf), row->id, row);
+    loader->last_key = row->id;
+    loader->num_rows++;
+    return EXECUTE_SUCCESS;
+}
+
+
+/**
+ * pushes the open nodes up level by level, fills the indexes from the loaded
+ * rows, and moves the topmost node into the root page
+ */
+void bulk_load_finish(BulkLoader *loader) {
+    Table *table = loader->table;
+    Pager *pager = table->pager;
+    if (loader->leaf == nullptr) {
+        pager->txn_tracking = pager->wal != nullptr;
+        return;
+    }
+
+    uint top_page_num = loader->leaf_page_num;
+    bulk_load_close_leaf(loader);
+    if (loader->num_levels > 0) {
+        bulk_load_push(loader, 0, top_page_num, loader->last_key);
+        for (uint level = 0; level + 1 < loader->num_levels; level++) {
+            bulk_load_push(loader, level + 1, loader->level_page_num[level], loader->level_right_max[level]);
+        }
+        top_page_num = loader->level_page_num[loader->num_levels - 1];
+    }
+    // the leaves are not linked under the root yet, so walk their chain
+    for (uint page_num = loader->first_leaf_page_num; page_num != 0;) {
+        void *leaf = get_page(pager, page_num);
+        Row row;
+        for (uint i = 0; i < *leaf_node_num_cells(leaf); i++) {
+            deserialize_row(leaf_node_value(leaf, i), &row);
+            index_row(table, &row);
+        }
+        uint next_page_num = *leaf_node_next_leaf(leaf);
+        unpin_page(pager, page_num);
+        page_num = next_page_num;
+    }
+    if (pager->wal != nullptr) {
+        pager_checkpoint(pager);
+        pager->txn_tracking = true;
+    }
+
+    void *top = get_page(pager, top_page_num);
+    void *root = latch_page(pager, table->root_page_num, LATCH_EXCLUSIVE);
+    mark_page_dirty(pager, table->root_page_num);
+    memcpy(root, top, PAGE_SIZE);
+    set_node_root(root, true);
+    unlatch_page(pager, table->root_page_num, LATCH_EXCLUSIVE);
+    unpin_page(pager, top_page_num);
+    free_page(pager, top_page_num);
+    pager_commit(pager);
+    table->rightmost_leaf_page_num = INVALID_PAGE_NUM;
+}
+
+
+/**
+ * drops a load in progress; the root was never touched so the table stays empty
+ */
+void bulk_load_abort(BulkLoader *loader) {
+    if (loader->leaf != nullptr) {
+        bulk_load_close_leaf(loader);
+    }
+    loader->table->pager->txn_tracking = loader->table->pager->wal != nullptr;
+}
+
+
+/**
+ * fsyncs the directory holding filename, making a rename into it durable
+ */
+void sync_directory_of(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    char *directory = slash == nullptr ? strdup(".") : strndup(filename, std::max<size_t>(slash - filename, 1));
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd == -1 || fsync(fd) == -1) {
+        printf("Error syncing %s\n", directory);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(directory);
+}
+
+
+/**
+ * an empty table in <db>-vacuum with the table's options, less the log, for a
+ * bulk load that is to replace the database file
+ */
+Table *rewrite_begin(Table *table) {
+    char *path = vacuum_path(table->filename);
+    unlink(path);
+    DbOptions options = table->options;
+    options.pager_mode = PAGER_BUFFER_POOL;
+    options.wal = false;
+    options.scan_threads = 1;
+    Table *copy = db_open(path, &options);
+    free(path);
+    return copy;
+}
+
+
+/**
+ * makes a copy from rewrite_begin durable, closes it and renames it over the
+ * database file; the caller reopens the table on it
+ */
+void rewrite_finish(Table *table, Table *copy) {
+    char *path = strdup(copy->filename);
+    pager_sync(copy->pager);
+    db_close(copy);
+    if (rename(path, table->filename) == -1) {
+        printf("Error replacing %s\n", table->filename);
+        exit(EXIT_FAILURE);
+    }
+    sync_directory_of(table->filename);
+    free(path);
+}
+
+
+/**
+ * rewrites the table into <db>-vacuum through the bulk loader, so that its
+ * leaves follow one another in key order at fill_factor with the indexes after
+ * them, then renames the copy over the database file and reopens the table on
+ * it. Readers keep using the old file while the copy is written and writers
+ * wait; only the swap waits for the statements in flight, so a row callback
+ * must not write to the table it is reading.
+ */
+void table_vacuum(Table *table, double fill_factor) {
+    std::lock_guard<std::mutex> writer(table->writer);
+    // the log must be empty before the file it applies to is replaced
+    if (table->pager->wal != nullptr) {
+        pager_checkpoint(table->pager);
+    }
+
+    Table *copy = rewrite_begin(table);
+    BulkLoader loader{};
+    bulk_load_begin(copy, fill_factor, &loader);
+    Cursor cursor = table_start(table);
+    Row row;
+    while (cursor_next_row(&cursor, UINT32_MAX, &row)) {
+        bulk_load_add(&loader, &row);
+    }
+    bulk_load_finish(&loader);
+    rewrite_finish(table, copy);
+
+    table_close_gate(table);
+    pager_close(table->pager);
+    table_open_file(table);
+    table_open_gate(table);
+}
+
+
+ThreadPool *thread_pool_create(uint num_threads) {
+    auto *pool = new ThreadPool();
+    pool->tasks.resize(THREAD_POOL_INITIAL_TASKS);
+    pool->task_head = 0;
+    pool->num_tasks = 0;
+    pool->stopping = false;
+    for (uint i = 0; i < num_threads; i++) {
+        pool->workers.emplace_back([pool] {
+            while (true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(pool->mutex);
+                    pool->wakeup.wait(lock, [pool] { return pool->stopping || pool->num_tasks > 0; });
+                    if (pool->num_tasks == 0) {
+                        return;
+                    }
+                    task = std::move(pool->tasks[pool->task_head]);
+                    pool->task_head = (pool->task_head + 1) % pool->tasks.size();
+                    pool->num_tasks--;
+                }
+                task();
+            }
+        });
+    }
+    return pool;
+}
+
+
+/**
+ * the queue is a ring that only reallocates when it holds more tasks than ever before
+ */
+void thread_pool_submit(ThreadPool *pool, std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        size_t capacity = pool->tasks.size();
+        if (pool->num_tasks == capacity) {
+            std::vector<std::function<void()>> tasks(capacity * 2);
+            for (size_t i = 0; i < capacity; i++) {
+                tasks[i] = std::move(pool->tasks[(pool->task_head + i) % capacity]);
+            }
+            pool->tasks.swap(tasks);
+            pool->task_head = 0;
+            capacity *= 2;
+        }
+        pool->tasks[(pool->task_head + pool->num_tasks) % capacity] = std::move(task);
+        pool->num_tasks++;
+    }
+    pool->wakeup.notify_one();
+}
+
+
+/**
+ * runs the tasks already queued, then joins the workers
+ */
+void thread_pool_destroy(ThreadPool *pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stopping = true;
+    }
+    pool->wakeup.notify_all();
+    for (std::thread &worker: pool->workers) {
+        worker.join();
+    }
+    delete pool;
+}
+
+
+/**
+ * a bump allocator for one thread's statement temporaries. Whatever does not fit
+ * the block goes to overflow blocks, and the outermost release folds them into
+ * one larger block, so a workload that repeats stops allocating after its first run.
+ */
+struct ArenaOverflow {
+    ArenaOverflow *next;
+};
+
+struct Arena;
+
+void arena_free_overflow(Arena *arena);
+
+struct Arena {
+    char *block;
+    size_t capacity;
+    size_t used;
+    ArenaOverflow *overflow;
+    size_t overflow_bytes;
+
+    ~Arena() {
+        arena_free_overflow(this);
+        free(block);
+    }
+};
+
+#define ARENA_ALIGNMENT 16
+
+thread_local Arena statement_arena{nullptr, 0, 0, nullptr, 0};
+
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    if (arena->capacity - arena->used >= size) {
+        void *memory = arena->block + arena->used;
+        arena->used += size;
+        return memory;
+    }
+    auto *overflow = (ArenaOverflow *) malloc(ARENA_ALIGNMENT + size);
+    if (overflow == nullptr) {
+        printf("Error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    overflow->next = arena->overflow;
+    arena->overflow = overflow;
+    arena->overflow_bytes += size;
+    return (char *) overflow + ARENA_ALIGNMENT;
+}
+
+
+void arena_free_overflow(Arena *arena) {
+    while (arena->overflow != nullptr) {
+        ArenaOverflow *next = arena->overflow->next;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+    arena->overflow_bytes = 0;
+}
+
+
+size_t arena_mark(Arena *arena) {
+    return arena->used;
+}
+
+
+/**
+ * frees everything allocated since mark was taken
+ */
+void arena_release(Arena *arena, size_t mark) {
+    arena->used = mark;
+    if (mark == 0 && arena->overflow != nullptr) {
+        size_t capacity = arena->capacity + arena->overflow_bytes;
+        arena_free_overflow(arena);
+        free(arena->block);
+        arena->block = (char *) aligned_alloc(ARENA_ALIGNMENT, capacity);
+        arena->capacity = capacity;
+    }
+}
+
+
+/**
+ * rows travel from a scan worker to the consumer a chunk at a time, through a
+ * ring of SCAN_QUEUE_CHUNKS chunks owned by the partition: the worker fills
+ * chunk produced, the consumer reads chunk consumed, and the worker waits while
+ * every chunk of its ring is still queued or being read
+ */
+#define SCAN_CHUNK_ROWS 64
+#define SCAN_QUEUE_CHUNKS 3
+/* partitions per worker, so that uneven ranges still balance */
+#define SCAN_PARTITIONS_PER_WORKER 4
+
+struct ScanChunk {
+    uint num_rows;
+    Row rows[SCAN_CHUNK_ROWS];
+};
+
+struct ScanPartition {
+    uint id_lo;
+    uint id_hi;
+    ScanChunk *chunks;
+    uint produced;
+    uint consumed;
+    bool done;
+};
+
+struct ParallelScan {
+    Table *table;
+    std::mutex mutex;
+    std::condition_variable changed;
+    ScanPartition *partitions;
+    uint num_partitions;
+    uint num_running;
+    bool cancelled;
+};
+
+
+/**
+ * the separator keys of the root's children, and of its grandchildren when the
+ * root alone gives fewer than target ranges; the array comes from the statement arena
+ */
+uint *scan_separators(Table *table, uint target, uint *num_separators) {
+    Pager *pager = table->pager;
+    uint *separators = nullptr;
+    uint count = 0;
+    uint children[INTERNAL_NODE_MAX_CELLS + 1];
+    uint num_children = 0;
+    void *root = latch_page(pager, table->root_page_num, LATCH_SHARED);
+    if (get_node_type(root) == NODE_INTERNAL) {
+        uint num_keys = *internal_node_num_keys(root);
+        num_children = num_keys + 1;
+        // room for every grandchild's keys as well, in case they are needed below
+        separators = (uint *) arena_alloc(&statement_arena, (size_t) (num_keys + num_children * INTERNAL_NODE_MAX_CELLS) * sizeof(uint));
+        memcpy(separators, internal_node_keys(root), num_keys * sizeof(uint));
+        count = num_keys;
+        for (uint i = 0; i < num_children; i++) {
+            children[i] = *internal_node_child(root, i);
+        }
+    }
+    unlatch_page(pager, table->root_page_num, LATCH_SHARED);
+
+    if (count + 1 < target && num_children > 0) {
+        // a child may have split since the root was read; the ranges only need to be sorted, not exact
+        for (uint i = 0; i < num_children; i++) {
+            void *child = latch_page(pager, children[i], LATCH_SHARED);
+            if (get_node_type(child) == NODE_INTERNAL) {
+                uint num_keys = *internal_node_num_keys(child);
+                memcpy(separators + count, internal_node_keys(child), num_keys * sizeof(uint));
+                count += num_keys;
+            }
+            unlatch_page(pager, children[i], LATCH_SHARED);
+        }
+        std::sort(separators, separators + count);
+        count = std::unique(separators, separators + count) - separators;
+    }
+    *num_separators = count;
+    return separators;
+}
+
+
+/**
+ * splits [id_lo, id_hi] at the tree's separator keys into at most max_partitions ranges
+ */
+void scan_partition_ranges(ParallelScan *scan, uint id_lo, uint id_hi, uint max_partitions) {
+    uint num_keys = 0;
+    uint *keys = scan_separators(scan->table, max_partitions, &num_keys);
+    // keep the separators inside the range, in place
+    uint num_separators = 0;
+    for (uint i = 0; i < num_keys; i++) {
+        if (keys[i] >= id_lo && keys[i] < id_hi) {
+            keys[num_separators++] = keys[i];
+        }
+    }
+    uint num_partitions = std::min(num_separators + 1, max_partitions);
+    scan->partitions = (ScanPartition *) arena_alloc(&statement_arena, num_partitions * sizeof(ScanPartition));
+    scan->num_partitions = num_partitions;
+    uint lo = id_lo;
+    for (uint i = 1; i <= num_partitions; i++) {
+        // partition i - 1 ends at an evenly spaced separator, the last one at id_hi
+        uint hi = i == num_partitions ? id_hi : keys[(size_t) i * (num_separators + 1) / num_partitions - 1];
+        auto *chunks = (ScanChunk *) arena_alloc(&statement_arena, SCAN_QUEUE_CHUNKS * sizeof(ScanChunk));
+        scan->partitions[i - 1] = {lo, hi, chunks, 0, 0, false};
+        lo = hi + 1;
+    }
+}
+
+
+/**
+ * one worker's share of a parallel scan: walks its range with its own cursor
+ * and fills its partition's chunks
+ */
+void scan_partition(ParallelScan *scan, uint index) {
+    Table *table = scan->table;
+    ScanPartition *partition = &scan->partitions[index];
+    uint id_hi = partition->id_hi;
+    // runs inside table_parallel_scan's entry to the gate
+    Cursor cursor{table, 0, 0, false, 0, 0};
+    cursor_seek(&cursor, partition->id_lo);
+    // the first chunk is free: nothing has been produced yet
+    ScanChunk *chunk = &partition->chunks[0];
+    chunk->num_rows = 0;
+    bool stopped = false;
+    while (!stopped && cursor_read_row(&cursor, id_hi, &chunk->rows[chunk->num_rows])) {
+        if (++chunk->num_rows == SCAN_CHUNK_ROWS) {
+            std::unique_lock<std::mutex> lock(scan->mutex);
+            partition->produced++;
+            scan->changed.notify_all();
+            scan->changed.wait(lock, [scan, partition] {
+                return scan->cancelled || partition->produced - partition->consumed < SCAN_QUEUE_CHUNKS;
+            });
+            stopped = scan->cancelled;
+            lock.unlock();
+            chunk = &partition->chunks[partition->produced % SCAN_QUEUE_CHUNKS];
+            chunk->num_rows = 0;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(scan->mutex);
+    if (chunk->num_rows > 0 && !stopped) {
+        partition->produced++;
+    }
+    partition->done = true;
+    scan->num_running--;
+    scan->changed.notify_all();
+}
+
+
+/**
+ * scans id_lo <= id <= id_hi on the table's scan pool, one cursor per range
+ * between the root's separator keys. The sink runs on the calling thread, in id
+ * order when ordered is set and otherwise in whatever order ranges finish chunks.
+ * Partitions and their chunks come from the calling thread's statement arena.
+ */
+void table_parallel_scan(Table *table, uint id_lo, uint id_hi, bool ordered, RowSink sink, void *context) {
+    if (id_lo > id_hi) {
+        return;
+    }
+    TableGuard guard(table);
+    size_t mark = arena_mark(&statement_arena);
+    ParallelScan scan;
+    scan.table = table;
+    scan.cancelled = false;
+    uint num_workers = table->scan_pool->workers.size();
+    scan_partition_ranges(&scan, id_lo, id_hi, num_workers * SCAN_PARTITIONS_PER_WORKER);
+    uint num_partitions = scan.num_partitions;
+    scan.num_running = num_partitions;
+    for (uint i = 0; i < num_partitions; i++) {
+        thread_pool_submit(table->scan_pool, [&scan, i] { scan_partition(&scan, i); });
+    }
+
+    std::unique_lock<std::mutex> lock(scan.mutex);
+    uint current = 0;
+    bool stopped = false;
+    while (!stopped) {
+        ScanPartition *source = nullptr;
+        if (ordered) {
+            ScanPartition *partition = &scan.partitions[current];
+            while (current < num_partitions && partition->done && partition->produced == partition->consumed) {
+                partition = &scan.partitions[++current];
+            }
+            if (current == num_partitions) {
+                break;
+            }
+            if (partition->produced > partition->consumed) {
+                source = partition;
+            }
+        } else {
+            for (uint i = 0; i < num_partitions && source == nullptr; i++) {
+                ScanPartition *partition = &scan.partitions[(current + i) % num_partitions];
+                if (partition->produced > partition->consumed) {
+                    source = partition;
+                    current = (current + i + 1) % num_partitions;
+                }
+            }
+            if (source == nullptr && scan.num_running == 0) {
+                break;
+            }
+        }
+        if (source == nullptr) {
+            scan.changed.wait(lock);
+            continue;
+        }
+        lock.unlock();
+        ScanChunk *chunk = &source->chunks[source->consumed % SCAN_QUEUE_CHUNKS];
+        for (uint i = 0; i < chunk->num_rows && !stopped; i++) {
+            stopped = !sink(&chunk->rows[i], context);
+        }
+        lock.lock();
+        // hand the chunk back to its worker
+        source->consumed++;
+        scan.changed.notify_all();
+    }
+
+    // the workers reference scan: stop them and wait before it goes out of scope
+    scan.cancelled = true;
+    scan.changed.notify_all();
+    scan.changed.wait(lock, [&scan] { return scan.num_running == 0; });
+    lock.unlock();
+    arena_release(&statement_arena, mark);
+}
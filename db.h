@@ -6,11 +6,20 @@
 #ifndef DB_TUTORIAL_DB_H
 #define DB_TUTORIAL_DB_H
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/types.h>
 
 struct InputBuffer {
     char *buffer;
@@ -33,6 +42,7 @@ typedef enum {
 typedef enum {
     STATEMENT_INSERT,
     STATEMENT_SELECT,
+    STATEMENT_DELETE,
 } StatementType;
 
 #define COLUMN_USERNAME_SIZE 32
@@ -43,24 +53,410 @@ struct Row {
     char email[COLUMN_EMAIL_SIZE + 1];
 };
 
+/**
+ * a parallel scan splits the key range between the scan pool's workers; ordered
+ * output still comes back in id order, unordered as the workers produce it
+ */
+typedef enum {
+    SCAN_SERIAL,
+    SCAN_PARALLEL_ORDERED,
+    SCAN_PARALLEL_UNORDERED,
+} ScanMode;
+
+/**
+ * how a select writes its rows: "(id username email)" lines, CSV with quoting
+ * as in RFC 4180, tab separated with backslash escapes, or binary records of a
+ * 32-bit length followed by the row in its serialized layout
+ */
+typedef enum {
+    OUTPUT_TABLE,
+    OUTPUT_CSV,
+    OUTPUT_TSV,
+    OUTPUT_BINARY,
+} OutputFormat;
+
+/**
+ * the field a "?" placeholder of a prepared statement stands for
+ */
+typedef enum {
+    PARAM_ID,
+    PARAM_USERNAME,
+    PARAM_EMAIL,
+    PARAM_ID_EQUALS,
+    PARAM_ID_LO,
+    PARAM_ID_HI,
+    PARAM_LIMIT,
+    PARAM_OFFSET,
+    PARAM_INDEX_KEY,
+} StatementParam;
+
+/**
+ * the columns with a secondary index
+ */
+typedef enum {
+    INDEX_USERNAME,
+    INDEX_EMAIL,
+} IndexColumn;
+
+#define NUM_INDEXES 2
+
+#define MAX_STATEMENT_PARAMS 4
+
+/**
+ * a select returns rows with id_lo <= id <= id_hi in id order, at most limit of them
+ * after skipping offset, and with by_index only those whose index_column equals
+ * index_key; with count set it returns how many there are instead. A delete removes
+ * the rows with id_lo <= id <= id_hi.
+ * params lists the placeholders of a prepared statement in the order they appear.
+ */
 struct Statement {
     StatementType type;
     Row row_to_insert;
+    uint id_lo;
+    uint id_hi;
+    uint limit;
+    uint offset;
+    bool count;
+    ScanMode scan_mode;
+    bool by_index;
+    IndexColumn index_column;
+    char index_key[COLUMN_EMAIL_SIZE + 1];
+    uint num_params;
+    StatementParam params[MAX_STATEMENT_PARAMS];
 };
 
 const uint PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 100
+const uint INVALID_PAGE_NUM = UINT32_MAX;
+const uint INVALID_FRAME = UINT32_MAX;
+
+/**
+ * number of frames in the buffer pool when the caller does not choose one,
+ * and the least we accept: a split pins a handful of pages at once
+ */
+#define DEFAULT_POOL_FRAMES 1024
+#define MIN_POOL_FRAMES 16
+
+/**
+ * the mmap pager reserves address space for the largest file up front so page
+ * pointers stay valid while the file grows, and grows the file an extent at a time
+ */
+const size_t MMAP_RESERVE_SIZE = (size_t) 64 << 30;
+const uint MMAP_EXTENT_PAGES = 2048;
+
+typedef enum {
+    PAGER_BUFFER_POOL,
+    PAGER_MMAP,
+} PagerMode;
+
+/**
+ * the buffer pool asks for explicit huge pages when it spans at least one,
+ * and for transparent ones when none are reserved
+ */
+const size_t HUGE_PAGE_SIZE = (size_t) 2 << 20;
+
+/**
+ * page latches: readers hold them shared, the writer exclusive. A latched page
+ * is always pinned, and page latches are taken before Pager::mutex, never under it.
+ */
+typedef enum {
+    LATCH_SHARED,
+    LATCH_EXCLUSIVE,
+} LatchMode;
+
+/**
+ * one slot of the buffer pool; the page bytes live in Pager::frame_data
+ */
+struct Frame {
+    uint page_num;
+    uint pin_count;
+    bool referenced;
+    bool dirty;
+    /* being read from disk: other threads wanting the page wait on Pager::loaded */
+    bool loading;
+    /* dirtied by the open transaction: pinned until it commits */
+    bool in_txn;
+    /* end of the log record that last changed the page; the log is flushed past it before write back */
+    uint64_t lsn;
+};
+
+/**
+ * write-ahead log kept next to the database file as <db>-wal. A transaction
+ * appends one record per page it changed, holding only the byte runs that
+ * differ from the page as it was before, then a commit record. Commits wait
+ * for wal_flush: one committer writes and fdatasyncs everything appended so
+ * far while the others wait for it, so concurrent commits share one sync.
+ * The log is replayed by db_open and emptied by each checkpoint.
+ */
+#define DEFAULT_WAL_CHECKPOINT_BYTES ((uint64_t) 16 << 20)
+#define MAX_TXN_PAGES 64
+/* equal bytes shorter than this between two changed runs are logged rather than starting a new run */
+#define WAL_RUN_GAP 16
+
+typedef enum {
+    WAL_PAGE_DELTA = 1,
+    WAL_COMMIT = 2,
+} WalRecordType;
+
+/**
+ * a page delta is followed by length bytes of runs, each a uint16 offset,
+ * a uint16 length and the bytes; checksum is FNV-1a over the other fields and the payload
+ */
+struct WalRecordHeader {
+    uint32_t type;
+    uint32_t page_num;
+    uint32_t length;
+    uint32_t checksum;
+};
+
+struct Wal {
+    int fd;
+    char *path;
+    std::mutex mutex;
+    std::condition_variable flushed;
+    /* records appended since the last flush, starting at buffer_lsn; the spare is being written */
+    char *buffer;
+    size_t buffer_length;
+    size_t buffer_capacity;
+    char *spare;
+    size_t spare_capacity;
+    uint64_t buffer_lsn;
+    /* lsns are byte positions in the log since open; the file holds file_start_lsn onwards */
+    uint64_t file_start_lsn;
+    uint64_t appended_lsn;
+    uint64_t durable_lsn;
+    bool flushing;
+    uint group_commit_us;
+    uint64_t checkpoint_bytes;
+};
+
+/**
+ * scans read the leaves after the current one ahead of the cursor, this many at
+ * a time, through an io_uring when the kernel offers one and otherwise through
+ * READAHEAD_THREADS threads calling pread
+ */
+#define READAHEAD_LEAVES 32
+#define READAHEAD_THREADS 4
+
+/**
+ * reads in flight pin their frames, so read-ahead stops at this share of the
+ * buffer pool and leaves the rest for the pages statements ask for
+ */
+#define READAHEAD_POOL_SHARE 4
+
+/**
+ * compressed files (DbOptions::compress, buffer pool only): each page is LZ
+ * compressed on write and packed into PAGE_SLOT_SIZE slots, taking only as many
+ * as its compressed bytes need; a page that does not shrink is stored as it is.
+ * Slot 0 holds only the magic number, written once; the next two hold alternate
+ * copies of the file header, which points at the page map, the slot and length of every page. pager_sync, close, and
+ * page writes once enough slots wait to be freed, write a new map and then the
+ * older header copy. With the log on, a slot a page moves out of is reused only
+ * once a header no longer refers to it, so the pages the last header points at
+ * stay intact for the log to replay onto. Free slots go to the first pages that
+ * fit in them; .vacuum packs the file again.
+ */
+const uint32_t COMPRESSED_MAGIC = 0x50495a50; /* "PZIP" */
+const uint PAGE_SLOT_SIZE = 512;
+const uint PAGE_MAX_SLOTS = PAGE_SIZE / PAGE_SLOT_SIZE;
+const uint COMPRESSED_HEADER_COPIES = 2;
+const uint COMPRESSED_HEADER_SLOTS = 1 + COMPRESSED_HEADER_COPIES;
+/* the longest output of page_compress */
+const uint PAGE_COMPRESS_BOUND = PAGE_SIZE + PAGE_SIZE / 255 + 16;
+
+/* slot 0 is the magic number, so a page at slot 0 has never been written; a page stored as it is has length PAGE_SIZE */
+struct PageMapEntry {
+    uint32_t slot;
+    uint32_t length;
+};
+
+/* checksum is FNV-1a over the fields before it */
+struct CompressedHeader {
+    uint32_t magic;
+    uint32_t num_pages;
+    uint64_t generation;
+    uint32_t map_slot;
+    uint32_t map_length;
+    uint32_t end_slot;
+    uint32_t checksum;
+};
+
+struct SlotRun {
+    uint32_t slot;
+    uint32_t count;
+};
+
+struct IoRing;
+struct ThreadPool;
 
+/**
+ * the pager is shared by every thread; mutex guards the page table, the frame
+ * descriptors and the file size, and is never held across a page read
+ */
 struct Pager {
+    std::mutex mutex;
+    std::condition_variable loaded;
+    PagerMode mode;
     int fd;
-    uint file_length;
+    off_t file_length;
     uint num_pages;
-    void *pages[TABLE_MAX_PAGES];
+    /* buffer pool; frame_data is one page-aligned mapping of frame_data_size bytes */
+    uint num_frames;
+    char *frame_data;
+    size_t frame_data_size;
+    Frame *frames;
+    uint clock_hand;
+    std::shared_mutex *frame_latches;
+    /* scratch for pager_flush_all, one entry per frame */
+    uint *flush_frames;
+    /* page table: open addressing, page number -> frame index */
+    uint *page_table;
+    uint page_table_mask;
+    /* mmap mode: the file is mapped at map_base for file_length bytes */
+    char *map_base;
+    /* mmap mode latches, allocated an extent at a time */
+    std::shared_mutex **extent_latches;
+    /* read-ahead: one of the two is set in buffer pool mode; readahead_frames are pinned by reads in flight */
+    IoRing *io_ring;
+    ThreadPool *io_pool;
+    uint readahead_frames;
+    /* write-ahead log, null when disabled; txn_before holds each txn page as it was when first dirtied */
+    Wal *wal;
+    bool txn_tracking;
+    uint num_txn_pages;
+    uint txn_pages[MAX_TXN_PAGES];
+    char *txn_before;
+    /* compressed file: page_map has page_map_capacity entries and the file ends at end_slot */
+    bool compressed;
+    PageMapEntry *page_map;
+    uint page_map_capacity;
+    uint end_slot;
+    uint64_t generation;
+    SlotRun map_run;
+    /* set while a log may be replayed onto the pages the header points at, which keeps their slots until the next header */
+    bool keep_header_pages;
+    /* a bit per free slot, where the next allocation starts looking, and runs freed since the last header that it may still refer to */
+    std::vector<uint64_t> free_slots;
+    uint slot_hint;
+    std::vector<SlotRun> pending_slots;
+    /* scratch for pager_write_run */
+    char *compress_buffer;
+};
+
+/**
+ * engine counters and latency histograms. Each thread counts into a block of its
+ * own and readers add the blocks up, so counting never contends; a thread's
+ * counts are kept when it exits. Histograms are log-linear: values below
+ * STATS_SUB_BUCKETS get a bucket each, and every power of two above that is
+ * split into STATS_SUB_BUCKETS equal buckets.
+ */
+typedef enum {
+    STAT_PAGE_HITS,
+    STAT_PAGE_MISSES,
+    STAT_BYTES_READ,
+    STAT_READAHEAD_PAGES,
+    STAT_PAGES_WRITTEN,
+    STAT_BYTES_WRITTEN,
+    STAT_WRITE_NS,
+    STAT_LOG_BYTES_WRITTEN,
+    STAT_LOG_SYNCS,
+    STAT_LEAF_SPLITS,
+    STAT_INTERNAL_SPLITS,
+    STAT_ROOT_SPLITS,
+    STAT_INDEX_SPLITS,
+    NUM_STAT_COUNTERS,
+} StatCounter;
+
+typedef enum {
+    STAT_INSERT_NS,
+    STAT_SELECT_NS,
+    STAT_DELETE_NS,
+    NUM_STAT_HISTOGRAMS,
+} StatHistogram;
+
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_HISTOGRAM_BUCKETS ((64 - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+struct EngineStats {
+    uint64_t counters[NUM_STAT_COUNTERS];
+    uint64_t histogram_sums[NUM_STAT_HISTOGRAMS];
+    uint64_t histogram_maxes[NUM_STAT_HISTOGRAMS];
+    uint64_t histograms[NUM_STAT_HISTOGRAMS][STATS_HISTOGRAM_BUCKETS];
+};
+
+/**
+ * wal turns on the write-ahead log; a leading committer waits group_commit_us
+ * for others to join its sync, and the log is checkpointed into the database
+ * file once it grows past checkpoint_bytes (0 picks the default). scan_threads
+ * sizes the parallel scan pool, 0 meaning one per core. compress creates new
+ * files in the compressed format; an existing file keeps the format it has,
+ * until .vacuum rewrites it. direct_io reads and writes the database file with
+ * O_DIRECT, so pages are cached only in the buffer pool; the log still goes
+ * through the page cache. A compressed file is read and written in slots, so
+ * with direct_io its device must accept PAGE_SLOT_SIZE blocks.
+ */
+struct DbOptions {
+    uint pool_frames;
+    PagerMode pager_mode;
+    bool wal;
+    uint group_commit_us;
+    uint64_t checkpoint_bytes;
+    uint scan_threads;
+    bool compress;
+    bool direct_io;
+};
+
+/**
+ * a fixed set of worker threads running tasks in the order they were submitted
+ */
+#define THREAD_POOL_INITIAL_TASKS 64
+
+/**
+ * tasks is a ring of num_tasks entries starting at task_head
+ */
+struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::function<void()>> tasks;
+    size_t task_head;
+    size_t num_tasks;
+    bool stopping;
 };
 
+/**
+ * deepest tree we build; with 340-way fanout this is far beyond any file size
+ */
+#define MAX_TREE_DEPTH 16
+
+/**
+ * any number of threads may read the table while one writer at a time, holding
+ * writer, changes it. The writer's exclusive page latches are listed in latched.
+ */
 struct Table {
     Pager *pager;
     uint root_page_num;
+    std::mutex writer;
+    /* the rightmost leaf and the internal nodes above it, root first; INVALID_PAGE_NUM until looked up */
+    uint rightmost_leaf_page_num;
+    uint right_spine_depth;
+    uint right_spine[MAX_TREE_DEPTH];
+    uint num_latched;
+    /* a delete also latches one sibling per level */
+    uint latched_pages[2 * (MAX_TREE_DEPTH + 1)];
+    ThreadPool *scan_pool;
+    uint index_root_page_num[NUM_INDEXES];
+    /* where selects write their rows, set by .mode and .output */
+    OutputFormat output_format;
+    int output_fd;
+    /* how the file was opened, so that table_vacuum can reopen it */
+    char *filename;
+    DbOptions options;
+    /* statements run inside a gate that table_vacuum closes while it swaps the file, see table_enter */
+    std::atomic<uint> num_entered;
+    std::atomic<bool> swapping;
+    std::mutex gate_mutex;
+    std::condition_variable gate_changed;
 };
 
 
@@ -69,28 +465,50 @@ struct Table {
 const uint ID_SIZE = size_of_attribute(Row, id);
 const uint USERNAME_SIZE = size_of_attribute(Row, username);
 const uint EMAIL_SIZE = size_of_attribute(Row, email);
-const uint ID_OFFSET = 0;
-const uint USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const uint EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const uint ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+
+/**
+ * serialized row layout: id, username length, email length, then the
+ * string bytes with no padding or terminators
+ */
+const uint ROW_ID_OFFSET = 0;
+const uint ROW_USERNAME_LENGTH_OFFSET = ROW_ID_OFFSET + ID_SIZE;
+const uint ROW_EMAIL_LENGTH_OFFSET = ROW_USERNAME_LENGTH_OFFSET + 1;
+const uint ROW_HEADER_SIZE = ROW_EMAIL_LENGTH_OFFSET + 1;
+const uint ROW_MAX_SIZE = ROW_HEADER_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
 
 enum ExecuteResult {
     EXECUTE_SUCCESS,
     EXECUTE_TABLE_FULL,
     EXECUTE_FAIL,
     EXECUTE_DUPLICATE_KEY,
+    EXECUTE_KEY_OUT_OF_ORDER,
+    EXECUTE_TABLE_NOT_EMPTY,
 };
 
+/**
+ * key is the key at cell_num when the cursor was positioned; a cursor holds no
+ * latch between calls, so it re-seeks to key if a split has moved the row.
+ * Once a scan moves past readahead_key it reads the next leaves ahead.
+ */
 struct Cursor {
     Table *table;
     uint page_num;
     uint cell_num;
     bool end_of_table;
+    uint key;
+    uint readahead_key = 0;
 };
 
+/**
+ * the primary tree, the secondary indexes and the free list each have their
+ * own page types, so a cursor that lands on a reused page can tell
+ */
 typedef enum {
     NODE_INTERNAL,
     NODE_LEAF,
+    NODE_INDEX_INTERNAL,
+    NODE_INDEX_LEAF,
+    NODE_FREE,
 } NodeType;
 
 
@@ -102,9 +520,7 @@ const uint NODE_TYPE_SIZE = sizeof(uint8);
 const uint NODE_TYPE_OFFSET = 0;
 const uint IS_ROOT_SIZE = sizeof(uint8);
 const uint IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-const uint PARENT_POINTER_SIZE = sizeof(uint);
-const uint PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const uint COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+const uint COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE;
 
 /**
  * leaf node header layout
@@ -113,18 +529,29 @@ const uint LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint);
 const uint LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint);
 const uint LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NUM_CELLS_OFFSET;
-const uint LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint LEAF_NODE_HEAP_START_SIZE = sizeof(uint16_t);
+const uint LEAF_NODE_HEAP_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint LEAF_NODE_HEADER_SIZE =
+        COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_HEAP_START_SIZE;
 
 /**
- * leaf node body layout
+ * node bodies start on a 16 byte boundary so the key arrays suit vector loads
+ */
+const uint NODE_BODY_ALIGNMENT = 16;
+
+/**
+ * leaf node body layout (slotted page): the key array, then a slot directory
+ * holding each row's offset in the page, free space, and finally the serialized
+ * rows packed against the end of the page. The heap start in the header is the
+ * offset of the lowest row.
  */
 const uint LEAF_NODE_KEY_SIZE = sizeof(uint);
-//const uint LEAF_NODE_KEY_OFFSET = 0;
-const uint LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-//const uint LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+const uint LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint LEAF_NODE_CELL_OVERHEAD = LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE;
+const uint LEAF_NODE_KEYS_OFFSET = (LEAF_NODE_HEADER_SIZE + NODE_BODY_ALIGNMENT - 1) / NODE_BODY_ALIGNMENT * NODE_BODY_ALIGNMENT;
+const uint LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_KEYS_OFFSET;
+/* upper bound, reached only by rows with empty strings */
+const uint LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_CELL_OVERHEAD + ROW_HEADER_SIZE);
 
 const uint LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
 const uint LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
@@ -136,18 +563,153 @@ const uint INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint);
 const uint INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint);
 const uint INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const uint INTERNAL_NODE_HEADER_SIZE =
-        COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint INTERNAL_NODE_RIGHT_COUNT_SIZE = sizeof(uint);
+const uint INTERNAL_NODE_RIGHT_COUNT_OFFSET = INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE +
+                                       INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_RIGHT_COUNT_SIZE;
 
 /**
- * Internal Node Body Layout
+ * Internal Node Body Layout: all keys in one array, then the children they belong
+ * to, then the number of rows under each child. The right child's count is in the header.
  */
 const uint INTERNAL_NODE_KEY_SIZE = sizeof(uint);
 const uint INTERNAL_NODE_CHILD_SIZE = sizeof(uint);
-const uint INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE;
-const uint INTERNAL_NODE_MAX_CELLS = 3;
+const uint INTERNAL_NODE_COUNT_SIZE = sizeof(uint);
+const uint INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_COUNT_SIZE;
+const uint INTERNAL_NODE_KEYS_OFFSET =
+        (INTERNAL_NODE_HEADER_SIZE + NODE_BODY_ALIGNMENT - 1) / NODE_BODY_ALIGNMENT * NODE_BODY_ALIGNMENT;
+const uint INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_KEYS_OFFSET;
+const uint INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+const uint INTERNAL_NODE_CHILDREN_OFFSET = INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE;
+const uint INTERNAL_NODE_COUNTS_OFFSET = INTERNAL_NODE_CHILDREN_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_CHILD_SIZE;
+
+/**
+ * files with a META_MAGIC_V1 meta page have internal nodes of keys and children
+ * only; db_open finds their first leaf through this offset and rebuilds them
+ */
+const uint V1_INTERNAL_NODE_CHILDREN_OFFSET =
+        INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_SPACE_FOR_CELLS / (INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE) * INTERNAL_NODE_KEY_SIZE;
+
+/**
+ * files with no meta page were written in the original layout: the root at page
+ * 0, a parent pointer after the common header, leaves of fixed-size cells (the
+ * key, then the row with both strings at full width) and internal nodes of
+ * (child, key) cells. db_open checks them against these sizes and rebuilds them.
+ */
+const uint V0_COMMON_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + sizeof(uint);
+const uint V0_LEAF_NODE_NUM_CELLS_OFFSET = V0_COMMON_NODE_HEADER_SIZE;
+const uint V0_LEAF_NODE_NEXT_LEAF_OFFSET = V0_LEAF_NODE_NUM_CELLS_OFFSET + sizeof(uint);
+const uint V0_LEAF_NODE_HEADER_SIZE = V0_LEAF_NODE_NEXT_LEAF_OFFSET + sizeof(uint);
+const uint V0_ROW_ID_OFFSET = 0;
+const uint V0_ROW_USERNAME_OFFSET = V0_ROW_ID_OFFSET + sizeof(uint);
+const uint V0_ROW_EMAIL_OFFSET = V0_ROW_USERNAME_OFFSET + COLUMN_USERNAME_SIZE + 1;
+const uint V0_ROW_SIZE = V0_ROW_EMAIL_OFFSET + COLUMN_EMAIL_SIZE + 1;
+const uint V0_LEAF_NODE_VALUE_OFFSET = sizeof(uint);
+const uint V0_LEAF_NODE_CELL_SIZE = V0_LEAF_NODE_VALUE_OFFSET + V0_ROW_SIZE;
+const uint V0_LEAF_NODE_MAX_CELLS = (PAGE_SIZE - V0_LEAF_NODE_HEADER_SIZE) / V0_LEAF_NODE_CELL_SIZE;
+const uint V0_INTERNAL_NODE_NUM_KEYS_OFFSET = V0_COMMON_NODE_HEADER_SIZE;
+const uint V0_INTERNAL_NODE_RIGHT_CHILD_OFFSET = V0_INTERNAL_NODE_NUM_KEYS_OFFSET + sizeof(uint);
+const uint V0_INTERNAL_NODE_HEADER_SIZE = V0_INTERNAL_NODE_RIGHT_CHILD_OFFSET + sizeof(uint);
+const uint V0_INTERNAL_NODE_KEY_OFFSET = sizeof(uint);
+const uint V0_INTERNAL_NODE_CELL_SIZE = V0_INTERNAL_NODE_KEY_OFFSET + sizeof(uint);
+const uint V0_INTERNAL_NODE_MAX_CELLS = (PAGE_SIZE - V0_INTERNAL_NODE_HEADER_SIZE) / V0_INTERNAL_NODE_CELL_SIZE;
+
+/**
+ * a delete that leaves a non-root node below these merges it with a sibling,
+ * or takes cells from the sibling when both do not fit in one page
+ */
+const uint LEAF_NODE_MIN_FILL_BYTES = LEAF_NODE_SPACE_FOR_CELLS / 4;
+const uint INTERNAL_NODE_MIN_KEYS = INTERNAL_NODE_MAX_CELLS / 4;
+
+/**
+ * page 0 of a database file: a magic number, the root pages of the primary
+ * tree and of each secondary index, and the first page of the free list (0 when
+ * it is empty). Files from before the meta page are in the original layout, and
+ * files with META_MAGIC_V1 kept no row counts in internal nodes; db_open
+ * rewrites both through the bulk loader.
+ */
+const uint META_PAGE_NUM = 0;
+const uint32_t META_MAGIC = 0x3254454d; /* "MET2" */
+const uint32_t META_MAGIC_V1 = 0x4154454d; /* "META" */
+const uint META_MAGIC_OFFSET = 0;
+const uint META_ROOT_OFFSET = META_MAGIC_OFFSET + sizeof(uint32_t);
+const uint META_INDEX_ROOTS_OFFSET = META_ROOT_OFFSET + sizeof(uint);
+const uint META_FREE_LIST_OFFSET = META_INDEX_ROOTS_OFFSET + NUM_INDEXES * sizeof(uint);
+
+/**
+ * a page on the free list holds only the number of the next free page
+ */
+const uint FREE_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+/**
+ * secondary index node layout (slotted page): entries are a row's id, the key
+ * length and the key bytes, ordered by key and then id. A leaf cell is an entry;
+ * an internal cell is a child page number followed by the largest entry under it.
+ * The link is the next leaf in a leaf and the rightmost child in an internal node.
+ */
+const uint INDEX_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint INDEX_NODE_LINK_OFFSET = INDEX_NODE_NUM_CELLS_OFFSET + sizeof(uint16_t);
+const uint INDEX_NODE_HEAP_START_OFFSET = INDEX_NODE_LINK_OFFSET + sizeof(uint);
+const uint INDEX_NODE_HEADER_SIZE = INDEX_NODE_HEAP_START_OFFSET + sizeof(uint16_t);
+const uint INDEX_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint INDEX_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INDEX_NODE_HEADER_SIZE;
+const uint INDEX_ENTRY_ID_OFFSET = 0;
+const uint INDEX_ENTRY_KEY_LENGTH_OFFSET = INDEX_ENTRY_ID_OFFSET + sizeof(uint);
+const uint INDEX_ENTRY_KEY_OFFSET = INDEX_ENTRY_KEY_LENGTH_OFFSET + sizeof(uint8_t);
+const uint INDEX_CELL_CHILD_SIZE = sizeof(uint);
+const uint INDEX_MAX_CELL_SIZE = INDEX_CELL_CHILD_SIZE + INDEX_ENTRY_KEY_OFFSET + COLUMN_EMAIL_SIZE;
+/* upper bound, reached only by empty keys in a leaf */
+const uint INDEX_NODE_MAX_CELLS = INDEX_NODE_SPACE_FOR_CELLS / (INDEX_NODE_SLOT_SIZE + INDEX_ENTRY_KEY_OFFSET);
+
+/**
+ * internal nodes from the root down to a leaf's parent
+ */
+struct TreePath {
+    uint depth;
+    uint page_num[MAX_TREE_DEPTH];
+};
+#define DEFAULT_BULK_LOAD_FILL 0.9
 
-Table *db_open(const char *filename);
+/**
+ * builds a tree bottom-up from rows arriving in ascending id order. Leaves are
+ * packed to the fill factor (a share of the page's bytes) and linked as they are written, and each level keeps
+ * one open node that receives the (page, max key) of every finished node below it.
+ * The secondary indexes are filled in by bulk_load_finish, walking the leaves from the first.
+ * The caller holds Table::writer from bulk_load_begin until it finishes or aborts.
+ */
+struct BulkLoader {
+    Table *table;
+    uint leaf_fill_bytes;
+    uint internal_target;
+    uint first_leaf_page_num;
+    uint leaf_page_num;
+    void *leaf;
+    uint last_key;
+    uint num_rows;
+    uint num_levels;
+    uint level_page_num[MAX_TREE_DEPTH];
+    uint level_right_max[MAX_TREE_DEPTH];
+};
+
+Table *db_open(const char *filename, const DbOptions *options = nullptr);
+
+void *get_page(Pager *pager, uint page_num);
+
+void unpin_page(Pager *pager, uint page_num);
+
+void *latch_page(Pager *pager, uint page_num, LatchMode mode);
+
+void unlatch_page(Pager *pager, uint page_num, LatchMode mode);
+
+void mark_page_dirty(Pager *pager, uint page_num);
+
+void pager_flush_all(Pager *pager);
+
+void pager_prefetch(Pager *pager, const uint *page_nums, uint count);
+
+void pager_commit(Pager *pager);
+
+void pager_checkpoint(Pager *pager);
 
 InputBuffer *new_input_buffer();
 
@@ -160,9 +722,64 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table);
 PrepareResult prepare_statement(InputBuffer *input_buffer,
                                 Statement *statement);
 
+PrepareResult prepare_parameterized(InputBuffer *input_buffer, Statement *statement);
+
+PrepareResult statement_bind_id(Statement *statement, uint index, uint value);
+
+PrepareResult statement_bind_text(Statement *statement, uint index, const char *value);
+
 ExecuteResult execute_statement(Statement *statement, Table *table);
 
+ExecuteResult execute_select(Statement *statement, Table *table);
+
+ExecuteResult table_insert(Table *table, const Row *row);
+
+ExecuteResult table_delete(Table *table, uint id_lo, uint id_hi, uint *num_deleted);
+
+bool table_get(Table *table, uint id, Row *row);
+
+Cursor table_seek(Table *table, uint key);
+
+uint table_num_rows(Table *table);
+
+uint table_rank(Table *table, uint key);
+
+Cursor table_seek_rank(Table *table, uint rank);
+
+uint table_count(Table *table, uint id_lo, uint id_hi);
+
+bool cursor_next_row(Cursor *cursor, uint id_hi, Row *row);
+
 void db_close(Table *table);
 
+/**
+ * receives the rows of a parallel scan on the calling thread; returning false ends the scan
+ */
+typedef bool (*RowSink)(const Row *row, void *context);
+
+void table_parallel_scan(Table *table, uint id_lo, uint id_hi, bool ordered, RowSink sink, void *context);
+
+ExecuteResult table_select(Table *table, const Statement *statement, RowSink sink, void *context);
+
+ExecuteResult table_count_rows(Table *table, const Statement *statement, uint *num_rows);
+
+ExecuteResult bulk_load_begin(Table *table, double fill_factor, BulkLoader *loader);
+
+ExecuteResult bulk_load_add(BulkLoader *loader, const Row *row);
+
+void bulk_load_finish(BulkLoader *loader);
+
+void bulk_load_abort(BulkLoader *loader);
+
+void table_vacuum(Table *table, double fill_factor);
+
+void stats_snapshot(EngineStats *stats);
+
+void stats_reset();
+
+void stats_print(FILE *out);
+
+void stats_print_json(FILE *out);
+
 
 #endif //DB_TUTORIAL_DB_H
\ No newline at end of file
@@ -0,0 +1,36 @@
+//
+// Library interface: the parts of db_api.h that are not inline.
+//
+
+#include "db_api.h"
+
+namespace db {
+
+Iterator::Iterator(::Table *table, uint id_lo, uint id_hi)
+        : cursor(table_seek(table, id_lo)), id_hi(id_hi) {
+    has_row = cursor_next_row(&cursor, id_hi, &row);
+}
+
+
+Iterator::Iterator(const Cursor &cursor, uint id_hi) : cursor(cursor), id_hi(id_hi) {
+    has_row = cursor_next_row(&this->cursor, id_hi, &row);
+}
+
+
+Iterator &Iterator::operator++() {
+    has_row = has_row && cursor_next_row(&cursor, id_hi, &row);
+    return *this;
+}
+
+
+PreparedStatement::PreparedStatement(::Table *table, const char *sql) : table(table), statement{} {
+    // parsing tokenizes in place, so it works on a copy
+    size_t length = strlen(sql);
+    char *copy = (char *) malloc(length + 1);
+    memcpy(copy, sql, length + 1);
+    InputBuffer buffer{copy, length + 1};
+    prepared = prepare_parameterized(&buffer, &statement);
+    free(copy);
+}
+
+}
@@ -0,0 +1,209 @@
+//
+// Library interface for applications that link the database in: handles over
+// the functions in db.h that skip the REPL's text parsing and printing.
+//
+
+#ifndef DB_TUTORIAL_DB_API_H
+#define DB_TUTORIAL_DB_API_H
+
+#include "db.h"
+#include <iterator>
+#include <type_traits>
+
+namespace db {
+
+/**
+ * walks rows with id_lo <= id <= id_hi in id order. Like the cursor under it, it
+ * holds no latch between rows, so it may stay open while other threads insert.
+ */
+class Iterator {
+public:
+    Iterator(::Table *table, uint id_lo, uint id_hi);
+
+    /* starts at a cursor from table_seek or table_seek_rank */
+    Iterator(const Cursor &cursor, uint id_hi);
+
+    bool valid() const { return has_row; }
+
+    const Row &operator*() const { return row; }
+
+    const Row *operator->() const { return &row; }
+
+    Iterator &operator++();
+
+    bool operator==(std::default_sentinel_t) const { return !has_row; }
+
+private:
+    Cursor cursor;
+    uint id_hi;
+    Row row;
+    bool has_row;
+};
+
+struct Range {
+    ::Table *table;
+    uint id_lo;
+    uint id_hi;
+
+    Iterator begin() const { return Iterator(table, id_lo, id_hi); }
+
+    std::default_sentinel_t end() const { return {}; }
+};
+
+/**
+ * calls on_row for each row; an on_row that returns bool stops the rows by returning false
+ */
+template<typename F>
+bool call_row(F &on_row, const Row &row) {
+    if constexpr (std::is_void_v<std::invoke_result_t<F &, const Row &>>) {
+        on_row(row);
+        return true;
+    } else {
+        return on_row(row);
+    }
+}
+
+template<typename F>
+bool row_sink(const Row *row, void *context) {
+    return call_row(*static_cast<F *>(context), *row);
+}
+
+/**
+ * a statement parsed once with "?" placeholders, then bound and executed any
+ * number of times: "insert ? ? ?", "select where id between ? and ? limit ? offset ?",
+ * "select count(*) where id between ? and ?", "delete where id = ?".
+ * Placeholders are numbered from 0 in the order they appear, and keep their
+ * values between executions.
+ */
+class PreparedStatement {
+public:
+    PreparedStatement(::Table *table, const char *sql);
+
+    /* PREPARE_SUCCESS, or why the text did not parse */
+    PrepareResult status() const { return prepared; }
+
+    PrepareResult bind(uint index, uint value) { return statement_bind_id(&statement, index, value); }
+
+    PrepareResult bind(uint index, const char *value) { return statement_bind_text(&statement, index, value); }
+
+    /* runs an insert or a delete, or a select whose rows are dropped */
+    ExecuteResult execute() {
+        return execute([](const Row &) {});
+    }
+
+    /* runs the statement, handing each row a select returns to on_row on this thread; a select count(*) runs through count() */
+    template<typename F>
+    ExecuteResult execute(F &&on_row) {
+        if (prepared != PREPARE_SUCCESS || statement.count) {
+            return EXECUTE_FAIL;
+        }
+        if (statement.type == STATEMENT_INSERT) {
+            return table_insert(table, &statement.row_to_insert);
+        }
+        if (statement.type == STATEMENT_DELETE) {
+            return table_delete(table, statement.id_lo, statement.id_hi, nullptr);
+        }
+        return table_select(table, &statement, row_sink<std::remove_reference_t<F>>, (void *) &on_row);
+    }
+
+    /* the number of rows a select, or a select count(*), matches after its offset and up to its limit */
+    ExecuteResult count(uint *num_rows) {
+        if (prepared != PREPARE_SUCCESS || statement.type != STATEMENT_SELECT) {
+            return EXECUTE_FAIL;
+        }
+        return table_count_rows(table, &statement, num_rows);
+    }
+
+private:
+    ::Table *table;
+    Statement statement;
+    PrepareResult prepared;
+};
+
+/**
+ * the table of an open Database; a cheap handle that is valid while the Database is.
+ * Any number of threads may use it at once.
+ */
+class Table {
+public:
+    explicit Table(::Table *table) : table(table) {}
+
+    ExecuteResult insert(const Row &row) { return table_insert(table, &row); }
+
+    /* deletes the rows with id_lo <= id <= id_hi and returns how many there were */
+    uint erase(uint id_lo, uint id_hi) {
+        uint num_deleted;
+        table_delete(table, id_lo, id_hi, &num_deleted);
+        return num_deleted;
+    }
+
+    bool erase(uint id) { return erase(id, id) == 1; }
+
+    /* copies the row with this id into row, if there is one */
+    bool get(uint id, Row *row) const { return table_get(table, id, row); }
+
+    Iterator seek(uint id_lo, uint id_hi = UINT32_MAX) const { return Iterator(table, id_lo, id_hi); }
+
+    /* the row at position in id order, counting from 0, and those after it; at(size() / 2) starts at the median */
+    Iterator at(uint position) const { return Iterator(table_seek_rank(table, position), UINT32_MAX); }
+
+    /* the number of rows, and of rows with id_lo <= id <= id_hi, from the internal nodes' row counts */
+    uint size() const { return table_num_rows(table); }
+
+    uint count(uint id_lo, uint id_hi) const { return table_count(table, id_lo, id_hi); }
+
+    /* the number of rows with a smaller id, which is the position of the row with this id */
+    uint rank(uint id) const { return table_rank(table, id); }
+
+    /* for (const Row &row: table.range(lo, hi)) */
+    Range range(uint id_lo = 0, uint id_hi = UINT32_MAX) const { return Range{table, id_lo, id_hi}; }
+
+    template<typename F>
+    void scan(uint id_lo, uint id_hi, F &&on_row) const {
+        for (Iterator it(table, id_lo, id_hi); it.valid(); ++it) {
+            if (!call_row(on_row, *it)) {
+                break;
+            }
+        }
+    }
+
+    PreparedStatement prepare(const char *sql) const { return PreparedStatement(table, sql); }
+
+    /* rewrites the file in key order, see table_vacuum */
+    void vacuum(double fill_factor = DEFAULT_BULK_LOAD_FILL) { table_vacuum(table, fill_factor); }
+
+    ::Table *raw() const { return table; }
+
+private:
+    ::Table *table;
+};
+
+/**
+ * opens a database file for the lifetime of the object and closes it, checkpointing, on destruction
+ */
+class Database {
+public:
+    explicit Database(const char *filename, const DbOptions *options = nullptr)
+            : handle(db_open(filename, options)) {}
+
+    ~Database() {
+        if (handle != nullptr) {
+            db_close(handle);
+        }
+    }
+
+    Database(const Database &) = delete;
+
+    Database &operator=(const Database &) = delete;
+
+    Database(Database &&other) noexcept: handle(other.handle) { other.handle = nullptr; }
+
+    Table table() const { return Table(handle); }
+
+private:
+    ::Table *handle;
+};
+
+}
+
+#endif //DB_TUTORIAL_DB_API_H
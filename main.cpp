@@ -2,12 +2,32 @@
 
 
 int main(int argc, const char *argv[]) {
-    if (argc < 2) {
+    DbOptions options{DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, false, 0, 0, 0, false, false};
+    const char *filename = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--pool-frames") == 0 && i + 1 < argc) {
+            options.pool_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.pager_mode = PAGER_MMAP;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            options.wal = true;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            options.direct_io = true;
+        } else if (strcmp(argv[i], "--group-commit-us") == 0 && i + 1 < argc) {
+            options.group_commit_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+            options.scan_threads = atoi(argv[++i]);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == nullptr) {
         printf("Must supply a database filename\n");
         return 0;
     }
-    const char *filename = argv[1];
-    Table *table = db_open(filename);
+    Table *table = db_open(filename, &options);
     InputBuffer *input_buffer = new_input_buffer();
     while (true) {
         print_prompt();
@@ -27,16 +47,16 @@ int main(int argc, const char *argv[]) {
                 break;
             case PREPARE_UNRECOGNIZED_STATEMENT:
                 printf("Unrecognized keyword at start of %s\n", input_buffer->buffer);
-                break;
+                continue;
             case PREPARE_SYNTAX_ERROR:
                 printf("Syntax error. Could not parse statement\n");
-                break;
+                continue;
             case PREPARE_STRING_TOO_LONG:
                 printf("String is too long\n");
-                break;
+                continue;
             case PREPARE_NEGATIVE_ID:
                 printf("ID must be positive\n");
-                break;
+                continue;
         }
         switch (execute_statement(&statement, table)) {
             case (EXECUTE_SUCCESS):
@@ -50,6 +70,12 @@ int main(int argc, const char *argv[]) {
             case EXECUTE_DUPLICATE_KEY:
                 printf("Error: Duplicate key.\n");
                 break;
+            case EXECUTE_KEY_OUT_OF_ORDER:
+                printf("Error: Key out of order.\n");
+                break;
+            case EXECUTE_TABLE_NOT_EMPTY:
+                printf("Error: Table not empty.\n");
+                break;
         }
     }
 }
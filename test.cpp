@@ -2,6 +2,594 @@
 // Created by Wind on 11/4/2021.
 //
 #include "db.h"
+#include "db_api.h"
+#include <atomic>
+#include <climits>
+#include <sys/wait.h>
+
+/* glibc's own allocator, wrapped below so that the test can count every allocation */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *memory, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *memory);
+}
+
+std::atomic<bool> counting{false};
+std::atomic<uint64_t> num_allocations{0};
+
+extern "C" {
+void *malloc(size_t size) {
+    if (counting.load(std::memory_order_relaxed)) num_allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (counting.load(std::memory_order_relaxed)) num_allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *memory, size_t size) {
+    if (counting.load(std::memory_order_relaxed)) num_allocations++;
+    return __libc_realloc(memory, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (counting.load(std::memory_order_relaxed)) num_allocations++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memory, size_t alignment, size_t size) {
+    if (counting.load(std::memory_order_relaxed)) num_allocations++;
+    *memory = __libc_memalign(alignment, size);
+    return *memory == nullptr ? ENOMEM : 0;
+}
+
+void free(void *memory) {
+    __libc_free(memory);
+}
+}
+
+
+void insert_rows(Table *table, uint first, uint last) {
+    Statement statement{};
+    statement.type = STATEMENT_INSERT;
+    for (uint i = first; i <= last; ++i) {
+        statement.row_to_insert.id = i;
+        sprintf(statement.row_to_insert.username, "user%u", i);
+        sprintf(statement.row_to_insert.email, "user%u@email.com", i);
+        execute_statement(&statement, table);
+    }
+}
+
+
+void select_rows(Table *table, uint id_lo, uint id_hi, uint limit) {
+    Statement statement{};
+    statement.type = STATEMENT_SELECT;
+    statement.id_lo = id_lo;
+    statement.id_hi = id_hi;
+    statement.limit = limit;
+    for (ScanMode mode: {SCAN_SERIAL, SCAN_PARALLEL_ORDERED, SCAN_PARALLEL_UNORDERED}) {
+        statement.scan_mode = mode;
+        execute_statement(&statement, table);
+    }
+}
+
+
+/**
+ * once the tree, the buffer pool and the statement arena have warmed up,
+ * inserts and selects must not touch the heap. The selected rows go to /dev/null.
+ */
+void check_steady_state(Table *table) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1) {
+        printf("Unable to open /dev/null\n");
+        exit(EXIT_FAILURE);
+    }
+    int saved_fd = table->output_fd;
+    table->output_fd = null_fd;
+    insert_rows(table, 31, 1000);
+    select_rows(table, 500, 540, UINT32_MAX);
+    select_rows(table, 0, UINT32_MAX, 5);
+
+    counting = true;
+    insert_rows(table, 1001, 3000);
+    counting = false;
+    uint64_t insert_allocations = num_allocations.exchange(0);
+
+    select_rows(table, 0, UINT32_MAX, UINT32_MAX);
+    counting = true;
+    select_rows(table, 2500, 2540, UINT32_MAX);
+    select_rows(table, 0, UINT32_MAX, 5);
+    select_rows(table, 0, UINT32_MAX, UINT32_MAX);
+    counting = false;
+    uint64_t select_allocations = num_allocations.exchange(0);
+    table->output_fd = saved_fd;
+    close(null_fd);
+
+    printf("Steady-state allocations: %lu in inserts, %lu in selects\n",
+           (unsigned long) insert_allocations, (unsigned long) select_allocations);
+    if (insert_allocations != 0 || select_allocations != 0) {
+        printf("FAILED: statement execution allocated\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * with rows 1 to 3000 in the table, counts, ranks and positions read from the
+ * internal nodes' row counts must agree with the ids
+ */
+void check_order_statistics(Table *table) {
+    bool correct = table_num_rows(table) == 3000 && table_count(table, 100, 199) == 100 &&
+                   table_count(table, 2990, UINT32_MAX) == 11 && table_rank(table, 1500) == 1499;
+    for (uint rank: {0u, 1234u, 2999u}) {
+        Cursor cursor = table_seek_rank(table, rank);
+        correct = correct && !cursor.end_of_table && cursor.key == rank + 1;
+    }
+    correct = correct && table_seek_rank(table, 3000).end_of_table;
+    printf("Order statistics: %s\n", correct ? "ok" : "wrong");
+    if (!correct) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * a child process commits rows with the log on and exits without db_close, so
+ * the rows reach the database file only through the log's replay in db_open
+ */
+void check_wal_recovery(const char *filename) {
+    char path[PATH_MAX];
+    char wal_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-recovery", filename);
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", path);
+    unlink(path);
+    unlink(wal_path);
+    DbOptions options{DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, true, 0, 0, 1, false, false};
+    pid_t child = fork();
+    if (child == 0) {
+        Table *table = db_open(path, &options);
+        insert_rows(table, 1, 500);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    bool correct = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS && access(wal_path, F_OK) == 0;
+
+    Table *table = db_open(path, &options);
+    correct = correct && table_num_rows(table) == 500;
+    Row row;
+    char username[COLUMN_USERNAME_SIZE + 1];
+    for (uint id = 1; id <= 500 && correct; id++) {
+        snprintf(username, sizeof(username), "user%u", id);
+        correct = table_get(table, id, &row) && strcmp(row.username, username) == 0;
+    }
+    db_close(table);
+    unlink(path);
+    unlink(wal_path);
+    printf("WAL recovery: %s\n", correct ? "ok" : "wrong");
+    if (!correct) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * the table must hold rows 1 to last in id order, less those in [gap_lo, gap_hi),
+ * and its row counts must agree
+ */
+bool table_holds(Table *table, uint last, uint gap_lo, uint gap_hi) {
+    uint expected = gap_lo == 1 ? gap_hi : 1;
+    bool correct = true;
+    Cursor cursor = table_seek(table, 0);
+    Row row;
+    char username[COLUMN_USERNAME_SIZE + 1];
+    while (correct && cursor_next_row(&cursor, UINT32_MAX, &row)) {
+        snprintf(username, sizeof(username), "user%u", expected);
+        correct = row.id == expected && strcmp(row.username, username) == 0;
+        expected = expected + 1 == gap_lo ? gap_hi : expected + 1;
+    }
+    uint num_rows = last - (gap_hi - gap_lo);
+    return correct && expected == last + 1 && table_num_rows(table) == num_rows &&
+           table_count(table, 0, UINT32_MAX) == num_rows;
+}
+
+
+bool count_row(const Row *, void *context) {
+    (*(uint *) context)++;
+    return true;
+}
+
+
+/**
+ * how many rows the username index finds for user<id>
+ */
+uint username_matches(Table *table, uint id) {
+    Statement statement{};
+    statement.type = STATEMENT_SELECT;
+    statement.id_lo = 0;
+    statement.id_hi = UINT32_MAX;
+    statement.limit = UINT32_MAX;
+    statement.by_index = true;
+    statement.index_column = INDEX_USERNAME;
+    sprintf(statement.index_key, "user%u", id);
+    uint count = 0;
+    table_select(table, &statement, count_row, &count);
+    return count;
+}
+
+
+/**
+ * deleting most of a three-level tree merges leaves and internal nodes and finally
+ * collapses the root to a leaf; scans, counts and the username index must follow,
+ * and rows inserted after a delete must go into the freed pages
+ */
+void check_deletes(const char *filename) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-deletes", filename);
+    unlink(path);
+    DbOptions options{DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, false, 0, 0, 1, false, false};
+    Table *table = db_open(path, &options);
+    insert_rows(table, 1, 60000);
+
+    uint num_deleted = 0;
+    table_delete(table, 1001, 59000, &num_deleted);
+    bool correct = num_deleted == 58000 && table_holds(table, 60000, 1001, 59001) &&
+                   username_matches(table, 1000) == 1 && username_matches(table, 30000) == 0 &&
+                   username_matches(table, 59001) == 1;
+
+    uint num_pages = table->pager->num_pages;
+    insert_rows(table, 1001, 30000);
+    correct = correct && table->pager->num_pages == num_pages &&
+              table_holds(table, 60000, 30001, 59001) && username_matches(table, 30000) == 1;
+
+    table_delete(table, 1, 59990, &num_deleted);
+    void *root = get_page(table->pager, table->root_page_num);
+    correct = correct && *((uint8_t *) root + NODE_TYPE_OFFSET) == NODE_LEAF;
+    unpin_page(table->pager, table->root_page_num);
+    correct = correct && table_holds(table, 60000, 1, 59991) && username_matches(table, 29999) == 0;
+    db_close(table);
+
+    table = db_open(path, &options);
+    correct = correct && table_holds(table, 60000, 1, 59991) && username_matches(table, 60000) == 1;
+    db_close(table);
+    unlink(path);
+    printf("Deletes: %s\n", correct ? "ok" : "wrong");
+    if (!correct) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+const uint ORIGINAL_FORMAT_PAGES = 3;
+
+/**
+ * fills pages with a file as the original layout wrote it: an internal root at
+ * page 0 over two leaves holding rows 1 to last
+ */
+void original_format_pages(char (*pages)[PAGE_SIZE], uint last) {
+    memset(pages, 0, ORIGINAL_FORMAT_PAGES * PAGE_SIZE);
+    uint split = V0_LEAF_NODE_MAX_CELLS;
+    uint num_keys = 1;
+    uint left = 1;
+    uint right = 2;
+    char *root = pages[0];
+    root[NODE_TYPE_OFFSET] = NODE_INTERNAL;
+    root[IS_ROOT_OFFSET] = 1;
+    memcpy(root + V0_INTERNAL_NODE_NUM_KEYS_OFFSET, &num_keys, sizeof(uint));
+    memcpy(root + V0_INTERNAL_NODE_RIGHT_CHILD_OFFSET, &right, sizeof(uint));
+    memcpy(root + V0_INTERNAL_NODE_HEADER_SIZE, &left, sizeof(uint));
+    memcpy(root + V0_INTERNAL_NODE_HEADER_SIZE + V0_INTERNAL_NODE_KEY_OFFSET, &split, sizeof(uint));
+
+    for (uint page_num = left; page_num <= right; page_num++) {
+        char *leaf = pages[page_num];
+        uint first = page_num == left ? 1 : split + 1;
+        uint num_cells = page_num == left ? split : last - split;
+        uint next_leaf = page_num == left ? right : 0;
+        leaf[NODE_TYPE_OFFSET] = NODE_LEAF;
+        memcpy(leaf + V0_LEAF_NODE_NUM_CELLS_OFFSET, &num_cells, sizeof(uint));
+        memcpy(leaf + V0_LEAF_NODE_NEXT_LEAF_OFFSET, &next_leaf, sizeof(uint));
+        for (uint i = 0; i < num_cells; i++) {
+            char *cell = leaf + V0_LEAF_NODE_HEADER_SIZE + i * V0_LEAF_NODE_CELL_SIZE;
+            char *value = cell + V0_LEAF_NODE_VALUE_OFFSET;
+            uint id = first + i;
+            memcpy(cell, &id, sizeof(uint));
+            memcpy(value + V0_ROW_ID_OFFSET, &id, sizeof(uint));
+            snprintf(value + V0_ROW_USERNAME_OFFSET, COLUMN_USERNAME_SIZE + 1, "user%u", id);
+            snprintf(value + V0_ROW_EMAIL_OFFSET, COLUMN_EMAIL_SIZE + 1, "user%u@email.com", id);
+        }
+    }
+}
+
+
+void write_file(const char *path, const void *data, size_t length) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || write(fd, data, length) != (ssize_t) length) {
+        printf("Unable to write %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+
+/**
+ * a file from before the meta page is rebuilt by db_open with all its rows and
+ * indexes, and stays that way when reopened; one that does not fit the original
+ * layout makes db_open exit and is left as it was
+ */
+void check_original_format(const char *filename) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-original", filename);
+    DbOptions options{MIN_POOL_FRAMES, PAGER_BUFFER_POOL, false, 0, 0, 1, false, false};
+    char pages[ORIGINAL_FORMAT_PAGES][PAGE_SIZE];
+    uint last = V0_LEAF_NODE_MAX_CELLS + 7;
+    original_format_pages(pages, last);
+    // a row stored under another row's key
+    uint id = 5;
+    memcpy(pages[2] + V0_LEAF_NODE_HEADER_SIZE + V0_LEAF_NODE_VALUE_OFFSET + V0_ROW_ID_OFFSET, &id, sizeof(uint));
+    write_file(path, pages, sizeof(pages));
+    pid_t child = fork();
+    if (child == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        db_open(path, &options);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    char contents[ORIGINAL_FORMAT_PAGES][PAGE_SIZE];
+    int fd = open(path, O_RDONLY);
+    bool correct = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE && fd != -1 &&
+                   read(fd, contents, sizeof(contents)) == (ssize_t) sizeof(contents) &&
+                   memcmp(contents, pages, sizeof(pages)) == 0 && lseek(fd, 0, SEEK_END) == sizeof(pages);
+    if (fd != -1) {
+        close(fd);
+    }
+
+    original_format_pages(pages, last);
+    write_file(path, pages, sizeof(pages));
+    for (int i = 0; i < 2 && correct; i++) {
+        Table *table = db_open(path, &options);
+        Row row;
+        char email[COLUMN_EMAIL_SIZE + 1];
+        snprintf(email, sizeof(email), "user%u@email.com", last);
+        correct = table_holds(table, last, last + 1, last + 1) && username_matches(table, last) == 1 &&
+                  table_get(table, last, &row) && strcmp(row.email, email) == 0;
+        db_close(table);
+    }
+    unlink(path);
+    printf("Original format: %s\n", correct ? "ok" : "wrong");
+    if (!correct) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * whether the table's leaves, followed from the first along their links, are
+ * more than one and in ascending page order
+ */
+bool leaves_ascend(Table *table) {
+    Pager *pager = table->pager;
+    uint page_num = table->root_page_num;
+    char *node = (char *) get_page(pager, page_num);
+    while (node[NODE_TYPE_OFFSET] == NODE_INTERNAL) {
+        uint num_keys;
+        uint child_page_num;
+        memcpy(&num_keys, node + INTERNAL_NODE_NUM_KEYS_OFFSET, sizeof(uint));
+        memcpy(&child_page_num, node + (num_keys > 0 ? INTERNAL_NODE_CHILDREN_OFFSET : INTERNAL_NODE_RIGHT_CHILD_OFFSET),
+               sizeof(uint));
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+        node = (char *) get_page(pager, page_num);
+    }
+
+    bool ascending = true;
+    uint num_leaves = 1;
+    while (true) {
+        uint next_page_num;
+        memcpy(&next_page_num, node + LEAF_NODE_NEXT_LEAF_OFFSET, sizeof(uint));
+        unpin_page(pager, page_num);
+        if (next_page_num == 0) {
+            break;
+        }
+        ascending = ascending && next_page_num > page_num;
+        page_num = next_page_num;
+        node = (char *) get_page(pager, page_num);
+        num_leaves++;
+    }
+    return ascending && num_leaves > 1;
+}
+
+
+/**
+ * vacuuming a table whose lower ids went in last, with most rows deleted, keeps
+ * the rows, counts and username index, lays the leaves out in key order in a
+ * smaller file, and stays that way when reopened
+ */
+void check_vacuum(const char *filename) {
+    char path[PATH_MAX];
+    char wal_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-vacuum-check", filename);
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", path);
+    unlink(path);
+    unlink(wal_path);
+    DbOptions options{DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, true, 0, 0, 1, false, false};
+    Table *table = db_open(path, &options);
+    insert_rows(table, 10001, 20000);
+    insert_rows(table, 1, 10000);
+    uint num_deleted = 0;
+    table_delete(table, 2001, 15000, &num_deleted);
+    bool correct = num_deleted == 13000 && !leaves_ascend(table);
+
+    uint num_pages = table->pager->num_pages;
+    table_vacuum(table, DEFAULT_BULK_LOAD_FILL);
+    for (int i = 0; i < 2 && correct; i++) {
+        correct = table_holds(table, 20000, 2001, 15001) && username_matches(table, 2000) == 1 &&
+                  username_matches(table, 2001) == 0 && username_matches(table, 15001) == 1 &&
+                  leaves_ascend(table) && table->pager->num_pages < num_pages;
+        db_close(table);
+        table = db_open(path, &options);
+    }
+    db_close(table);
+    unlink(path);
+    unlink(wal_path);
+    printf("Vacuum: %s\n", correct ? "ok" : "wrong");
+    if (!correct) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * a compressed file written through a buffer pool small enough that pages are
+ * evicted, and so compressed and moved between slots, over and over, holds every
+ * row when reopened, with the log off and on
+ */
+void check_compressed(const char *filename) {
+    char path[PATH_MAX];
+    char wal_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-compressed", filename);
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", path);
+    bool correct = true;
+    for (int wal = 0; wal < 2 && correct; wal++) {
+        unlink(path);
+        unlink(wal_path);
+        DbOptions options{MIN_POOL_FRAMES, PAGER_BUFFER_POOL, wal == 1, 0, 0, 1, true, false};
+        Table *table = db_open(path, &options);
+        insert_rows(table, 1, 20000);
+        uint num_deleted = 0;
+        table_delete(table, 5001, 6000, &num_deleted);
+        uint num_pages = table->pager->num_pages;
+        correct = num_deleted == 1000 && table->pager->compressed;
+        db_close(table);
+
+        int fd = open(path, O_RDONLY);
+        uint32_t magic = 0;
+        correct = correct && fd != -1 && read(fd, &magic, sizeof(magic)) == sizeof(magic) &&
+                  magic == COMPRESSED_MAGIC && lseek(fd, 0, SEEK_END) < (off_t) num_pages * PAGE_SIZE;
+        if (fd != -1) {
+            close(fd);
+        }
+
+        table = db_open(path, &options);
+        Row row;
+        char email[COLUMN_EMAIL_SIZE + 1];
+        correct = correct && table->pager->compressed && table_holds(table, 20000, 5001, 6001);
+        for (uint id = 1; id <= 20000 && correct; id++) {
+            snprintf(email, sizeof(email), "user%u@email.com", id);
+            correct = id >= 5001 && id <= 6000 ? !table_get(table, id, &row)
+                                               : table_get(table, id, &row) && strcmp(row.email, email) == 0;
+        }
+        db_close(table);
+    }
+    unlink(path);
+    unlink(wal_path);
+    printf("Compressed pages: %s\n", correct ? "ok" : "wrong");
+    if (!correct) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * the C++ interface over a Database's table: inserts and gets, scans with a
+ * void and with a bool callback, range-for, and each kind of prepared statement
+ * bound and executed twice
+ */
+void check_library_api(const char *filename) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s-api", filename);
+    unlink(path);
+    DbOptions options{DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, false, 0, 0, 1, false, false};
+    bool correct = true;
+    {
+        db::Database database(path, &options);
+        db::Table table = database.table();
+        Row row{};
+        for (uint id = 1; id <= 100; id++) {
+            row.id = id;
+            snprintf(row.username, sizeof(row.username), "user%u", id);
+            snprintf(row.email, sizeof(row.email), "user%u@email.com", id);
+            correct = correct && table.insert(row) == EXECUTE_SUCCESS;
+        }
+        correct = correct && table.insert(row) == EXECUTE_DUPLICATE_KEY &&
+                  table.get(50, &row) && strcmp(row.username, "user50") == 0 && !table.get(101, &row);
+
+        uint sum = 0;
+        table.scan(10, 19, [&sum](const Row &scanned) { sum += scanned.id; });
+        uint num_scanned = 0;
+        table.scan(1, 100, [&num_scanned](const Row &scanned) {
+            num_scanned++;
+            return scanned.id < 5;
+        });
+        uint expected = 90;
+        for (const Row &ranged: table.range(90)) {
+            correct = correct && ranged.id == expected++;
+        }
+        correct = correct && sum == 145 && num_scanned == 5 && expected == 101;
+
+        db::PreparedStatement insert = table.prepare("insert ? ? ?");
+        char username[COLUMN_USERNAME_SIZE + 1];
+        char email[COLUMN_EMAIL_SIZE + 1];
+        for (uint id = 101; id <= 102; id++) {
+            snprintf(username, sizeof(username), "user%u", id);
+            snprintf(email, sizeof(email), "user%u@email.com", id);
+            correct = correct && insert.bind(0, id) == PREPARE_SUCCESS && insert.bind(1, username) == PREPARE_SUCCESS &&
+                      insert.bind(2, email) == PREPARE_SUCCESS && insert.execute() == EXECUTE_SUCCESS;
+        }
+
+        // ids 11 to 13, then 95 to 102
+        db::PreparedStatement select = table.prepare("select where id between ? and ? limit ? offset ?");
+        uint selects[2][4] = {{1, 100, 3, 10}, {95, 200, 10, 0}};
+        uint first[2] = {11, 95};
+        uint last[2] = {13, 102};
+        for (uint i = 0; i < 2; i++) {
+            expected = first[i];
+            for (uint param = 0; param < 4; param++) {
+                correct = correct && select.bind(param, selects[i][param]) == PREPARE_SUCCESS;
+            }
+            bool rows_correct = true;
+            ExecuteResult result = select.execute([&](const Row &selected) {
+                snprintf(username, sizeof(username), "user%u", expected);
+                rows_correct = rows_correct && selected.id == expected++ && strcmp(selected.username, username) == 0;
+            });
+            correct = correct && result == EXECUTE_SUCCESS && rows_correct && expected == last[i] + 1;
+        }
+
+        db::PreparedStatement count = table.prepare("select count(*) where id between ? and ?");
+        uint num_rows = 0;
+        correct = correct && count.bind(0, 1) == PREPARE_SUCCESS && count.bind(1, 50) == PREPARE_SUCCESS &&
+                  count.count(&num_rows) == EXECUTE_SUCCESS && num_rows == 50;
+        correct = correct && count.bind(0, 51) == PREPARE_SUCCESS && count.bind(1, 200) == PREPARE_SUCCESS &&
+                  count.count(&num_rows) == EXECUTE_SUCCESS && num_rows == 52;
+
+        db::PreparedStatement erase = table.prepare("delete where id = ?");
+        for (uint id = 7; id <= 8; id++) {
+            correct = correct && erase.bind(0, id) == PREPARE_SUCCESS && erase.execute() == EXECUTE_SUCCESS &&
+                      !table.get(id, &row);
+        }
+        correct = correct && insert.status() == PREPARE_SUCCESS && select.status() == PREPARE_SUCCESS &&
+                  count.status() == PREPARE_SUCCESS && erase.status() == PREPARE_SUCCESS &&
+                  table.size() == 100 && table.count(1, 10) == 8;
+    }
+
+    {
+        db::Database database(path, &options);
+        db::Table table = database.table();
+        Row row;
+        correct = correct && table.size() == 100 && !table.get(7, &row) &&
+                  table.get(102, &row) && strcmp(row.email, "user102@email.com") == 0;
+    }
+    unlink(path);
+    printf("Library API: %s\n", correct ? "ok" : "wrong");
+    if (!correct) {
+        exit(EXIT_FAILURE);
+    }
+}
 
 
 int main(int argc, const char *argv[]) {
@@ -10,7 +598,15 @@ int main(int argc, const char *argv[]) {
         return 0;
     }
     const char *filename = argv[1];
-    Table *table = db_open(filename);
+    // these fork, so they run before this process starts any threads
+    check_wal_recovery(filename);
+    check_original_format(filename);
+    check_deletes(filename);
+    check_vacuum(filename);
+    check_compressed(filename);
+    check_library_api(filename);
+    DbOptions options{DEFAULT_POOL_FRAMES, PAGER_BUFFER_POOL, true, 0, 0, 4, false, false};
+    Table *table = db_open(filename, &options);
     Statement statement{};
     for (int i = 0; i < 30; ++i) {
         statement.row_to_insert.id = i + 1;
@@ -20,8 +616,13 @@ int main(int argc, const char *argv[]) {
         execute_statement(&statement, table);
     }
     statement.type = STATEMENT_SELECT;
+    statement.id_lo = 0;
+    statement.id_hi = UINT32_MAX;
+    statement.limit = UINT32_MAX;
     execute_statement(&statement, table);
+    check_steady_state(table);
+    check_order_statistics(table);
     printf("Bye~\n");
     db_close(table);
     return 0;
-}
\ No newline at end of file
+}